@@ -0,0 +1,992 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "actor.h"
+#include "memory.h"
+#include "metrics.h"
+#include "object.h"
+#include "program.h"
+#include "vm.h"
+
+/**
+ * @brief A value copied out of one VM, to be copied into another.
+ * Messages belong to no VM, so they are allocated with malloc.
+ */
+typedef struct Message
+{
+    _Atomic(struct Message*) next;
+    int length;
+    uint8_t* bytes;
+} Message;
+
+/**
+ * @brief A lock-free queue of messages, which any number of threads
+ * send to and only the thread running its actor receives from.
+ * Messages are linked from the oldest (tail) to the newest (head),
+ * after a stub message which keeps the queue from ever being empty.
+ */
+typedef struct
+{
+    _Atomic(Message*) head;
+    Message* tail;
+    Message stub;
+} Mailbox;
+
+typedef enum
+{
+    ACTOR_IDLE,      // Waiting for a message.
+    ACTOR_SCHEDULED, // In a run queue.
+    ACTOR_RUNNING,
+    ACTOR_DONE
+} ActorState;
+
+/**
+ * @brief An isolated VM running a fiber body, which only communicates
+ * with others through messages. Actors are run by a pool of threads,
+ * one at a time, on whichever thread is free.
+ * Other VMs may refer to an actor for as long as they exist, so an
+ * actor is never freed, but its VM is freed once its body finishes.
+ * @param program The program of the body, until its fiber holds it instead.
+ * @param heapLimit The heap limit of its VM, inherited from its creator.
+ * @param vm The VM while it is not running, or NULL before it first runs.
+ * @param fiber The fiber running the body, in the actor's VM.
+ * @param receiving Whether the fiber is waiting for a message.
+ * @param external Whether the actor stands for a thread outside the pool,
+ * which waits for messages on a condition variable.
+ */
+typedef struct Actor
+{
+    Mailbox mailbox;
+    atomic_int state;
+    Program* program;
+    uint8_t* body;
+    size_t heapLimit;
+    VM* vm;
+    ObjFiber* fiber;
+    bool receiving;
+    bool external;
+    pthread_mutex_t lock;
+    pthread_cond_t arrived;
+} Actor;
+
+/**
+ * @brief A queue of actors ready to run. Each thread of the pool takes
+ * actors from the front of its own queue, and steals from the back of
+ * the others' when its own is empty.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    int head;
+    int count;
+    int capacity;
+    Actor** actors;
+} RunQueue;
+
+static pthread_once_t poolOnce = PTHREAD_ONCE_INIT;
+static int workerCount;
+// A queue for each worker, and one more for threads outside the pool.
+static RunQueue* runQueues;
+static atomic_int runnable = 0;
+static atomic_int sleepers = 0;
+static pthread_mutex_t sleepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+// How many actors are scheduled or running, which waitForActors() waits for.
+static atomic_int busy = 0;
+static pthread_mutex_t quietLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t quiet = PTHREAD_COND_INITIALIZER;
+
+// The index of this thread in the pool, or -1 if it is not in the pool.
+static _Thread_local int workerIndex = -1;
+
+static void initMailbox(Mailbox* mailbox)
+{
+    atomic_init(&mailbox->stub.next, NULL);
+    atomic_init(&mailbox->head, &mailbox->stub);
+    mailbox->tail = &mailbox->stub;
+}
+
+static void pushMessage(Mailbox* mailbox, Message* message)
+{
+    atomic_store_explicit(&message->next, NULL, memory_order_relaxed);
+    Message* previous = atomic_exchange(&mailbox->head, message);
+    atomic_store_explicit(&previous->next, message, memory_order_release);
+}
+
+/**
+ * @brief Take the oldest message from a mailbox.
+ * Only the thread running the mailbox's actor may do this.
+ * @return The message, or NULL if there is none yet.
+ */
+static Message* popMessage(Mailbox* mailbox)
+{
+    Message* tail = mailbox->tail;
+    Message* next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (tail == &mailbox->stub)
+    {
+        if (next == NULL) return NULL;
+        mailbox->tail = next;
+        tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+
+    if (next != NULL)
+    {
+        mailbox->tail = next;
+        return tail;
+    }
+
+    // The tail is the newest message, unless one is being sent right now.
+    if (tail != atomic_load(&mailbox->head)) return NULL;
+
+    // Put the stub back, so that the tail can be taken.
+    pushMessage(mailbox, &mailbox->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next == NULL) return NULL;
+
+    mailbox->tail = next;
+    return tail;
+}
+
+/**
+ * @brief Check if a mailbox has, or is being sent, a message.
+ */
+static bool hasMessage(Mailbox* mailbox)
+{
+    return atomic_load(&mailbox->head) != mailbox->tail;
+}
+
+static void freeMessage(Message* message)
+{
+    free(message->bytes);
+    free(message);
+}
+
+typedef enum
+{
+    TAG_NIL,
+    TAG_TRUE,
+    TAG_FALSE,
+    TAG_INT,
+    TAG_NUMBER,
+    TAG_STRING,
+    TAG_LIST,
+    TAG_ARRAY,
+    TAG_MAP,
+    TAG_ACTOR,
+    // An object which was already copied, by its index in copying order.
+    TAG_REFERENCE
+} MessageTag;
+
+/**
+ * @brief The bytes of a message being written.
+ * @param copied The objects already written, mapped to their indices,
+ * so that shared objects (and cycles) are copied once.
+ */
+typedef struct
+{
+    int count;
+    int capacity;
+    uint8_t* bytes;
+    Table copied;
+    int copiedCount;
+} MessageWriter;
+
+static void writeBytes(MessageWriter* writer, const void* bytes, int count)
+{
+    if (writer->count + count > writer->capacity)
+    {
+        while (writer->count + count > writer->capacity)
+        {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = realloc(writer->bytes, writer->capacity);
+        if (writer->bytes == NULL) exit(1);
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void writeTag(MessageWriter* writer, MessageTag tag)
+{
+    uint8_t byte = (uint8_t)tag;
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeInt(MessageWriter* writer, int32_t value)
+{
+    writeBytes(writer, &value, sizeof(value));
+}
+
+/**
+ * @brief Write a value into a message.
+ * @return False after reporting a runtime error, if the
+ * value is (or contains) one which can not be sent.
+ */
+static bool writeValue(MessageWriter* writer, Value value)
+{
+    switch (value.type)
+    {
+    case VAL_NIL:
+        writeTag(writer, TAG_NIL);
+        return true;
+    case VAL_BOOL:
+        writeTag(writer, AS_BOOL(value) ? TAG_TRUE : TAG_FALSE);
+        return true;
+    case VAL_INT:
+        writeTag(writer, TAG_INT);
+        writeInt(writer, AS_INT(value));
+        return true;
+    case VAL_NUMBER:
+        writeTag(writer, TAG_NUMBER);
+        writeBytes(writer, &value.as.number, sizeof(double));
+        return true;
+    case VAL_UNDEFINED:
+    case VAL_OBJ:
+        break;
+    }
+
+    Value index;
+    if (tableGet(&writer->copied, value, &index))
+    {
+        writeTag(writer, TAG_REFERENCE);
+        writeInt(writer, AS_INT(index));
+        return true;
+    }
+
+    switch (OBJ_TYPE(value))
+    {
+    case OBJ_STRING:
+    {
+        ObjString* string = AS_STRING(value);
+        writeTag(writer, TAG_STRING);
+        writeInt(writer, string->length);
+        writeBytes(writer, string->chars, string->length);
+        break;
+    }
+    case OBJ_LIST:
+    {
+        // Copied before its elements, which may refer back to it.
+        ValueArray* elements = &AS_LIST(value)->elements;
+        tableSet(&writer->copied, value, INT_VAL(writer->copiedCount++));
+        writeTag(writer, TAG_LIST);
+        writeInt(writer, elements->count);
+        for (int i = 0; i < elements->count; i++)
+        {
+            if (!writeValue(writer, elements->values[i])) return false;
+        }
+        return true;
+    }
+    case OBJ_ARRAY:
+    {
+        ObjArray* array = AS_ARRAY(value);
+        writeTag(writer, TAG_ARRAY);
+        writeInt(writer, array->count);
+        writeBytes(writer, array->values, sizeof(double) * array->count);
+        break;
+    }
+    case OBJ_MAP:
+    {
+        ObjMap* map = AS_MAP(value);
+        tableSet(&writer->copied, value, INT_VAL(writer->copiedCount++));
+        writeTag(writer, TAG_MAP);
+        writeInt(writer, map->count);
+        for (int i = 0; i < map->table.capacity; i++)
+        {
+            Entry* entry = &map->table.entries[i];
+            if (IS_UNDEFINED(entry->key)) continue;
+
+            if (!writeValue(writer, entry->key) || !writeValue(writer, entry->value)) return false;
+        }
+        return true;
+    }
+    case OBJ_ACTOR:
+        writeTag(writer, TAG_ACTOR);
+        writeBytes(writer, &AS_ACTOR(value)->actor, sizeof(Actor*));
+        break;
+    default:
+        runtimeError("Can only send nil, booleans, numbers, strings, lists, arrays, maps and actors.");
+        return false;
+    }
+
+    tableSet(&writer->copied, value, INT_VAL(writer->copiedCount++));
+    return true;
+}
+
+/**
+ * @brief Copy a value out of this thread's VM into a new message.
+ * @return The message, or NULL after reporting a runtime error.
+ */
+static Message* newMessage(Value value)
+{
+    MessageWriter writer = {0, 0, NULL, {0}, 0};
+    initTable(&writer.copied);
+
+    bool written = writeValue(&writer, value);
+    freeTable(&writer.copied);
+    if (!written)
+    {
+        free(writer.bytes);
+        return NULL;
+    }
+
+    Message* message = malloc(sizeof(Message));
+    if (message == NULL) exit(1);
+    message->length = writer.count;
+    message->bytes = writer.bytes;
+    return message;
+}
+
+/**
+ * @brief The bytes of a message being read.
+ * @param copied The objects read so far, in the order they were written.
+ */
+typedef struct
+{
+    const uint8_t* current;
+    ValueArray copied;
+} MessageReader;
+
+static void readBytes(MessageReader* reader, void* bytes, int count)
+{
+    memcpy(bytes, reader->current, count);
+    reader->current += count;
+}
+
+static int32_t readInt(MessageReader* reader)
+{
+    int32_t value;
+    readBytes(reader, &value, sizeof(value));
+    return value;
+}
+
+/**
+ * @brief Read a value from a message into objects of this thread's VM.
+ */
+static Value readValue(MessageReader* reader)
+{
+    switch ((MessageTag)*reader->current++)
+    {
+    case TAG_NIL:   return NIL_VAL;
+    case TAG_TRUE:  return BOOL_VAL(true);
+    case TAG_FALSE: return BOOL_VAL(false);
+    case TAG_INT:   return INT_VAL(readInt(reader));
+    case TAG_NUMBER:
+    {
+        double number;
+        readBytes(reader, &number, sizeof(double));
+        return NUMBER_VAL(number);
+    }
+    case TAG_STRING:
+    {
+        int length = readInt(reader);
+        Value string = OBJ_VAL(copyString((const char*)reader->current, length));
+        reader->current += length;
+        writeValueArray(&reader->copied, string);
+        return string;
+    }
+    case TAG_LIST:
+    {
+        ObjList* list = newList();
+        writeValueArray(&reader->copied, OBJ_VAL(list));
+        int count = readInt(reader);
+        for (int i = 0; i < count; i++)
+        {
+            writeValueArray(&list->elements, readValue(reader));
+        }
+        return OBJ_VAL(list);
+    }
+    case TAG_ARRAY:
+    {
+        ObjArray* array = newArray(readInt(reader));
+        readBytes(reader, array->values, sizeof(double) * array->count);
+        writeValueArray(&reader->copied, OBJ_VAL(array));
+        return OBJ_VAL(array);
+    }
+    case TAG_MAP:
+    {
+        ObjMap* map = newMap();
+        writeValueArray(&reader->copied, OBJ_VAL(map));
+        int count = readInt(reader);
+        for (int i = 0; i < count; i++)
+        {
+            Value key = readValue(reader);
+            Value value = readValue(reader);
+            if (tableSet(&map->table, key, value)) map->count++;
+        }
+        return OBJ_VAL(map);
+    }
+    case TAG_ACTOR:
+    {
+        Actor* actor;
+        readBytes(reader, &actor, sizeof(Actor*));
+        Value reference = OBJ_VAL(newActorReference(actor));
+        writeValueArray(&reader->copied, reference);
+        return reference;
+    }
+    case TAG_REFERENCE:
+        return reader->copied.values[readInt(reader)];
+    }
+
+    return NIL_VAL; // Unreachable.
+}
+
+/**
+ * @brief Copy the value of a message into this thread's VM, and free the message.
+ */
+static Value receiveMessage(Message* message)
+{
+    MessageReader reader;
+    reader.current = message->bytes;
+    initValueArray(&reader.copied);
+
+    Value value = readValue(&reader);
+
+    freeValueArray(&reader.copied);
+    freeMessage(message);
+    return value;
+}
+
+static void pushRunQueue(RunQueue* queue, Actor* actor)
+{
+    pthread_mutex_lock(&queue->lock);
+    if (queue->count == queue->capacity)
+    {
+        // Copy the queue to the start of a bigger buffer.
+        int capacity = GROW_CAPACITY(queue->capacity);
+        Actor** actors = malloc(sizeof(Actor*) * capacity);
+        if (actors == NULL) exit(1);
+        for (int i = 0; i < queue->count; i++)
+        {
+            actors[i] = queue->actors[(queue->head + i) % queue->capacity];
+        }
+        free(queue->actors);
+        queue->actors = actors;
+        queue->capacity = capacity;
+        queue->head = 0;
+    }
+
+    queue->actors[(queue->head + queue->count) % queue->capacity] = actor;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+/**
+ * @brief Take an actor from the front or the back of a queue.
+ * @return The actor, or NULL if the queue is empty.
+ */
+static Actor* popRunQueue(RunQueue* queue, bool front)
+{
+    pthread_mutex_lock(&queue->lock);
+    Actor* actor = NULL;
+    if (queue->count > 0)
+    {
+        queue->count--;
+        if (front)
+        {
+            actor = queue->actors[queue->head];
+            queue->head = (queue->head + 1) % queue->capacity;
+        }
+        else
+        {
+            actor = queue->actors[(queue->head + queue->count) % queue->capacity];
+        }
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return actor;
+}
+
+/**
+ * @brief Queue an actor to run, on this thread if it is in the pool.
+ * The actor must have been made ACTOR_SCHEDULED by the caller.
+ */
+static void schedule(Actor* actor)
+{
+    pushRunQueue(&runQueues[workerIndex >= 0 ? workerIndex : workerCount], actor);
+
+    atomic_fetch_add(&runnable, 1);
+    if (atomic_load(&sleepers) > 0)
+    {
+        pthread_mutex_lock(&sleepLock);
+        pthread_cond_signal(&wake);
+        pthread_mutex_unlock(&sleepLock);
+    }
+}
+
+/**
+ * @brief Take an actor to run: the oldest in this thread's own queue,
+ * or else the newest in another queue.
+ * @return The actor, or NULL if every queue is empty.
+ */
+static Actor* takeWork()
+{
+    Actor* actor = popRunQueue(&runQueues[workerIndex], true);
+    for (int i = 1; actor == NULL && i <= workerCount; i++)
+    {
+        actor = popRunQueue(&runQueues[(workerIndex + i) % (workerCount + 1)], false);
+    }
+
+    if (actor != NULL) atomic_fetch_sub(&runnable, 1);
+    return actor;
+}
+
+/**
+ * @brief Count an actor as busy, before it is scheduled.
+ */
+static void startBusy()
+{
+    atomic_fetch_add(&busy, 1);
+}
+
+/**
+ * @brief Stop counting an actor as busy, once it is idle or done.
+ */
+static void endBusy()
+{
+    if (atomic_fetch_sub(&busy, 1) == 1)
+    {
+        pthread_mutex_lock(&quietLock);
+        pthread_cond_broadcast(&quiet);
+        pthread_mutex_unlock(&quietLock);
+    }
+}
+
+/**
+ * @brief Schedule an idle actor, unless another thread already has.
+ */
+static void wakeActor(Actor* actor)
+{
+    // Counted first, so that the count can't drop to zero meanwhile.
+    startBusy();
+    int idle = ACTOR_IDLE;
+    if (atomic_compare_exchange_strong(&actor->state, &idle, ACTOR_SCHEDULED))
+    {
+        schedule(actor);
+    }
+    else
+    {
+        endBusy();
+    }
+}
+
+/**
+ * @brief Wait until every actor has finished, or is waiting for a message
+ * with none in its mailbox, so that none will ever run again unless sent
+ * a message by this thread. The process should do this before exiting,
+ * so that it does not end actors halfway.
+ */
+void waitForActors()
+{
+    pthread_mutex_lock(&quietLock);
+    while (atomic_load(&busy) > 0)
+    {
+        pthread_cond_wait(&quiet, &quietLock);
+    }
+    pthread_mutex_unlock(&quietLock);
+}
+
+/**
+ * @brief Free the messages in the mailbox of an actor which has finished.
+ * @return Whether one of them was a given message.
+ */
+static bool drainMailbox(Actor* actor, Message* sent)
+{
+    bool found = false;
+
+    // Senders drain the mailbox too, so only one thread may at a time.
+    pthread_mutex_lock(&actor->lock);
+    while (true)
+    {
+        Message* message = popMessage(&actor->mailbox);
+        if (message == NULL)
+        {
+            // A message being sent right now is only a moment away.
+            if (!hasMessage(&actor->mailbox)) break;
+            continue;
+        }
+
+        if (message == sent) found = true;
+        freeMessage(message);
+    }
+    pthread_mutex_unlock(&actor->lock);
+    return found;
+}
+
+/**
+ * @brief Make this thread's VM the actor's, saving the thread's.
+ */
+static void saveActor(Actor* actor)
+{
+    if (actor->vm == NULL)
+    {
+        actor->vm = malloc(sizeof(VM));
+        if (actor->vm == NULL) exit(1);
+    }
+    *actor->vm = vm;
+}
+
+/**
+ * @brief Put an actor aside until it is sent a message.
+ */
+static void parkActor(Actor* actor)
+{
+    saveActor(actor);
+    atomic_store(&actor->state, ACTOR_IDLE);
+
+    // A message sent meanwhile may have seen the actor still running.
+    if (hasMessage(&actor->mailbox)) wakeActor(actor);
+    endBusy();
+}
+
+/**
+ * @brief Free an actor's VM and messages once its body has finished.
+ */
+static void finishActor(Actor* actor)
+{
+    freeVM();
+    free(actor->vm);
+    actor->vm = NULL;
+    atomic_store(&actor->state, ACTOR_DONE);
+
+    drainMailbox(actor, NULL);
+    endBusy();
+}
+
+/**
+ * @brief Run an actor on this thread until it waits for a message,
+ * yields or finishes. Yielding lets the other actors run first.
+ */
+static void runActor(Actor* actor)
+{
+    atomic_store(&actor->state, ACTOR_RUNNING);
+
+    if (actor->vm == NULL)
+    {
+        initVM();
+        vm.actor = actor;
+        vm.heapLimit = actor->heapLimit;
+    }
+    else
+    {
+        // The stack is part of the VM, so pointers into it are moved along.
+        vm = *actor->vm;
+        vm.slots = vm.stack;
+        vm.stackTop = vm.stack;
+    }
+
+    jmp_buf handler;
+    if (setjmp(handler) != 0)
+    {
+        // Reaching the heap limit ends the actor, like any runtime error.
+        if (actor->program != NULL)
+        {
+            releaseProgram(actor->program);
+            actor->program = NULL;
+        }
+        finishActor(actor);
+        return;
+    }
+    vm.outOfMemory = &handler;
+
+    // Loading the body allocates, so it happens under the handler.
+    if (actor->fiber == NULL)
+    {
+        loadProgram(actor->program);
+        actor->fiber = newFiber(actor->program, actor->body);
+        releaseProgram(actor->program);
+        actor->program = NULL;
+    }
+
+    ObjFiber* fiber = actor->fiber;
+    while (true)
+    {
+        if (actor->receiving)
+        {
+            Message* message = popMessage(&actor->mailbox);
+            if (message == NULL)
+            {
+                parkActor(actor);
+                return;
+            }
+
+            // The message replaces the nil receive() returned.
+            fiber->stackTop[-1] = receiveMessage(message);
+            fiber->state = FIBER_SUSPENDED;
+            actor->receiving = false;
+        }
+
+        Value yielded;
+        bool resumed = resumeFiber(fiber, &yielded);
+        publishMetrics();
+        if (!resumed || fiber->state == FIBER_DONE)
+        {
+            finishActor(actor);
+            return;
+        }
+
+        if (fiber->state == FIBER_SUSPENDED)
+        {
+            saveActor(actor);
+            atomic_store(&actor->state, ACTOR_SCHEDULED);
+            schedule(actor);
+            return;
+        }
+    }
+}
+
+static void* runWorker(void* index)
+{
+    workerIndex = (int)(intptr_t)index;
+
+    while (true)
+    {
+        Actor* actor = takeWork();
+        if (actor != NULL)
+        {
+            runActor(actor);
+            continue;
+        }
+
+        pthread_mutex_lock(&sleepLock);
+        atomic_fetch_add(&sleepers, 1);
+        while (atomic_load(&runnable) == 0)
+        {
+            pthread_cond_wait(&wake, &sleepLock);
+        }
+        atomic_fetch_sub(&sleepers, 1);
+        pthread_mutex_unlock(&sleepLock);
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start a thread for each core, which run actors until the process exits.
+ */
+static void startPool()
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    workerCount = cores > 0 ? (int)cores : 1;
+
+    runQueues = malloc(sizeof(RunQueue) * (workerCount + 1));
+    if (runQueues == NULL) exit(1);
+    for (int i = 0; i <= workerCount; i++)
+    {
+        pthread_mutex_init(&runQueues[i].lock, NULL);
+        runQueues[i].head = 0;
+        runQueues[i].count = 0;
+        runQueues[i].capacity = 0;
+        runQueues[i].actors = NULL;
+    }
+
+    for (int i = 0; i < workerCount; i++)
+    {
+        pthread_t thread;
+        pthread_create(&thread, NULL, runWorker, (void*)(intptr_t)i);
+        pthread_detach(thread);
+    }
+}
+
+static Actor* newActor(bool external)
+{
+    Actor* actor = malloc(sizeof(Actor));
+    if (actor == NULL) exit(1);
+
+    initMailbox(&actor->mailbox);
+    atomic_init(&actor->state, external ? ACTOR_RUNNING : ACTOR_SCHEDULED);
+    actor->program = NULL;
+    actor->body = NULL;
+    actor->heapLimit = 0;
+    actor->vm = NULL;
+    actor->fiber = NULL;
+    actor->receiving = false;
+    actor->external = external;
+    pthread_mutex_init(&actor->lock, NULL);
+    pthread_cond_init(&actor->arrived, NULL);
+    return actor;
+}
+
+/**
+ * @brief Get the actor of this thread's VM, making one
+ * to stand for the thread if it has none yet.
+ */
+static Actor* currentActor()
+{
+    if (vm.actor == NULL) vm.actor = newActor(true);
+    return vm.actor;
+}
+
+/**
+ * @brief Check if the running code is an actor's body,
+ * which waits for I/O like the script itself would.
+ */
+bool inActorBody()
+{
+    return vm.actor != NULL && vm.fiber != NULL && vm.fiber == vm.actor->fiber;
+}
+
+/**
+ * @brief Get an actor argument.
+ * @return False after reporting a runtime error.
+ */
+static bool actorArgument(Value arg, Actor** actor)
+{
+    if (!IS_ACTOR(arg))
+    {
+        runtimeError("Expected an actor.");
+        return false;
+    }
+
+    *actor = AS_ACTOR(arg)->actor;
+    return true;
+}
+
+/**
+ * @brief actor(fiber) starts an actor running the body of a fiber,
+ * from the start, in a VM of its own, and returns the actor.
+ * The actor shares no globals or objects with its creator.
+ */
+static bool actorNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (!IS_FIBER(args[0]))
+    {
+        runtimeError("Expected a fiber.");
+        return false;
+    }
+
+    ObjFiber* fiber = AS_FIBER(args[0]);
+
+    pthread_once(&poolOnce, startPool);
+
+    Actor* actor = newActor(false);
+    actor->program = retainProgram(fiber->program);
+    actor->body = fiber->body;
+    actor->heapLimit = vm.heapLimit;
+    startBusy();
+    schedule(actor);
+
+    *result = OBJ_VAL(newActorReference(actor));
+    return true;
+}
+
+/**
+ * @brief send(actor, value) copies a value into an actor's mailbox.
+ * It returns false if the actor has finished, and true otherwise.
+ */
+static bool sendNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Actor* actor;
+    if (!actorArgument(args[0], &actor)) return false;
+
+    if (atomic_load(&actor->state) == ACTOR_DONE)
+    {
+        *result = BOOL_VAL(false);
+        return true;
+    }
+
+    Message* message = newMessage(args[1]);
+    if (message == NULL) return false;
+    pushMessage(&actor->mailbox, message);
+
+    if (actor->external)
+    {
+        pthread_mutex_lock(&actor->lock);
+        pthread_cond_signal(&actor->arrived);
+        pthread_mutex_unlock(&actor->lock);
+    }
+    else if (atomic_load(&actor->state) == ACTOR_DONE)
+    {
+        // The actor finished while the message was being sent, and may
+        // have freed its mailbox before the message was in it.
+        *result = BOOL_VAL(!drainMailbox(actor, message));
+        return true;
+    }
+    else
+    {
+        wakeActor(actor);
+    }
+
+    *result = BOOL_VAL(true);
+    return true;
+}
+
+/**
+ * @brief receive() returns the oldest message sent to the running actor,
+ * waiting for one if there is none. An actor's body waits without keeping
+ * its thread busy; anything else blocks its thread until one arrives.
+ */
+static bool receiveNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    Actor* actor = currentActor();
+    if (!actor->external && !inActorBody())
+    {
+        runtimeError("Can only receive in an actor's body.");
+        return false;
+    }
+
+    Message* message = popMessage(&actor->mailbox);
+    if (message != NULL)
+    {
+        *result = receiveMessage(message);
+        return true;
+    }
+
+    if (!actor->external)
+    {
+        // The actor's thread resumes it once a message arrives.
+        actor->receiving = true;
+        vm.fiber->state = FIBER_WAITING;
+        *result = NIL_VAL;
+        return true;
+    }
+
+    // A message may be a long time coming, so what was done so far is counted now.
+    if (metricsEnabled) publishMetrics();
+
+    pthread_mutex_lock(&actor->lock);
+    while ((message = popMessage(&actor->mailbox)) == NULL)
+    {
+        // A message being sent right now is only a moment away.
+        if (!hasMessage(&actor->mailbox)) pthread_cond_wait(&actor->arrived, &actor->lock);
+    }
+    pthread_mutex_unlock(&actor->lock);
+
+    *result = receiveMessage(message);
+    return true;
+}
+
+/**
+ * @brief self() returns the running actor, which for code not
+ * in an actor stands for the thread running it.
+ */
+static bool selfNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    *result = OBJ_VAL(newActorReference(currentActor()));
+    return true;
+}
+
+/**
+ * @brief Define the natives for actors as globals of this thread's VM.
+ */
+void defineActorNatives()
+{
+    defineNative("actor", 1, actorNative);
+    defineNative("send", 2, sendNative);
+    defineNative("receive", 0, receiveNative);
+    defineNative("self", 0, selfNative);
+}
@@ -0,0 +1,10 @@
+#ifndef CLOX_ACTOR_H
+#define CLOX_ACTOR_H
+
+#include "common.h"
+
+bool inActorBody();
+void waitForActors();
+void defineActorNatives();
+
+#endif
@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
 #include "memory.h"
@@ -34,8 +35,9 @@ static inline void addLineData(ChunkLines* lines, int lineNumber)
         {
             // Not enough space in the allocated array. Grow the array to make room.
             int oldCapacity = lines->capacity;
-            lines->capacity = GROW_CAPACITY(oldCapacity);
-            lines->data = GROW_ARRAY(ChunkLineData, lines->data, oldCapacity, lines->capacity);
+            int capacity = GROW_CAPACITY(oldCapacity);
+            lines->data = GROW_ARRAY(ChunkLineData, lines->data, oldCapacity, capacity);
+            lines->capacity = capacity;
         }
 
         ChunkLineData* lineData = &lines->data[lines->count];
@@ -61,6 +63,7 @@ void initChunk(Chunk* chunk)
     chunk->code = NULL;
     initChunkLines(&chunk->lines);
     initValueArray(&chunk->constants);
+    chunk->maxStack = 0;
 }
 
 /**
@@ -84,8 +87,9 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line)
         // Not enough space in the allocated array of the chunk.
         // Grow the array to make room.
         int oldCapacity = chunk->capacity;
-        chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, capacity);
+        chunk->capacity = capacity;
     }
 
     chunk->code[chunk->count] = byte;
@@ -104,6 +108,85 @@ int addConstant(Chunk* chunk, Value value)
     return index;
 }
 
+/**
+ * @brief Find a constant which is the same value, of the same type, as another.
+ * Unlike valuesEqual(), an int and an equal double are different constants.
+ * @return The index of the constant, or -1 if there is none.
+ */
+int findConstant(Chunk* chunk, Value value)
+{
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        Value constant = chunk->constants.values[i];
+        if (constant.type != value.type) continue;
+
+        switch (value.type)
+        {
+        case VAL_BOOL:
+            if (AS_BOOL(constant) == AS_BOOL(value)) return i;
+            break;
+        case VAL_NUMBER:
+            // Compared bit by bit, so that -0 and 0 differ and NaN is itself.
+            if (memcmp(&constant.as.number, &value.as.number, sizeof(double)) == 0) return i;
+            break;
+        case VAL_INT:
+            if (AS_INT(constant) == AS_INT(value)) return i;
+            break;
+        case VAL_OBJ:
+            if (AS_OBJ(constant) == AS_OBJ(value)) return i;
+            break;
+        case VAL_NIL:
+        case VAL_UNDEFINED:
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Append the code of another chunk to a chunk, with its line information.
+ * The code is copied as it is, so its constant operands still refer to
+ * the other chunk's constants.
+ */
+void appendChunk(Chunk* chunk, Chunk* other)
+{
+    if (chunk->count + other->count > chunk->capacity)
+    {
+        int oldCapacity = chunk->capacity;
+        int capacity = oldCapacity;
+        while (chunk->count + other->count > capacity)
+        {
+            capacity = GROW_CAPACITY(capacity);
+        }
+        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, capacity);
+        chunk->capacity = capacity;
+    }
+
+    memcpy(chunk->code + chunk->count, other->code, other->count);
+    chunk->count += other->count;
+
+    ChunkLines* lines = &chunk->lines;
+    for (int i = 0; i < other->lines.count; i++)
+    {
+        ChunkLineData* data = &other->lines.data[i];
+        if (lines->count > 0 && lines->data[lines->count - 1].number == data->number)
+        {
+            lines->data[lines->count - 1].count += data->count;
+            continue;
+        }
+
+        if (lines->count == lines->capacity)
+        {
+            int oldCapacity = lines->capacity;
+            int capacity = GROW_CAPACITY(oldCapacity);
+            lines->data = GROW_ARRAY(ChunkLineData, lines->data, oldCapacity, capacity);
+            lines->capacity = capacity;
+        }
+        lines->data[lines->count++] = *data;
+    }
+}
+
 /**
  * @brief Get the Line number of an instruction.
  * @param chunk The instruction's chunk.
@@ -134,3 +217,30 @@ int getLine(Chunk* chunk, int offset)
 
     return chunk->lines.data[lineIndex].number;
 }
+
+/**
+ * @brief Get the size of an instruction in bytes, including its operands.
+ */
+int instructionSize(uint8_t instruction)
+{
+    switch (instruction)
+    {
+    case OP_CONSTANT:
+    case OP_INT8:
+    case OP_POPN:
+    case OP_CONCAT_N:
+    case OP_CALL:
+    case OP_BUILD_LIST:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+        return 2;
+    case OP_INT16:
+    case OP_FIBER:
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+        return 3;
+    default:
+        return 1;
+    }
+}
@@ -4,27 +4,74 @@
 #include "common.h"
 #include "value.h"
 
+// How deeply fiber bodies may be nested in one another.
+#define FIBER_NESTING_MAX 16
+
 /**
  * @brief Operation codes.
  */
 typedef enum
 {
     OP_CONSTANT,
+    OP_INT8,
+    OP_INT16,
     OP_NIL,
     OP_TRUE,
     OP_FALSE,
     OP_POP,
+    OP_POPN,
+    OP_GET_LOCAL,
+    OP_SET_LOCAL,
+    OP_DEFINE_GLOBAL,
+    OP_GET_GLOBAL,
+    OP_SET_GLOBAL,
     OP_EQUAL,
+    OP_NOT_EQUAL,
     OP_GREATER,
+    OP_GREATER_EQUAL,
     OP_LESS,
+    OP_LESS_EQUAL,
     OP_ADD,
     OP_SUBTRACT,
     OP_MULTIPLY,
     OP_DIVIDE,
+    OP_CONCAT_N,
+    OP_CALL,
+    OP_BUILD_LIST,
+    OP_GET_INDEX,
+    OP_SET_INDEX,
+    OP_FIBER,
+    OP_YIELD,
+    OP_END_FIBER,
     OP_NOT,
     OP_NEGATE,
     OP_PRINT,
-    OP_RETURN
+    OP_RETURN,
+
+    // Quickened instructions. The VM rewrites a generic instruction
+    // into one of these after seeing its operand types. If the types
+    // ever differ, an integer instruction is widened by rewriting it
+    // back, while any other settles on a generic form for good.
+    // The compiler emits OP_ADD_STR itself for additions it knows
+    // to join strings.
+    OP_GREATER_NUM,
+    OP_GREATER_EQUAL_NUM,
+    OP_LESS_NUM,
+    OP_LESS_EQUAL_NUM,
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_INT,
+    OP_GREATER_EQUAL_INT,
+    OP_LESS_INT,
+    OP_LESS_EQUAL_INT,
+    OP_ADD_INT,
+    OP_SUBTRACT_INT,
+    OP_MULTIPLY_INT,
+    // An addition seen with both numbers and strings, never quickened again.
+    OP_ADD_ANY
 } OpCode;
 
 typedef struct
@@ -45,6 +92,8 @@ typedef struct
 
 /**
  * @brief A chunk of bytecode instructions.
+ * @param maxStack The deepest the value stack gets while running
+ * the chunk. Only known once the chunk has been verified.
  */
 typedef struct
 {
@@ -53,13 +102,17 @@ typedef struct
     uint8_t* code;
     ChunkLines lines;
     ValueArray constants;
+    int maxStack;
 } Chunk;
 
 void initChunk(Chunk* chunk);
 void freeChunk(Chunk* chunk);
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 int addConstant(Chunk* chunk, Value value);
+int findConstant(Chunk* chunk, Value value);
+void appendChunk(Chunk* chunk, Chunk* other);
 
 int getLine(Chunk* chunk, int offset);
+int instructionSize(uint8_t instruction);
 
 #endif
@@ -5,6 +5,8 @@
 #include <stddef.h>
 #include <stdint.h>
 
+#define UINT8_COUNT (UINT8_MAX + 1)
+
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
 
@@ -1,10 +1,19 @@
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "common.h"
 #include "compiler.h"
+#include "globals.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
+#include "trace.h"
+#include "vm.h"
 
 #ifdef DEBUG_PRINT_CODE
 #include "debug.h"
@@ -14,6 +23,8 @@
  * @brief Parser struct.
  * @param current The next to be consumed token.
  * @param previous The last consumed token.
+ * @param silent Whether errors are only recorded, not reported.
+ * @param madeString Whether the code just emitted is known to leave a string.
  */
 typedef struct
 {
@@ -21,6 +32,8 @@ typedef struct
     Token previous;
     bool hadError;
     bool panicMode;
+    bool silent;
+    bool madeString;
 } Parser;
 
 typedef enum
@@ -38,7 +51,7 @@ typedef enum
     PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)();
+typedef void (*ParseFn)(bool canAssign);
 
 typedef struct
 {
@@ -47,9 +60,52 @@ typedef struct
     Precedence precedence;
 } ParseRule;
 
+/**
+ * @brief A local variable.
+ * @param depth The scope depth of the block where the variable
+ * was declared, or -1 if it is declared but not yet initialized.
+ * @param isString Whether the value last assigned to it, in the
+ * order of the source, is known to be a string.
+ */
+typedef struct
+{
+    Token name;
+    int depth;
+    bool isString;
+} Local;
+
+/**
+ * @brief Compiler state for resolving local variables.
+ * Locals live on the value stack, in the order they were
+ * declared, so a local's index is also its stack slot.
+ * Each fiber body has its own stack, so it is compiled
+ * with a compiler of its own.
+ * @param enclosing The compiler of the code around a fiber
+ * body, or NULL for the top level of the script.
+ * @param fiberDepth How many fiber bodies the code is nested in.
+ */
+typedef struct Compiler
+{
+    struct Compiler* enclosing;
+    Local locals[UINT8_COUNT];
+    int localCount;
+    int scopeDepth;
+    int fiberDepth;
+} Compiler;
+
+// How big a batch of a streamed source grows before it is run. A chunk
+// holds at most 256 constants, so a batch ends well short of that.
+#define BATCH_CODE_SIZE 4096
+#define BATCH_CONSTANTS 128
 
-Parser parser;
-Chunk* compilingChunk;
+_Thread_local Parser parser;
+_Thread_local Compiler* current = NULL;
+_Thread_local Chunk* compilingChunk;
+
+// The global slots whose value last assigned, in the order of the source,
+// is known to be a string, one bit each. Code the compiler does not see may
+// assign them too, so this is only a guess, which the VM checks.
+static _Thread_local uint8_t stringGlobals[(UINT16_MAX + 1) / 8];
 
 /**
  * @brief Get the current chunk being compiled. 
@@ -67,6 +123,9 @@ static void errorAt(Token* token, const char* message)
     if (parser.panicMode) return;
 
     parser.panicMode = true;
+    parser.hadError = true;
+    if (parser.silent) return;
+
     fprintf(stderr, "[line %d] Error", token->line);
 
     if (token->type == TOKEN_EOF)
@@ -83,7 +142,6 @@ static void errorAt(Token* token, const char* message)
     }
 
     fprintf(stderr, ": %s\n", message);
-    parser.hadError = true;
 }
 
 /**
@@ -110,6 +168,14 @@ static void advance()
 {
     parser.previous = parser.current;
 
+    // A streamed source runs what it can before waiting for more,
+    // which is once a top-level statement ends.
+    if (parser.previous.type == TOKEN_SEMICOLON &&
+        current != NULL && current->enclosing == NULL && current->scopeDepth == 0)
+    {
+        allowPause();
+    }
+
     while (true)
     {
         parser.current = scanToken();
@@ -160,6 +226,7 @@ static bool match(TokenType type)
 static void emitByte(uint8_t byte)
 {
     writeChunk(currentChunk(), byte, parser.previous.line);
+    parser.madeString = false;
 }
 
 /**
@@ -171,6 +238,16 @@ static void emitBytes(uint8_t byte1, uint8_t byte2)
     emitByte(byte2);
 }
 
+/**
+ * @brief Emit an instruction with a two-byte operand. 
+ */
+static void emitShort(uint8_t instruction, uint16_t operand)
+{
+    emitByte(instruction);
+    emitByte((operand >> 8) & 0xff);
+    emitByte(operand & 0xff);
+}
+
 /**
  * @brief Emit a return instruction.
  */
@@ -187,7 +264,9 @@ static void emitReturn()
  */
 static uint8_t makeConstant(Value value)
 {
-    int constant = addConstant(currentChunk(), value);
+    // A chunk only has room for 256 constants, so equal ones share a slot.
+    int constant = findConstant(currentChunk(), value);
+    if (constant == -1) constant = addConstant(currentChunk(), value);
     if (constant > UINT8_MAX)
     {
         error("Too many constants in one chunk.");
@@ -208,9 +287,27 @@ static void emitConstant(Value value)
     emitBytes(OP_CONSTANT, makeConstant(value));
 }
 
+/**
+ * @brief Initialize a compiler and make it the current one.
+ */
+static void initCompiler(Compiler* compiler)
+{
+    compiler->enclosing = current;
+    compiler->localCount = 0;
+    compiler->scopeDepth = 0;
+    compiler->fiberDepth = current != NULL ? current->fiberDepth + 1 : 0;
+
+    // Each script starts out knowing nothing about its globals.
+    if (current == NULL) memset(stringGlobals, 0, sizeof(stringGlobals));
+    current = compiler;
+}
+
 static void endCompiler()
 {
     emitReturn();
+    current = current->enclosing;
+    if (!parser.hadError) optimizeChunk(currentChunk());
+
 #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError)
     {
@@ -222,6 +319,9 @@ static void endCompiler()
 static void expression();
 static void statement();
 static void declaration();
+static void block();
+static void beginScope();
+static void endScope();
 static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 
@@ -230,9 +330,12 @@ static void parsePrecedence(Precedence precedence);
  * It is assumed that the first operand has already been
  * compiled, and that the operator was just consumed.
  */
-static void binary()
+static void binary(bool canAssign)
 {
+    (void)canAssign;
+
     TokenType operatorType = parser.previous.type;
+    bool leftString = parser.madeString;
 
     // Compile the right operand by parsing at the
     // correct precedence level (one above the operator's).
@@ -240,6 +343,15 @@ static void binary()
     ParseRule* rule = getRule(operatorType);
     parsePrecedence((Precedence)(rule->precedence + 1));
 
+    // Adding anything to a string either makes a string or fails, so an
+    // addition with a string operand is marked as joining strings up front.
+    if (operatorType == TOKEN_PLUS && (leftString || parser.madeString))
+    {
+        emitByte(OP_ADD_STR);
+        parser.madeString = true;
+        return;
+    }
+
     // Emit the appropriate bytecode instruction.
     switch (operatorType)
     {
@@ -257,12 +369,136 @@ static void binary()
     }
 }
 
+/**
+ * @brief Parse the arguments of a call.
+ * It is assumed that the opening parenthesis was just consumed.
+ * @return The number of arguments.
+ */
+static uint8_t argumentList()
+{
+    uint8_t argCount = 0;
+    if (!check(TOKEN_RIGHT_PAREN))
+    {
+        do
+        {
+            expression();
+            if (argCount == UINT8_MAX)
+            {
+                error("Can't have more than 255 arguments.");
+            }
+            argCount++;
+        } while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+    return argCount;
+}
+
+/**
+ * @brief Parse a call.
+ * It is assumed that the callee was compiled and the
+ * opening parenthesis was just consumed.
+ */
+static void call(bool canAssign)
+{
+    (void)canAssign;
+
+    uint8_t argCount = argumentList();
+    emitBytes(OP_CALL, argCount);
+}
+
+/**
+ * @brief Parse a list literal.
+ * It is assumed that the opening bracket was just consumed.
+ */
+static void list(bool canAssign)
+{
+    (void)canAssign;
+
+    uint8_t count = 0;
+    if (!check(TOKEN_RIGHT_BRACKET))
+    {
+        do
+        {
+            expression();
+            if (count == UINT8_MAX)
+            {
+                error("Can't have more than 255 elements in a list literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after list elements.");
+    emitBytes(OP_BUILD_LIST, count);
+}
+
+/**
+ * @brief Parse an index into a list, or an assignment to one.
+ * It is assumed that the list was compiled and the
+ * opening bracket was just consumed.
+ */
+static void subscript(bool canAssign)
+{
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        emitByte(OP_SET_INDEX);
+    }
+    else
+    {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
+/**
+ * @brief Parse a fiber expression, whose body is compiled in place
+ * and skipped over by the code creating the fiber.
+ * It is assumed that the fiber keyword was just consumed.
+ */
+static void fiber(bool canAssign)
+{
+    (void)canAssign;
+
+    if (current->fiberDepth == FIBER_NESTING_MAX)
+    {
+        error("Can't nest fibers this deeply.");
+    }
+
+    emitShort(OP_FIBER, 0xffff);
+    int bodyStart = currentChunk()->count;
+
+    // The body's locals start at the bottom of the fiber's stack.
+    Compiler compiler;
+    initCompiler(&compiler);
+    beginScope();
+    consume(TOKEN_LEFT_BRACE, "Expect '{' before fiber body.");
+    block();
+    endScope();
+    emitByte(OP_END_FIBER);
+    current = compiler.enclosing;
+
+    int bodySize = currentChunk()->count - bodyStart;
+    if (bodySize > UINT16_MAX)
+    {
+        error("Too much code in fiber body.");
+    }
+
+    currentChunk()->code[bodyStart - 2] = (bodySize >> 8) & 0xff;
+    currentChunk()->code[bodyStart - 1] = bodySize & 0xff;
+}
+
 /**
  * @brief Parse a literal.
  * It is assumed that the keyword token was just consumed.
  */
-static void literal()
+static void literal(bool canAssign)
 {
+    (void)canAssign;
+
     switch (parser.previous.type)
     {
     case TOKEN_FALSE: emitByte(OP_FALSE); break;
@@ -276,8 +512,10 @@ static void literal()
  * @brief Parse a parenthetical grouping expression.
  * It is assumed that the opening parenthesis was just consumed.
  */
-static void grouping()
+static void grouping(bool canAssign)
 {
+    (void)canAssign;
+
     expression();
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
@@ -286,31 +524,186 @@ static void grouping()
  * @brief Parse a number.
  * It is assumed that the number's token was just consumed.
  */
-static void number()
+static void number(bool canAssign)
 {
+    (void)canAssign;
+
     // Convert the previously consumed token's lexeme
     // to a double value, and emit it as a constant.
     double value = strtod(parser.previous.start, NULL);
-    emitConstant(NUMBER_VAL(value));
+
+    // Literals are never negative, so an integral one is never -0.
+    // Small ones are carried in the instruction itself.
+    if (value <= UINT8_MAX && value == (uint8_t)value)
+    {
+        emitBytes(OP_INT8, (uint8_t)value);
+    }
+    else if (value <= UINT16_MAX && value == (uint16_t)value)
+    {
+        emitShort(OP_INT16, (uint16_t)value);
+    }
+    else if (value <= INT32_MAX && value == (int32_t)value)
+    {
+        emitConstant(INT_VAL((int32_t)value));
+    }
+    else
+    {
+        emitConstant(NUMBER_VAL(value));
+    }
 }
 
 /**
  * @brief Parse a string.
  * It is assumed that the string's token was just consumed.
  */
-static void string()
+static void string(bool canAssign)
 {
+    (void)canAssign;
+
     emitConstant(OBJ_VAL(
         copyString(parser.previous.start + 1,
                    parser.previous.length - 2)));
+    parser.madeString = true;
+}
+
+/**
+ * @brief Check if two identifier tokens have the same name.
+ */
+static bool identifiersEqual(Token* a, Token* b)
+{
+    if (a->length != b->length) return false;
+    return memcmp(a->start, b->start, a->length) == 0;
+}
+
+/**
+ * @brief Find a local variable in the current compiler.
+ * @return The local's stack slot, or -1 if there is no such local.
+ */
+static int resolveLocal(Compiler* compiler, Token* name)
+{
+    // Search backwards, so inner variables shadow outer ones.
+    for (int i = compiler->localCount - 1; i >= 0; i--)
+    {
+        Local* local = &compiler->locals[i];
+        if (identifiersEqual(name, &local->name))
+        {
+            if (local->depth == -1)
+            {
+                error("Can't read local variable in its own initializer.");
+            }
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * @brief Get the slot of a global variable.
+ */
+static uint16_t globalSlot(Token* name)
+{
+    int slot = resolveGlobal(name->start, name->length);
+    if (slot == -1)
+    {
+        error("Too many global variables.");
+        return 0;
+    }
+
+    return (uint16_t)slot;
+}
+
+/**
+ * @brief Record whether a global variable is known to hold a string.
+ */
+static void markStringGlobal(uint16_t slot, bool isString)
+{
+    if (isString)
+    {
+        stringGlobals[slot / 8] |= (uint8_t)(1 << (slot % 8));
+    }
+    else
+    {
+        stringGlobals[slot / 8] &= (uint8_t)~(1 << (slot % 8));
+    }
+}
+
+/**
+ * @brief Check if a global variable is known to hold a string.
+ */
+static bool isStringGlobal(uint16_t slot)
+{
+    return (stringGlobals[slot / 8] >> (slot % 8)) & 1;
+}
+
+/**
+ * @brief Emit the instruction to get a variable, or to set
+ * it if it is the target of an assignment.
+ */
+static void namedVariable(Token name, bool canAssign)
+{
+    int local = resolveLocal(current, &name);
+
+    // Fibers have no closures, so the locals around
+    // a fiber body are out of its reach.
+    for (Compiler* compiler = current->enclosing;
+         local == -1 && compiler != NULL; compiler = compiler->enclosing)
+    {
+        if (resolveLocal(compiler, &name) != -1)
+        {
+            error("Can't use a local variable from outside the fiber body.");
+            return;
+        }
+    }
+
+    if (local != -1)
+    {
+        if (canAssign && match(TOKEN_EQUAL))
+        {
+            expression();
+            current->locals[local].isString = parser.madeString;
+            emitBytes(OP_SET_LOCAL, (uint8_t)local);
+        }
+        else
+        {
+            emitBytes(OP_GET_LOCAL, (uint8_t)local);
+        }
+        parser.madeString = current->locals[local].isString;
+        return;
+    }
+
+    uint16_t slot = globalSlot(&name);
+
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        expression();
+        markStringGlobal(slot, parser.madeString);
+        emitShort(OP_SET_GLOBAL, slot);
+    }
+    else
+    {
+        emitShort(OP_GET_GLOBAL, slot);
+    }
+    parser.madeString = isStringGlobal(slot);
+}
+
+/**
+ * @brief Parse a variable access or assignment.
+ * It is assumed that the variable's name was just consumed.
+ */
+static void variable(bool canAssign)
+{
+    namedVariable(parser.previous, canAssign);
 }
 
 /**
  * @brief Parse a unary expression.
  * It is assumed that operand was just consumed.
  */
-static void unary()
+static void unary(bool canAssign)
 {
+    (void)canAssign;
+
     TokenType operatorType = parser.previous.type;
 
     // Compile the operand.
@@ -326,10 +719,12 @@ static void unary()
 }
 
 ParseRule rules[] = {
-    [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+    [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
     [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
     [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE},
     [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_LEFT_BRACKET]  = {list,     subscript, PREC_CALL},
+    [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
     [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -345,13 +740,14 @@ ParseRule rules[] = {
     [TOKEN_GREATER_EQUAL] = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS]          = {NULL,     binary, PREC_COMPARISON},
     [TOKEN_LESS_EQUAL]    = {NULL,     binary, PREC_COMPARISON},
-    [TOKEN_IDENTIFIER]    = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_IDENTIFIER]    = {variable, NULL,   PREC_NONE},
     [TOKEN_STRING]        = {string,   NULL,   PREC_NONE},
     [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
     [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FALSE]         = {literal,  NULL,   PREC_NONE},
+    [TOKEN_FIBER]         = {fiber,    NULL,   PREC_NONE},
     [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
@@ -364,6 +760,8 @@ ParseRule rules[] = {
     [TOKEN_TRUE]          = {literal,  NULL,   PREC_NONE},
     [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
     [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_YIELD]         = {NULL,     NULL,   PREC_NONE},
+    [TOKEN_PAUSE]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
     [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -385,8 +783,10 @@ static void parsePrecedence(Precedence precedence)
         return;
     }
 
-    // Compile the rest of the prefix expression.
-    prefixRule(); 
+    // Compile the rest of the prefix expression. Only allow
+    // assignment if this expression is at a low enough precedence.
+    bool canAssign = precedence <= PREC_ASSIGNMENT;
+    prefixRule(canAssign);
 
     // While there is an infix parser for the next token,
     // and that infix parser has a precedence >= our precedence,
@@ -396,7 +796,14 @@ static void parsePrecedence(Precedence precedence)
     {
         advance();
         ParseFn infixRule = getRule(parser.previous.type)->infix;
-        infixRule();
+        infixRule(canAssign);
+    }
+
+    // If an '=' was not consumed as part of the expression,
+    // the expression was not a valid assignment target.
+    if (canAssign && match(TOKEN_EQUAL))
+    {
+        error("Invalid assignment target.");
     }
 }
 
@@ -416,6 +823,163 @@ static void expression()
     parsePrecedence(PREC_ASSIGNMENT);
 }
 
+/**
+ * @brief Enter a new block scope.
+ */
+static void beginScope()
+{
+    current->scopeDepth++;
+}
+
+/**
+ * @brief Exit the current block scope, popping its locals
+ * off the stack in as few instructions as possible.
+ */
+static void endScope()
+{
+    current->scopeDepth--;
+
+    int count = 0;
+    while (current->localCount > 0 &&
+           current->locals[current->localCount - 1].depth > current->scopeDepth)
+    {
+        count++;
+        current->localCount--;
+    }
+
+    while (count > 0)
+    {
+        int batch = count > UINT8_MAX ? UINT8_MAX : count;
+        if (batch == 1)
+        {
+            emitByte(OP_POP);
+        }
+        else
+        {
+            emitBytes(OP_POPN, (uint8_t)batch);
+        }
+        count -= batch;
+    }
+}
+
+/**
+ * @brief Add a local variable to the current scope.
+ * It is marked uninitialized until its initializer is compiled.
+ */
+static void addLocal(Token name)
+{
+    if (current->localCount == UINT8_COUNT)
+    {
+        error("Too many local variables in scope.");
+        return;
+    }
+
+    Local* local = &current->locals[current->localCount++];
+    local->name = name;
+    local->depth = -1;
+    local->isString = false;
+}
+
+/**
+ * @brief Declare a local variable with the name of the last
+ * consumed token. Globals are not declared.
+ */
+static void declareVariable()
+{
+    if (current->scopeDepth == 0) return;
+
+    Token* name = &parser.previous;
+    for (int i = current->localCount - 1; i >= 0; i--)
+    {
+        Local* local = &current->locals[i];
+        if (local->depth != -1 && local->depth < current->scopeDepth) break;
+
+        if (identifiersEqual(name, &local->name))
+        {
+            error("Already a variable with this name in this scope.");
+        }
+    }
+
+    addLocal(*name);
+}
+
+/**
+ * @brief Mark the last declared local as initialized,
+ * with the value of the code just emitted.
+ */
+static void markInitialized()
+{
+    Local* local = &current->locals[current->localCount - 1];
+    local->depth = current->scopeDepth;
+    local->isString = parser.madeString;
+}
+
+/**
+ * @brief Parse a variable name and declare the variable.
+ * @return The variable's global slot, or 0 for a local.
+ */
+static uint16_t parseVariable(const char* errorMessage)
+{
+    consume(TOKEN_IDENTIFIER, errorMessage);
+
+    declareVariable();
+    if (current->scopeDepth > 0) return 0;
+
+    return globalSlot(&parser.previous);
+}
+
+/**
+ * @brief Emit the code to define a declared variable,
+ * whose initial value is on top of the stack.
+ */
+static void defineVariable(uint16_t global)
+{
+    if (current->scopeDepth > 0)
+    {
+        // The value stays on the stack as the local.
+        markInitialized();
+        return;
+    }
+
+    markStringGlobal(global, parser.madeString);
+    emitShort(OP_DEFINE_GLOBAL, global);
+}
+
+/**
+ * @brief Parse a variable declaration.
+ * It is assumed that the var keyword has been consumed.
+ */
+static void varDeclaration()
+{
+    uint16_t global = parseVariable("Expect variable name.");
+
+    if (match(TOKEN_EQUAL))
+    {
+        expression();
+    }
+    else
+    {
+        emitByte(OP_NIL);
+    }
+    consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+
+    defineVariable(global);
+}
+
+/**
+ * @brief Parse the declarations in a block.
+ * It is assumed that the opening brace has been consumed.
+ */
+static void block()
+{
+    while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+    {
+        declaration();
+    }
+
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+}
+
 /**
  * @brief Parse an expression statement.
  */
@@ -437,6 +1001,29 @@ static void printStatement()
     emitByte(OP_PRINT);
 }
 
+/**
+ * @brief Parse a yield statement, which suspends the running fiber.
+ * It is assumed that the yield keyword has been consumed.
+ */
+static void yieldStatement()
+{
+    if (current->fiberDepth == 0)
+    {
+        error("Can't yield outside a fiber body.");
+    }
+
+    if (match(TOKEN_SEMICOLON))
+    {
+        emitByte(OP_NIL);
+    }
+    else
+    {
+        expression();
+        consume(TOKEN_SEMICOLON, "Expect ';' after yielded value.");
+    }
+    emitByte(OP_YIELD);
+}
+
 /**
  * @brief Synchronize to exit panic mode.
  */
@@ -460,6 +1047,7 @@ static void synchronize()
             case TOKEN_WHILE:
             case TOKEN_PRINT:
             case TOKEN_RETURN:
+            case TOKEN_YIELD:
                 return;
             
             default:
@@ -475,7 +1063,14 @@ static void synchronize()
  */
 static void declaration()
 {
-    statement();
+    if (match(TOKEN_VAR))
+    {
+        varDeclaration();
+    }
+    else
+    {
+        statement();
+    }
 
     // If we hit a compile error while parsing the previous statement,
     // we entered panic mode. If so, synchronize.
@@ -491,23 +1086,37 @@ static void statement()
     {
         printStatement();
     }
+    else if (match(TOKEN_YIELD))
+    {
+        yieldStatement();
+    }
+    else if (match(TOKEN_LEFT_BRACE))
+    {
+        beginScope();
+        block();
+        endScope();
+    }
     else
     {
         expressionStatement();
     }
 }
+
 /**
- * @brief Compile source into a chunk.
+ * @brief Compile source into a chunk on this thread.
  * @return True if there was no error.
  * @return False if there was a parser error.
  */
-bool compile(const char* source, Chunk* chunk)
+static bool compileSequential(const char* source, Chunk* chunk)
 {
     initScanner(source);
+    Compiler compiler;
+    initCompiler(&compiler);
     compilingChunk = chunk;
 
     parser.hadError = false;
     parser.panicMode = false;
+    parser.silent = false;
 
     advance();
     
@@ -519,3 +1128,359 @@ bool compile(const char* source, Chunk* chunk)
     endCompiler();
     return !parser.hadError;
 }
+
+// Sources smaller than this are always compiled on one thread.
+#define PARALLEL_COMPILE_MIN (1 << 20)
+// Each thread compiles this many segments on average, so
+// that threads which finish early can take on more.
+#define SEGMENTS_PER_THREAD 4
+
+static atomic_bool parallelCompileOn = false;
+
+/**
+ * @brief A run of top-level statements of a source, compiled on its own.
+ * @param line The line of the source the segment starts on.
+ * @param endLine The line the segment ends on, once compiled.
+ */
+typedef struct
+{
+    const char* start;
+    int length;
+    int line;
+    int endLine;
+    Chunk chunk;
+    bool compiled;
+} Segment;
+
+/**
+ * @brief The segments of a source, taken in order by the threads compiling them.
+ */
+typedef struct
+{
+    Segment* segments;
+    int count;
+    atomic_int next;
+} SegmentQueue;
+
+/**
+ * @brief A thread compiling segments, and the constants it made for them.
+ */
+typedef struct
+{
+    pthread_t thread;
+    SegmentQueue* queue;
+    Obj* objects;
+    Table strings;
+} SegmentWorker;
+
+/**
+ * @brief Compile sources of at least a megabyte on a thread for each core,
+ * or go back to compiling everything on one thread.
+ */
+void enableParallelCompile(bool enabled)
+{
+    atomic_store(&parallelCompileOn, enabled);
+}
+
+/**
+ * @brief Split a source into segments of about a given length, between top-level
+ * statements. Only a semicolon outside of any brackets, strings and comments
+ * ends a top-level statement, so a segment never ends in the middle of one.
+ * @return The number of segments.
+ */
+static int findSegments(const char* source, int length, int targetLength, Segment* segments, int capacity)
+{
+    int count = 0;
+    int start = 0;
+    int startLine = 1;
+    int line = 1;
+    int depth = 0;
+
+    for (int i = 0; i < length; i++)
+    {
+        switch (source[i])
+        {
+        case '\n':
+            line++;
+            break;
+        case '"':
+            // Strings have no escapes, so they end at the next quote.
+            for (i++; i < length && source[i] != '"'; i++)
+            {
+                if (source[i] == '\n') line++;
+            }
+            break;
+        case '/':
+            if (i + 1 < length && source[i + 1] == '/')
+            {
+                while (i + 1 < length && source[i + 1] != '\n') i++;
+            }
+            break;
+        case '(': case '[': case '{':
+            depth++;
+            break;
+        case ')': case ']': case '}':
+            depth--;
+            break;
+        case ';':
+            if (depth == 0 && i + 1 - start >= targetLength && count < capacity - 1)
+            {
+                segments[count++] = (Segment){.start = source + start, .length = i + 1 - start, .line = startLine};
+                start = i + 1;
+                startLine = line;
+            }
+            break;
+        }
+    }
+
+    segments[count++] = (Segment){.start = source + start, .length = length - start, .line = startLine};
+    return count;
+}
+
+/**
+ * @brief Compile a segment into its own chunk, without reporting errors.
+ */
+static void compileSegment(Segment* segment)
+{
+    uint64_t start = traceStart();
+
+    // The scanner stops at a null byte, so the segment is copied to end with one.
+    char* text = ALLOCATE(char, segment->length + 1);
+    memcpy(text, segment->start, segment->length);
+    text[segment->length] = '\0';
+
+    initScannerAt(text, segment->line);
+    initChunk(&segment->chunk);
+    Compiler compiler;
+    initCompiler(&compiler);
+    compilingChunk = &segment->chunk;
+
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.silent = true;
+
+    advance();
+
+    while (!match(TOKEN_EOF))
+    {
+        declaration();
+    }
+
+    current = current->enclosing;
+    segment->compiled = !parser.hadError;
+    segment->endLine = parser.previous.line;
+    FREE_ARRAY(char, text, segment->length + 1);
+    traceEnd("compileSegment", start);
+}
+
+static void* runSegmentWorker(void* context)
+{
+    SegmentWorker* worker = (SegmentWorker*)context;
+    SegmentQueue* queue = worker->queue;
+
+    // Constants are made in this thread's VM, set up for just that. Like
+    // the program being built, they are in the shared heap.
+    vm.program = NULL;
+    vm.objects = NULL;
+    initTable(&vm.strings);
+    vm.sharedHeapDepth = 1;
+    vm.outOfMemory = NULL;
+
+    int index;
+    while ((index = atomic_fetch_add(&queue->next, 1)) < queue->count)
+    {
+        compileSegment(&queue->segments[index]);
+    }
+
+    worker->objects = vm.objects;
+    worker->strings = vm.strings;
+    return NULL;
+}
+
+/**
+ * @brief Link compiled segments into one chunk, in order. Equal constants
+ * of different segments are merged into one, made in this thread's VM.
+ * @return False if a segment had an error, or there are too many constants.
+ */
+static bool linkSegments(Segment* segments, int count, Chunk* chunk)
+{
+    for (int i = 0; i < count; i++)
+    {
+        Segment* segment = &segments[i];
+        if (!segment->compiled) return false;
+
+        uint8_t constants[UINT8_COUNT];
+        for (int j = 0; j < segment->chunk.constants.count; j++)
+        {
+            Value value = segment->chunk.constants.values[j];
+            if (IS_STRING(value))
+            {
+                value = OBJ_VAL(copyString(AS_CSTRING(value), AS_STRING(value)->length));
+            }
+
+            int constant = findConstant(chunk, value);
+            if (constant == -1)
+            {
+                if (chunk->constants.count == UINT8_COUNT) return false;
+                constant = addConstant(chunk, value);
+            }
+            constants[j] = (uint8_t)constant;
+        }
+
+        int offset = chunk->count;
+        appendChunk(chunk, &segment->chunk);
+        for (; offset < chunk->count; offset += instructionSize(chunk->code[offset]))
+        {
+            if (chunk->code[offset] == OP_CONSTANT)
+            {
+                chunk->code[offset + 1] = constants[chunk->code[offset + 1]];
+            }
+        }
+    }
+
+    return true;
+}
+
+/**
+ * @brief Compile source into a chunk on a thread for each core. The source is
+ * split into segments of top-level statements, which are compiled into chunks
+ * of their own and then linked together.
+ * If anything goes wrong, it is compiled again on this thread, which reports
+ * the same errors, in the same order, as it would have otherwise.
+ * @return True if there was no error.
+ * @return False if there was a parser error.
+ */
+static bool compileParallel(const char* source, Chunk* chunk)
+{
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores > 1 ? (int)cores : 1;
+    int length = (int)strlen(source);
+    if (threads == 1 || length < PARALLEL_COMPILE_MIN) return compileSequential(source, chunk);
+
+    int capacity = threads * SEGMENTS_PER_THREAD;
+    Segment* segments = ALLOCATE(Segment, capacity);
+    int count = findSegments(source, length, length / capacity, segments, capacity);
+    if (count < 2)
+    {
+        FREE_ARRAY(Segment, segments, capacity);
+        return compileSequential(source, chunk);
+    }
+
+    SegmentQueue queue;
+    queue.segments = segments;
+    queue.count = count;
+    atomic_init(&queue.next, 0);
+
+    if (threads > count) threads = count;
+    SegmentWorker* workers = ALLOCATE(SegmentWorker, threads);
+    for (int i = 0; i < threads; i++)
+    {
+        workers[i].queue = &queue;
+        pthread_create(&workers[i].thread, NULL, runSegmentWorker, &workers[i]);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+    }
+
+    bool linked = linkSegments(segments, count, chunk);
+    int endLine = segments[count - 1].endLine;
+
+    for (int i = 0; i < count; i++)
+    {
+        freeChunk(&segments[i].chunk);
+    }
+    for (int i = 0; i < threads; i++)
+    {
+        releaseStringTable(&workers[i].strings);
+        freeObjectList(workers[i].objects);
+    }
+    FREE_ARRAY(SegmentWorker, workers, threads);
+    FREE_ARRAY(Segment, segments, capacity);
+
+    if (!linked)
+    {
+        freeChunk(chunk);
+        return compileSequential(source, chunk);
+    }
+
+    writeChunk(chunk, OP_RETURN, endLine);
+    optimizeChunk(chunk);
+
+#ifdef DEBUG_PRINT_CODE
+    disassembleChunk(chunk, "code");
+#endif
+
+    return true;
+}
+
+/**
+ * @brief Compile source into a chunk.
+ * @return True if there was no error.
+ * @return False if there was a parser error.
+ */
+bool compile(const char* source, Chunk* chunk)
+{
+    if (atomic_load(&parallelCompileOn)) return compileParallel(source, chunk);
+    return compileSequential(source, chunk);
+}
+
+/**
+ * @brief Start compiling a streamed source, one batch of top-level statements
+ * at a time, so that each batch can run while the rest is still being read.
+ */
+void beginStream(SourceReader read, void* context)
+{
+    initStreamScanner(read, context);
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.silent = false;
+    advance();
+}
+
+/**
+ * @brief Compile the next batch of top-level statements of a streamed source.
+ * A batch ends once its chunk is big enough, or once all of the source
+ * read so far is compiled, so that input arriving slowly runs as soon as it can.
+ * No locals are live between top-level statements, so each batch
+ * starts with an empty stack.
+ * @return True if there was no error.
+ * @return False if there was a parser error.
+ */
+bool compileBatch(Chunk* chunk)
+{
+    Compiler compiler;
+    initCompiler(&compiler);
+    compilingChunk = chunk;
+
+    // The previous batch ended at a pause, waiting for more of the source.
+    if (check(TOKEN_PAUSE)) advance();
+
+    while (!check(TOKEN_EOF) && !check(TOKEN_PAUSE))
+    {
+        // Earlier statements are compiled, so their text can be dropped.
+        keepSourceFrom(parser.current.start);
+        declaration();
+
+        if (chunk->count >= BATCH_CODE_SIZE || chunk->constants.count >= BATCH_CONSTANTS) break;
+    }
+
+    endCompiler();
+    return !parser.hadError;
+}
+
+/**
+ * @brief Check if every statement of a streamed source has been compiled.
+ */
+bool streamEnded()
+{
+    return check(TOKEN_EOF);
+}
+
+/**
+ * @brief Stop compiling a streamed source, freeing what is left of its text.
+ */
+void endStream()
+{
+    freeScanner();
+}
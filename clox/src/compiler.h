@@ -2,7 +2,13 @@
 #define CLOX_COMPILER_H
 
 #include "chunk.h"
+#include "scanner.h"
 
 bool compile(const char* source, Chunk* chunk);
+void enableParallelCompile(bool enabled);
+void beginStream(SourceReader read, void* context);
+bool compileBatch(Chunk* chunk);
+bool streamEnded();
+void endStream();
 
 #endif
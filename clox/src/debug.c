@@ -1,27 +1,31 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "globals.h"
 
 void disassembleChunk(Chunk* chunk, const char* name)
 {
     printf("== %s ==\n", name);
     
     int lineIndex = 0;
-    ChunkLineData lineData = chunk->lines.data[lineIndex];
-    // In lineInfo.count we track how many instructions are remaining in this line.
+    int lineBytesLeft = chunk->lines.data[lineIndex].count;
+    int previousLine = -1;
+    // In lineBytesLeft we track how many bytes are remaining in this line.
     
     for (int offset = 0; offset < chunk->count;)
     {
-        bool changedLine = false;
-        lineData.count--;
-        if (lineData.count == 0)
+        int line = chunk->lines.data[lineIndex].number;
+        int next = disassembleInstruction(chunk, offset, line != previousLine ? line : -1);
+        previousLine = line;
+
+        lineBytesLeft -= next - offset;
+        while (lineBytesLeft <= 0 && lineIndex + 1 < chunk->lines.count)
         {
             lineIndex++;
-            lineData = chunk->lines.data[lineIndex];
-            changedLine = true;
+            lineBytesLeft += chunk->lines.data[lineIndex].count;
         }
 
-        offset = disassembleInstruction(chunk, offset, (offset == 0 || changedLine) ? lineData.number : -1);
+        offset = next;
     }
 }
 
@@ -40,6 +44,38 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset)
     return offset + 2;
 }
 
+static int byteInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint8_t operand = chunk->code[offset + 1];
+    printf("%-16s %4d\n", name, operand);
+    return offset + 2;
+}
+
+static int shortInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t operand = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d\n", name, operand);
+    return offset + 3;
+}
+
+/**
+ * @brief Print an instruction followed by a body of code it skips,
+ * with the offset of the instruction after the body.
+ */
+static int jumpInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t jump = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + jump);
+    return offset + 3;
+}
+
+static int globalInstruction(const char* name, Chunk* chunk, int offset)
+{
+    uint16_t slot = (uint16_t)((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]);
+    printf("%-16s %4d '%s'\n", name, slot, globalName(slot));
+    return offset + 3;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset, int lineNumber)
 {
     printf("%04d ", offset);
@@ -50,11 +86,16 @@ int disassembleInstruction(Chunk* chunk, int offset, int lineNumber)
         printf("%4d ", lineNumber);
     }
 
-    uint8_t instruction = chunk->code[offset];
+    // Other VMs may be quickening the opcode while it is traced.
+    uint8_t instruction = __atomic_load_n(&chunk->code[offset], __ATOMIC_RELAXED);
     switch (instruction)
     {
     case OP_CONSTANT:
         return constantInstruction("OP_CONSTANT", chunk, offset);
+    case OP_INT8:
+        return byteInstruction("OP_INT8", chunk, offset);
+    case OP_INT16:
+        return shortInstruction("OP_INT16", chunk, offset);
     case OP_NIL:
         return simpleInstruction("OP_NIL", offset);
     case OP_TRUE:
@@ -63,12 +104,30 @@ int disassembleInstruction(Chunk* chunk, int offset, int lineNumber)
         return simpleInstruction("OP_FALSE", offset);
     case OP_POP:
         return simpleInstruction("OP_POP", offset);
+    case OP_POPN:
+        return byteInstruction("OP_POPN", chunk, offset);
+    case OP_GET_LOCAL:
+        return byteInstruction("OP_GET_LOCAL", chunk, offset);
+    case OP_SET_LOCAL:
+        return byteInstruction("OP_SET_LOCAL", chunk, offset);
+    case OP_DEFINE_GLOBAL:
+        return globalInstruction("OP_DEFINE_GLOBAL", chunk, offset);
+    case OP_GET_GLOBAL:
+        return globalInstruction("OP_GET_GLOBAL", chunk, offset);
+    case OP_SET_GLOBAL:
+        return globalInstruction("OP_SET_GLOBAL", chunk, offset);
     case OP_EQUAL:
         return simpleInstruction("OP_EQUAL", offset);
+    case OP_NOT_EQUAL:
+        return simpleInstruction("OP_NOT_EQUAL", offset);
     case OP_GREATER:
         return simpleInstruction("OP_GREATER", offset);
+    case OP_GREATER_EQUAL:
+        return simpleInstruction("OP_GREATER_EQUAL", offset);
     case OP_LESS:
         return simpleInstruction("OP_LESS", offset);
+    case OP_LESS_EQUAL:
+        return simpleInstruction("OP_LESS_EQUAL", offset);
     case OP_ADD:
         return simpleInstruction("OP_ADD", offset);
     case OP_SUBTRACT:
@@ -77,6 +136,22 @@ int disassembleInstruction(Chunk* chunk, int offset, int lineNumber)
         return simpleInstruction("OP_MULTIPLY", offset);
     case OP_DIVIDE:
         return simpleInstruction("OP_DIVIDE", offset);
+    case OP_CONCAT_N:
+        return byteInstruction("OP_CONCAT_N", chunk, offset);
+    case OP_CALL:
+        return byteInstruction("OP_CALL", chunk, offset);
+    case OP_BUILD_LIST:
+        return byteInstruction("OP_BUILD_LIST", chunk, offset);
+    case OP_GET_INDEX:
+        return simpleInstruction("OP_GET_INDEX", offset);
+    case OP_SET_INDEX:
+        return simpleInstruction("OP_SET_INDEX", offset);
+    case OP_FIBER:
+        return jumpInstruction("OP_FIBER", chunk, offset);
+    case OP_YIELD:
+        return simpleInstruction("OP_YIELD", offset);
+    case OP_END_FIBER:
+        return simpleInstruction("OP_END_FIBER", offset);
     case OP_NOT:
         return simpleInstruction("OP_NOT", offset);
     case OP_NEGATE:
@@ -85,6 +160,40 @@ int disassembleInstruction(Chunk* chunk, int offset, int lineNumber)
         return simpleInstruction("OP_PRINT", offset);
     case OP_RETURN:
         return simpleInstruction("OP_RETURN", offset);
+    case OP_GREATER_NUM:
+        return simpleInstruction("OP_GREATER_NUM", offset);
+    case OP_GREATER_EQUAL_NUM:
+        return simpleInstruction("OP_GREATER_EQUAL_NUM", offset);
+    case OP_LESS_NUM:
+        return simpleInstruction("OP_LESS_NUM", offset);
+    case OP_LESS_EQUAL_NUM:
+        return simpleInstruction("OP_LESS_EQUAL_NUM", offset);
+    case OP_ADD_NUM:
+        return simpleInstruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simpleInstruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+        return simpleInstruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+        return simpleInstruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+        return simpleInstruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_INT:
+        return simpleInstruction("OP_GREATER_INT", offset);
+    case OP_GREATER_EQUAL_INT:
+        return simpleInstruction("OP_GREATER_EQUAL_INT", offset);
+    case OP_LESS_INT:
+        return simpleInstruction("OP_LESS_INT", offset);
+    case OP_LESS_EQUAL_INT:
+        return simpleInstruction("OP_LESS_EQUAL_INT", offset);
+    case OP_ADD_INT:
+        return simpleInstruction("OP_ADD_INT", offset);
+    case OP_SUBTRACT_INT:
+        return simpleInstruction("OP_SUBTRACT_INT", offset);
+    case OP_MULTIPLY_INT:
+        return simpleInstruction("OP_MULTIPLY_INT", offset);
+    case OP_ADD_ANY:
+        return simpleInstruction("OP_ADD_ANY", offset);
     default:
         printf("Unknown opcode %d\n", instruction);
         return offset + 1;
@@ -0,0 +1,914 @@
+// For pipe2() and accept4().
+#define _GNU_SOURCE
+
+#include "eventloop.h"
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "actor.h"
+#include "memory.h"
+#include "metrics.h"
+#include "object.h"
+#include "vm.h"
+
+// The most I/O events handled in one turn of the loop.
+#define EVENTS_MAX 64
+
+// The longest delay, in milliseconds (about 30 years). Longer ones are
+// cut to it, so that deadlines can't overflow.
+#define DELAY_MAX 1e12
+
+typedef enum
+{
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_ACCEPT,
+    WAIT_SLEEP,
+    WAIT_TIMER
+} WaitKind;
+
+/**
+ * @brief An operation which may have to wait for a file descriptor or a time.
+ * @param fiber The fiber waiting for it, or NULL if the script itself is.
+ * For a timer, the fiber to resume once it is done.
+ * @param count How many bytes to read, at most.
+ * @param data The string to write, of which written bytes are written so far.
+ * @param deadline When a sleep or timer is done, in nanoseconds.
+ * @param result The result of the operation, once it is done.
+ * @param previous The previous operation the loop is waiting for.
+ * @param next The next operation the loop is waiting for.
+ */
+typedef struct Wait
+{
+    WaitKind kind;
+    ObjFiber* fiber;
+    int fd;
+    int count;
+    ObjString* data;
+    int written;
+    uint64_t deadline;
+    bool done;
+    Value result;
+    struct Wait* previous;
+    struct Wait* next;
+} Wait;
+
+/**
+ * @brief The event loop of a VM. Waits for file descriptors are
+ * woken by epoll, and waits for a time by a heap of deadlines.
+ * @param ready The fibers to resume, a queue in a circular buffer.
+ * @param timers The sleeps and timers, a min-heap ordered by deadline.
+ * @param waits Every operation not done yet, in a linked list.
+ */
+typedef struct EventLoop
+{
+    int epoll;
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+    ObjFiber** ready;
+    int timerCount;
+    int timerCapacity;
+    Wait** timers;
+    Wait* waits;
+} EventLoop;
+
+/**
+ * @brief Get the time of a monotonic clock, in nanoseconds.
+ */
+static uint64_t now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + (uint64_t)time.tv_nsec;
+}
+
+/**
+ * @brief Get this thread's event loop, creating it on first use.
+ * @return The loop, or NULL after reporting a runtime error.
+ */
+static EventLoop* getLoop()
+{
+    if (vm.loop != NULL) return vm.loop;
+
+    int epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll < 0)
+    {
+        runtimeError("Could not create the event loop.");
+        return NULL;
+    }
+
+    EventLoop* loop = ALLOCATE(EventLoop, 1);
+    loop->epoll = epoll;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->ready = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->timers = NULL;
+    loop->waits = NULL;
+    vm.loop = loop;
+    return loop;
+}
+
+/**
+ * @brief Free this thread's event loop, abandoning the fibers waiting in it.
+ */
+void freeEventLoop()
+{
+    EventLoop* loop = vm.loop;
+    if (loop == NULL) return;
+
+    // Only fibers' waits are allocated; the script's own are not
+    // pending once it is no longer running.
+    while (loop->waits != NULL)
+    {
+        Wait* wait = loop->waits;
+        loop->waits = wait->next;
+        if (wait->fiber != NULL) FREE(Wait, wait);
+    }
+
+    close(loop->epoll);
+    FREE_ARRAY(ObjFiber*, loop->ready, loop->readyCapacity);
+    FREE_ARRAY(Wait*, loop->timers, loop->timerCapacity);
+    FREE(EventLoop, loop);
+    vm.loop = NULL;
+}
+
+/**
+ * @brief Call a function on each value this thread's event loop holds
+ * on to, outside of the stacks of fibers: the strings being written.
+ */
+void retainLoopValues(void (*retain)(Value value))
+{
+    if (vm.loop == NULL) return;
+
+    for (Wait* wait = vm.loop->waits; wait != NULL; wait = wait->next)
+    {
+        if (wait->data != NULL) retain(OBJ_VAL(wait->data));
+    }
+}
+
+/**
+ * @brief Queue a fiber to be resumed, unless it already is.
+ */
+static void schedule(EventLoop* loop, ObjFiber* fiber)
+{
+    if (fiber->scheduled) return;
+
+    if (loop->readyCount == loop->readyCapacity)
+    {
+        // Copy the queue to the start of a bigger buffer.
+        int oldCapacity = loop->readyCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        ObjFiber** ready = ALLOCATE(ObjFiber*, capacity);
+        for (int i = 0; i < loop->readyCount; i++)
+        {
+            ready[i] = loop->ready[(loop->readyHead + i) % oldCapacity];
+        }
+        FREE_ARRAY(ObjFiber*, loop->ready, oldCapacity);
+        loop->ready = ready;
+        loop->readyCapacity = capacity;
+        loop->readyHead = 0;
+    }
+
+    loop->ready[(loop->readyHead + loop->readyCount) % loop->readyCapacity] = fiber;
+    loop->readyCount++;
+    fiber->scheduled = true;
+}
+
+/**
+ * @brief Take the fiber at the front of the queue.
+ */
+static ObjFiber* nextReady(EventLoop* loop)
+{
+    ObjFiber* fiber = loop->ready[loop->readyHead];
+    loop->readyHead = (loop->readyHead + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    fiber->scheduled = false;
+    return fiber;
+}
+
+/**
+ * @brief Put a timer into a hole in the heap, moving it
+ * up or down until the heap is ordered again.
+ */
+static void placeTimer(EventLoop* loop, int hole, Wait* wait)
+{
+    Wait** timers = loop->timers;
+    while (hole > 0 && timers[(hole - 1) / 2]->deadline > wait->deadline)
+    {
+        timers[hole] = timers[(hole - 1) / 2];
+        hole = (hole - 1) / 2;
+    }
+
+    while (true)
+    {
+        int child = 2 * hole + 1;
+        if (child >= loop->timerCount) break;
+        if (child + 1 < loop->timerCount &&
+            timers[child + 1]->deadline < timers[child]->deadline)
+        {
+            child++;
+        }
+        if (timers[child]->deadline >= wait->deadline) break;
+
+        timers[hole] = timers[child];
+        hole = child;
+    }
+
+    timers[hole] = wait;
+}
+
+static void addTimer(EventLoop* loop, Wait* wait)
+{
+    if (loop->timerCount == loop->timerCapacity)
+    {
+        int oldCapacity = loop->timerCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        loop->timers = GROW_ARRAY(Wait*, loop->timers, oldCapacity, capacity);
+        loop->timerCapacity = capacity;
+    }
+
+    loop->timerCount++;
+    placeTimer(loop, loop->timerCount - 1, wait);
+}
+
+static void removeTimer(EventLoop* loop, int index)
+{
+    loop->timerCount--;
+    if (index < loop->timerCount)
+    {
+        placeTimer(loop, index, loop->timers[loop->timerCount]);
+    }
+}
+
+/**
+ * @brief Write to a file descriptor. Sockets are written with MSG_NOSIGNAL,
+ * so that writing to one closed by its peer fails instead of raising SIGPIPE.
+ */
+static ssize_t writeSome(int fd, const char* chars, size_t length)
+{
+    ssize_t written = send(fd, chars, length, MSG_NOSIGNAL);
+    if (written < 0 && errno == ENOTSOCK) written = write(fd, chars, length);
+    return written;
+}
+
+/**
+ * @brief Try to do an operation without blocking.
+ * @return True if it is done, with its result set.
+ */
+static bool attempt(Wait* wait)
+{
+    switch (wait->kind)
+    {
+    case WAIT_READ:
+    {
+        char* chars = ALLOCATE(char, wait->count + 1);
+        ssize_t length = read(wait->fd, chars, wait->count);
+        if (length < 0)
+        {
+            int error = errno;
+            FREE_ARRAY(char, chars, wait->count + 1);
+            if (error == EAGAIN || error == EWOULDBLOCK || error == EINTR) return false;
+
+            wait->result = NIL_VAL;
+            return true;
+        }
+
+        chars = GROW_ARRAY(char, chars, wait->count + 1, length + 1);
+        chars[length] = '\0';
+        wait->result = OBJ_VAL(takeString(chars, (int)length));
+        return true;
+    }
+
+    case WAIT_WRITE:
+        while (wait->written < wait->data->length)
+        {
+            ssize_t length = writeSome(wait->fd, wait->data->chars + wait->written,
+                                       wait->data->length - wait->written);
+            if (length < 0)
+            {
+                if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) return false;
+
+                wait->result = NIL_VAL;
+                return true;
+            }
+            wait->written += (int)length;
+        }
+        wait->result = INT_VAL(wait->written);
+        return true;
+
+    case WAIT_ACCEPT:
+    {
+        int fd = accept4(wait->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) return false;
+
+        wait->result = fd < 0 ? NIL_VAL : INT_VAL(fd);
+        return true;
+    }
+
+    case WAIT_SLEEP:
+    case WAIT_TIMER:
+        wait->result = NIL_VAL;
+        return now() >= wait->deadline;
+    }
+
+    return false; // Unreachable.
+}
+
+/**
+ * @brief Start waiting for an operation to be done.
+ * @return False after reporting a runtime error.
+ */
+static bool startWait(EventLoop* loop, Wait* wait)
+{
+    if (wait->kind == WAIT_SLEEP || wait->kind == WAIT_TIMER)
+    {
+        addTimer(loop, wait);
+    }
+    else
+    {
+        struct epoll_event event;
+        event.events = wait->kind == WAIT_WRITE ? EPOLLOUT : EPOLLIN;
+        event.data.ptr = wait;
+        if (epoll_ctl(loop->epoll, EPOLL_CTL_ADD, wait->fd, &event) < 0)
+        {
+            if (errno == EEXIST)
+            {
+                runtimeError("Already waiting for file descriptor %d.", wait->fd);
+            }
+            else
+            {
+                runtimeError("Can't wait for file descriptor %d.", wait->fd);
+            }
+            return false;
+        }
+    }
+
+    wait->previous = NULL;
+    wait->next = loop->waits;
+    if (loop->waits != NULL) loop->waits->previous = wait;
+    loop->waits = wait;
+    return true;
+}
+
+/**
+ * @brief Remove an operation from the list of those not done yet.
+ */
+static void unlinkWait(EventLoop* loop, Wait* wait)
+{
+    if (wait->previous != NULL) wait->previous->next = wait->next;
+    else loop->waits = wait->next;
+    if (wait->next != NULL) wait->next->previous = wait->previous;
+}
+
+/**
+ * @brief Stop waiting for an operation, whether it is done or not.
+ */
+static void stopWait(EventLoop* loop, Wait* wait)
+{
+    if (wait->kind == WAIT_SLEEP || wait->kind == WAIT_TIMER)
+    {
+        for (int i = 0; i < loop->timerCount; i++)
+        {
+            if (loop->timers[i] == wait)
+            {
+                removeTimer(loop, i);
+                break;
+            }
+        }
+    }
+    else
+    {
+        epoll_ctl(loop->epoll, EPOLL_CTL_DEL, wait->fd, NULL);
+    }
+
+    unlinkWait(loop, wait);
+}
+
+/**
+ * @brief Finish an operation which is done, making
+ * whoever waited for it ready to continue.
+ */
+static void complete(EventLoop* loop, Wait* wait)
+{
+    if (wait->fiber == NULL)
+    {
+        wait->done = true;
+        return;
+    }
+
+    if (wait->kind != WAIT_TIMER)
+    {
+        // The result replaces the nil the fiber's native call returned.
+        wait->fiber->stackTop[-1] = wait->result;
+        wait->fiber->state = FIBER_SUSPENDED;
+    }
+    schedule(loop, wait->fiber);
+    FREE(Wait, wait);
+}
+
+/**
+ * @brief Run one turn of the loop: resume the fibers which are ready,
+ * then wait for I/O until a deadline, if there is anything to wait for.
+ * @return False after a runtime error in a fiber.
+ */
+static bool turn(EventLoop* loop)
+{
+    // Fibers which become ready meanwhile wait for the next turn,
+    // so fibers which keep yielding can not starve I/O.
+    for (int count = loop->readyCount; count > 0; count--)
+    {
+        ObjFiber* fiber = nextReady(loop);
+        if (fiber->state != FIBER_SUSPENDED) continue;
+
+        Value yielded;
+        if (!resumeFiber(fiber, &yielded)) return false;
+        if (fiber->state == FIBER_SUSPENDED) schedule(loop, fiber);
+    }
+
+    int timeout = -1;
+    if (loop->readyCount > 0)
+    {
+        timeout = 0;
+    }
+    else if (loop->timerCount > 0)
+    {
+        uint64_t time = now();
+        uint64_t deadline = loop->timers[0]->deadline;
+        uint64_t milliseconds = deadline <= time ? 0 : (deadline - time + 999999) / 1000000;
+        timeout = milliseconds > INT32_MAX ? INT32_MAX : (int)milliseconds;
+    }
+    else if (loop->waits == NULL)
+    {
+        return true;
+    }
+
+    // The thread may wait for a long time, so the metrics are brought up to date first.
+    if (timeout != 0 && metricsEnabled) publishMetrics();
+
+    struct epoll_event events[EVENTS_MAX];
+    int count = epoll_wait(loop->epoll, events, EVENTS_MAX, timeout);
+    for (int i = 0; i < count; i++)
+    {
+        // Readiness can be spurious, and then it is waited for again.
+        Wait* wait = events[i].data.ptr;
+        if (!attempt(wait)) continue;
+
+        stopWait(loop, wait);
+        complete(loop, wait);
+    }
+
+    uint64_t time = now();
+    while (loop->timerCount > 0 && loop->timers[0]->deadline <= time)
+    {
+        Wait* wait = loop->timers[0];
+        removeTimer(loop, 0);
+        unlinkWait(loop, wait);
+        complete(loop, wait);
+    }
+
+    return true;
+}
+
+/**
+ * @brief Do an operation, waiting for it if it can not be done right away.
+ * A fiber waits by being suspended until the loop resumes it. The script
+ * itself waits by running the loop, resuming other fibers meanwhile.
+ * @param result Where to store the result, which for a fiber is
+ * only stored on its stack once the operation is done.
+ * @return False after reporting a runtime error.
+ */
+static bool perform(Wait* operation, Value* result)
+{
+    if (attempt(operation))
+    {
+        *result = operation->result;
+        return true;
+    }
+
+    EventLoop* loop = getLoop();
+    if (loop == NULL) return false;
+
+    // An actor's body waits like a script, as its thread belongs to it.
+    if (vm.fiber != NULL && !inActorBody())
+    {
+        Wait* wait = ALLOCATE(Wait, 1);
+        *wait = *operation;
+        wait->fiber = vm.fiber;
+        if (!startWait(loop, wait))
+        {
+            FREE(Wait, wait);
+            return false;
+        }
+
+        vm.fiber->state = FIBER_WAITING;
+        *result = NIL_VAL;
+        return true;
+    }
+
+    operation->fiber = NULL;
+    if (!startWait(loop, operation)) return false;
+    while (!operation->done)
+    {
+        if (!turn(loop))
+        {
+            stopWait(loop, operation);
+            return false;
+        }
+    }
+
+    *result = operation->result;
+    return true;
+}
+
+/**
+ * @brief Get a file descriptor argument.
+ * @return False after reporting a runtime error.
+ */
+static bool fdArgument(Value arg, int* fd)
+{
+    int32_t value;
+    if (!asIndex(arg, &value) || value < 0)
+    {
+        runtimeError("Expected a file descriptor.");
+        return false;
+    }
+
+    *fd = value;
+    return true;
+}
+
+/**
+ * @brief Get a string argument.
+ * @return False after reporting a runtime error.
+ */
+static bool stringArgument(Value arg, ObjString** string)
+{
+    if (!IS_STRING(arg))
+    {
+        runtimeError("Expected a string.");
+        return false;
+    }
+
+    *string = AS_STRING(arg);
+    return true;
+}
+
+/**
+ * @brief Get an argument which is a number of milliseconds from now.
+ * @param deadline Where to store the time that many milliseconds from now.
+ * @return False after reporting a runtime error.
+ */
+static bool delayArgument(Value arg, uint64_t* deadline)
+{
+    // Written so that NaN is rejected too.
+    if (!IS_NUMBER(arg) || !(AS_NUMBER(arg) >= 0))
+    {
+        runtimeError("Delay must be a non-negative number of milliseconds.");
+        return false;
+    }
+
+    double milliseconds = AS_NUMBER(arg) < DELAY_MAX ? AS_NUMBER(arg) : DELAY_MAX;
+    *deadline = now() + (uint64_t)(milliseconds * 1000000);
+    return true;
+}
+
+/**
+ * @brief Get a fiber argument.
+ * @return False after reporting a runtime error.
+ */
+static bool fiberArgument(Value arg, ObjFiber** fiber)
+{
+    if (!IS_FIBER(arg))
+    {
+        runtimeError("Expected a fiber.");
+        return false;
+    }
+
+    *fiber = AS_FIBER(arg);
+    return true;
+}
+
+/**
+ * @brief Get the address of a Unix socket at a path.
+ * @return False if the path is too long.
+ */
+static bool unixAddress(ObjString* path, struct sockaddr_un* address)
+{
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    if (path->length >= (int)sizeof(address->sun_path)) return false;
+
+    memcpy(address->sun_path, path->chars, path->length);
+    return true;
+}
+
+/**
+ * @brief open(path, mode) opens a file for reading ("r"), writing ("w")
+ * or appending ("a"), and returns its file descriptor, or nil on failure.
+ */
+static bool openNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjString* path;
+    ObjString* mode;
+    if (!stringArgument(args[0], &path) || !stringArgument(args[1], &mode)) return false;
+
+    int flags;
+    if (strcmp(mode->chars, "r") == 0)
+    {
+        flags = O_RDONLY;
+    }
+    else if (strcmp(mode->chars, "w") == 0)
+    {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    }
+    else if (strcmp(mode->chars, "a") == 0)
+    {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+    else
+    {
+        runtimeError("Mode must be \"r\", \"w\" or \"a\".");
+        return false;
+    }
+
+    int fd = open(path->chars, flags | O_NONBLOCK | O_CLOEXEC, 0666);
+    *result = fd < 0 ? NIL_VAL : INT_VAL(fd);
+    return true;
+}
+
+/**
+ * @brief close(fd) closes a file descriptor, and returns whether it could.
+ */
+static bool closeNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    int fd;
+    if (!fdArgument(args[0], &fd)) return false;
+
+    *result = BOOL_VAL(close(fd) == 0);
+    return true;
+}
+
+/**
+ * @brief pipe() returns a list of the file descriptors
+ * of a new pipe's read end and write end, or nil on failure.
+ */
+static bool pipeNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        *result = NIL_VAL;
+        return true;
+    }
+
+    ObjList* list = newList();
+    writeValueArray(&list->elements, INT_VAL(fds[0]));
+    writeValueArray(&list->elements, INT_VAL(fds[1]));
+    *result = OBJ_VAL(list);
+    return true;
+}
+
+/**
+ * @brief listen(path) creates a Unix socket listening at a path,
+ * and returns its file descriptor, or nil on failure.
+ */
+static bool listenNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjString* path;
+    if (!stringArgument(args[0], &path)) return false;
+
+    *result = NIL_VAL;
+    struct sockaddr_un address;
+    if (!unixAddress(path, &address)) return true;
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    *result = INT_VAL(fd);
+    return true;
+}
+
+/**
+ * @brief connect(path) connects to a Unix socket listening at a path,
+ * and returns the connection's file descriptor, or nil on failure.
+ */
+static bool connectNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjString* path;
+    if (!stringArgument(args[0], &path)) return false;
+
+    *result = NIL_VAL;
+    struct sockaddr_un address;
+    if (!unixAddress(path, &address)) return true;
+
+    // Connecting to a local socket does not wait for the other end.
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) < 0)
+    {
+        close(fd);
+        return true;
+    }
+
+    *result = INT_VAL(fd);
+    return true;
+}
+
+/**
+ * @brief accept(fd) waits for a connection to a listening socket,
+ * and returns the connection's file descriptor, or nil on failure.
+ */
+static bool acceptNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Wait wait = {.kind = WAIT_ACCEPT};
+    if (!fdArgument(args[0], &wait.fd)) return false;
+
+    return perform(&wait, result);
+}
+
+/**
+ * @brief read(fd, count) waits until it can read from a file descriptor,
+ * and returns a string of up to count bytes. The string is empty at the
+ * end of the file, and nil on failure.
+ */
+static bool readNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Wait wait = {.kind = WAIT_READ};
+    if (!fdArgument(args[0], &wait.fd)) return false;
+
+    int32_t count;
+    if (!asIndex(args[1], &count) || count <= 0)
+    {
+        runtimeError("Count must be a positive integer.");
+        return false;
+    }
+    wait.count = count;
+
+    return perform(&wait, result);
+}
+
+/**
+ * @brief write(fd, string) waits until it has written all of a string
+ * to a file descriptor, and returns its length, or nil on failure.
+ * Writing to a pipe whose reader is gone raises SIGPIPE, unless the
+ * embedder ignores it, as the interpreter does.
+ */
+static bool writeNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Wait wait = {.kind = WAIT_WRITE};
+    if (!fdArgument(args[0], &wait.fd) || !stringArgument(args[1], &wait.data)) return false;
+
+    return perform(&wait, result);
+}
+
+/**
+ * @brief sleep(milliseconds) waits for a time, and returns nil.
+ */
+static bool sleepNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Wait wait = {.kind = WAIT_SLEEP};
+    if (!delayArgument(args[0], &wait.deadline)) return false;
+
+    return perform(&wait, result);
+}
+
+/**
+ * @brief timer(milliseconds, fiber) makes the event loop resume
+ * a fiber after a time, and returns the fiber.
+ */
+static bool timerNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    Wait wait = {.kind = WAIT_TIMER};
+    if (!delayArgument(args[0], &wait.deadline) || !fiberArgument(args[1], &wait.fiber)) return false;
+
+    EventLoop* loop = getLoop();
+    if (loop == NULL) return false;
+
+    Wait* timer = ALLOCATE(Wait, 1);
+    *timer = wait;
+    startWait(loop, timer);
+    *result = args[1];
+    return true;
+}
+
+/**
+ * @brief spawn(fiber) makes the event loop resume a fiber, and returns it.
+ * The loop keeps resuming it whenever it yields, until it finishes.
+ */
+static bool spawnNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjFiber* fiber;
+    if (!fiberArgument(args[0], &fiber)) return false;
+
+    EventLoop* loop = getLoop();
+    if (loop == NULL) return false;
+
+    schedule(loop, fiber);
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief runLoop() runs the event loop until no fiber is ready
+ * or waiting, and returns nil.
+ */
+static bool runLoopNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    if (vm.fiber != NULL && !inActorBody())
+    {
+        runtimeError("Can't run the event loop in a fiber.");
+        return false;
+    }
+
+    EventLoop* loop = getLoop();
+    if (loop == NULL) return false;
+
+    while (loop->readyCount > 0 || loop->waits != NULL)
+    {
+        if (!turn(loop)) return false;
+    }
+
+    *result = NIL_VAL;
+    return true;
+}
+
+/**
+ * @brief Define the natives for I/O and the event loop as globals of this thread's VM.
+ */
+void defineEventNatives()
+{
+    defineNative("open", 2, openNative);
+    defineNative("close", 1, closeNative);
+    defineNative("pipe", 0, pipeNative);
+    defineNative("listen", 1, listenNative);
+    defineNative("connect", 1, connectNative);
+    defineNative("accept", 1, acceptNative);
+    defineNative("read", 2, readNative);
+    defineNative("write", 2, writeNative);
+    defineNative("sleep", 1, sleepNative);
+    defineNative("timer", 2, timerNative);
+    defineNative("spawn", 1, spawnNative);
+    defineNative("runLoop", 0, runLoopNative);
+}
+
+#else
+
+/**
+ * @brief There is no event loop for this platform, so there are no I/O natives.
+ */
+void defineEventNatives()
+{
+}
+
+void freeEventLoop()
+{
+}
+
+#endif
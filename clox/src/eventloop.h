@@ -0,0 +1,11 @@
+#ifndef CLOX_EVENTLOOP_H
+#define CLOX_EVENTLOOP_H
+
+#include "common.h"
+#include "value.h"
+
+void defineEventNatives();
+void freeEventLoop();
+void retainLoopValues(void (*retain)(Value value));
+
+#endif
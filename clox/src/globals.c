@@ -0,0 +1,294 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "globals.h"
+#include "memory.h"
+#include "object.h"
+
+// An index entry of a name which was freed, which lookups probe past.
+#define TOMBSTONE -1
+
+/**
+ * @brief The name of a global variable, or a free slot.
+ * @param chars The name, or NULL if the slot is free.
+ * @param refCount How many programs use the slot, plus how many VMs
+ * have defined it.
+ * @param nextFree The next free slot, if this one is free, or -1.
+ */
+typedef struct
+{
+    char* chars;
+    int length;
+    uint32_t hash;
+    int refCount;
+    int nextFree;
+} GlobalName;
+
+/**
+ * @brief The process-wide mapping from global variable names to slots.
+ * Every program resolves a name to the same slot, so the values of
+ * globals can be kept in a flat array in each VM, and programs compiled
+ * separately (like REPL lines) see each other's globals.
+ * A slot is freed for another name once no program uses it and no VM
+ * has defined it, but not while programs are being built, as a
+ * program only takes its references once it is built.
+ * The names are only needed for error messages.
+ * @param count How many slots were ever handed out, named or free.
+ * @param named How many slots have a name.
+ * @param freeSlot The first free slot, or -1 if there is none.
+ * @param unreferenced Whether some named slot may have no references.
+ * @param building How many programs are being built.
+ * @param slots Open addressing index into names, storing slot + 1
+ * (0 is empty). indexCount counts the entries used, tombstones included.
+ */
+typedef struct
+{
+    int count;
+    int capacity;
+    GlobalName* names;
+    int named;
+    int freeSlot;
+    bool unreferenced;
+    int building;
+    int slotCapacity;
+    int indexCount;
+    int* slots;
+} GlobalNames;
+
+static pthread_mutex_t globalsLock = PTHREAD_MUTEX_INITIALIZER;
+static GlobalNames globals = {0, 0, NULL, 0, -1, false, 0, 0, 0, NULL};
+static atomic_int globalsCount = 0;
+
+/**
+ * @brief Find the index entry for a name.
+ * @return The entry holding the name's slot + 1, or if the
+ * name has no slot, the entry to put it in.
+ */
+static int* findSlot(int* slots, int capacity, const char* chars, int length, uint32_t hash)
+{
+    int index = hash & (capacity - 1);
+    int* tombstone = NULL;
+
+    while (true)
+    {
+        int* entry = slots + index;
+        if (*entry == 0) return tombstone != NULL ? tombstone : entry;
+
+        if (*entry == TOMBSTONE)
+        {
+            if (tombstone == NULL) tombstone = entry;
+        }
+        else
+        {
+            GlobalName* name = &globals.names[*entry - 1];
+            if (name->length == length && name->hash == hash &&
+                memcmp(name->chars, chars, length) == 0)
+            {
+                return entry;
+            }
+        }
+
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+/**
+ * @brief Rebuild the index, re-inserting every name and dropping tombstones.
+ * It is left at most a quarter full, so that it is rebuilt rarely.
+ */
+static void rebuildSlots()
+{
+    int capacity = GROW_CAPACITY(0);
+    while ((globals.named + 1) * 4 > capacity) capacity = GROW_CAPACITY(capacity);
+
+    int* slots = ALLOCATE(int, capacity);
+    memset(slots, 0, sizeof(int) * capacity);
+
+    for (int i = 0; i < globals.count; i++)
+    {
+        GlobalName* name = &globals.names[i];
+        if (name->chars == NULL) continue;
+        *findSlot(slots, capacity, name->chars, name->length, name->hash) = i + 1;
+    }
+
+    FREE_ARRAY(int, globals.slots, globals.slotCapacity);
+    globals.slots = slots;
+    globals.slotCapacity = capacity;
+    globals.indexCount = globals.named;
+}
+
+/**
+ * @brief Free the name of a slot, and the slot for another name.
+ */
+static void freeName(int slot)
+{
+    GlobalName* name = &globals.names[slot];
+    *findSlot(globals.slots, globals.slotCapacity, name->chars, name->length, name->hash) = TOMBSTONE;
+    FREE_ARRAY(char, name->chars, name->length + 1);
+    name->chars = NULL;
+    name->nextFree = globals.freeSlot;
+    globals.freeSlot = slot;
+    globals.named--;
+}
+
+/**
+ * @brief Free the names of the slots nothing references.
+ */
+static void sweepNames()
+{
+    for (int slot = 0; slot < globals.count; slot++)
+    {
+        GlobalName* name = &globals.names[slot];
+        if (name->chars != NULL && name->refCount == 0) freeName(slot);
+    }
+
+    globals.unreferenced = false;
+}
+
+/**
+ * @brief Start building a program, so that the slots it resolves are
+ * not freed before it can take references to them.
+ */
+void beginResolvingGlobals()
+{
+    pthread_mutex_lock(&globalsLock);
+    globals.building++;
+    pthread_mutex_unlock(&globalsLock);
+}
+
+/**
+ * @brief Finish building a program, freeing the slots resolved
+ * meanwhile which it did not take references to, once no other
+ * program is being built.
+ */
+void endResolvingGlobals()
+{
+    pthread_mutex_lock(&globalsLock);
+    globals.building--;
+    if (globals.building == 0 && globals.unreferenced)
+    {
+        enterSharedHeap();
+        sweepNames();
+        leaveSharedHeap();
+    }
+    pthread_mutex_unlock(&globalsLock);
+}
+
+/**
+ * @brief Get the slot of a global variable, giving the name
+ * a new slot if it has none yet. Only call it between
+ * beginResolvingGlobals() and endResolvingGlobals(), and take
+ * a reference to the slot before the latter to keep it.
+ * @return The slot, or -1 if there are too many globals.
+ */
+int resolveGlobal(const char* chars, int length)
+{
+    uint32_t hash = hashString(chars, length);
+
+    pthread_mutex_lock(&globalsLock);
+    enterSharedHeap();
+
+    // Keep the index at most half full.
+    if ((globals.indexCount + 1) * 2 > globals.slotCapacity) rebuildSlots();
+
+    int* entry = findSlot(globals.slots, globals.slotCapacity, chars, length, hash);
+    int slot = *entry > 0 ? *entry - 1 : -1;
+
+    if (slot == -1 && (globals.freeSlot != -1 || globals.count < GLOBALS_MAX))
+    {
+        if (globals.freeSlot != -1)
+        {
+            slot = globals.freeSlot;
+            globals.freeSlot = globals.names[slot].nextFree;
+        }
+        else
+        {
+            if (globals.count == globals.capacity)
+            {
+                int oldCapacity = globals.capacity;
+                int capacity = GROW_CAPACITY(oldCapacity);
+                globals.names = GROW_ARRAY(GlobalName, globals.names, oldCapacity, capacity);
+                globals.capacity = capacity;
+            }
+
+            slot = globals.count;
+            globals.count++;
+            atomic_store_explicit(&globalsCount, globals.count, memory_order_release);
+        }
+
+        GlobalName* name = &globals.names[slot];
+        name->chars = ALLOCATE(char, length + 1);
+        memcpy(name->chars, chars, length);
+        name->chars[length] = '\0';
+        name->length = length;
+        name->hash = hash;
+        name->refCount = 0;
+
+        if (*entry == 0) globals.indexCount++;
+        *entry = slot + 1;
+        globals.named++;
+        globals.unreferenced = true;
+    }
+
+    leaveSharedHeap();
+    pthread_mutex_unlock(&globalsLock);
+    return slot;
+}
+
+/**
+ * @brief Take a reference to a global slot, keeping its name.
+ */
+void retainGlobal(int slot)
+{
+    pthread_mutex_lock(&globalsLock);
+    globals.names[slot].refCount++;
+    pthread_mutex_unlock(&globalsLock);
+}
+
+/**
+ * @brief Drop a reference to a global slot. The slot is freed once
+ * it has none, or once no program is being built if one is.
+ */
+void releaseGlobal(int slot)
+{
+    pthread_mutex_lock(&globalsLock);
+    GlobalName* name = &globals.names[slot];
+    name->refCount--;
+    if (name->refCount == 0)
+    {
+        if (globals.building > 0)
+        {
+            globals.unreferenced = true;
+        }
+        else
+        {
+            enterSharedHeap();
+            freeName(slot);
+            leaveSharedHeap();
+        }
+    }
+    pthread_mutex_unlock(&globalsLock);
+}
+
+/**
+ * @brief Get the number of global slots handed out so far.
+ * Every slot used by a compiled program is below this number.
+ */
+int globalCount()
+{
+    return atomic_load_explicit(&globalsCount, memory_order_acquire);
+}
+
+/**
+ * @brief Get the name of the global variable in a slot.
+ * @return The name, or NULL if the slot is free.
+ */
+const char* globalName(int slot)
+{
+    pthread_mutex_lock(&globalsLock);
+    const char* name = globals.names[slot].chars;
+    pthread_mutex_unlock(&globalsLock);
+    return name;
+}
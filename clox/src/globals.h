@@ -0,0 +1,17 @@
+#ifndef CLOX_GLOBALS_H
+#define CLOX_GLOBALS_H
+
+#include "common.h"
+
+// Global slots are encoded as two-byte operands.
+#define GLOBALS_MAX (UINT16_MAX + 1)
+
+void beginResolvingGlobals();
+void endResolvingGlobals();
+int resolveGlobal(const char* chars, int length);
+void retainGlobal(int slot);
+void releaseGlobal(int slot);
+int globalCount();
+const char* globalName(int slot);
+
+#endif
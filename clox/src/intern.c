@@ -0,0 +1,166 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "intern.h"
+#include "memory.h"
+#include "metrics.h"
+#include "table.h"
+
+// Must be a power of two.
+#define SHARD_COUNT 64
+
+/**
+ * @brief One part of the process-wide table of interned strings.
+ * Each string belongs to exactly one shard, chosen by its hash.
+ */
+typedef struct
+{
+    pthread_rwlock_t lock;
+    Table strings;
+} Shard;
+
+/**
+ * @brief The process-wide table of interned strings, which every string
+ * of every VM and program is interned in, so that equal strings are always
+ * the same object. Lookups take a read lock on one shard only, so VMs rarely
+ * contend. Each string counts the tables of VMs and programs holding it,
+ * and is freed as soon as the last of them releases it.
+ */
+static Shard shards[SHARD_COUNT] = {
+    [0 ... SHARD_COUNT - 1] = {.lock = PTHREAD_RWLOCK_INITIALIZER},
+};
+
+/**
+ * @brief Get the shard responsible for a hash.
+ * The low bits pick the slot within a shard's table,
+ * so the high bits are used to pick the shard.
+ */
+static inline Shard* shardFor(uint32_t hash)
+{
+    return &shards[(hash >> 26) & (SHARD_COUNT - 1)];
+}
+
+/**
+ * @brief Find an interned string equal to a given buffer, taking
+ * a reference to it for the caller's table.
+ * @return The string, or NULL if it is not interned.
+ */
+ObjString* findSharedString(const char* chars, int length, uint32_t hash)
+{
+    Shard* shard = shardFor(hash);
+
+    // Taken under the lock, so that the string can't be freed meanwhile.
+    pthread_rwlock_rdlock(&shard->lock);
+    ObjString* string = tableFindString(&shard->strings, chars, length, hash);
+    if (string != NULL) atomic_fetch_add_explicit(&string->refCount, 1, memory_order_relaxed);
+    pthread_rwlock_unlock(&shard->lock);
+    return string;
+}
+
+/**
+ * @brief Intern a string, taking ownership of its buffer and
+ * a reference to the string for the caller's table.
+ * If another thread interned an equal string first, the
+ * buffer is freed and that string is returned instead.
+ */
+ObjString* addSharedString(char* chars, int length, uint32_t hash)
+{
+    // Allocated up front, as running out of memory can't unwind past the lock.
+    ObjString* string = ALLOCATE(ObjString, 1);
+    string->obj.type = OBJ_STRING;
+    string->obj.next = NULL;
+    string->length = length;
+    atomic_init(&string->refCount, 1);
+    string->chars = chars;
+    string->hash = hash;
+
+    Shard* shard = shardFor(hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    ObjString* interned = tableFindString(&shard->strings, chars, length, hash);
+    if (interned != NULL)
+    {
+        atomic_fetch_add_explicit(&interned->refCount, 1, memory_order_relaxed);
+    }
+    else
+    {
+        enterSharedHeap();
+        tableSet(&shard->strings, OBJ_VAL(string), NIL_VAL);
+        leaveSharedHeap();
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (interned != NULL)
+    {
+        FREE_ARRAY(char, chars, length + 1);
+        FREE(ObjString, string);
+        return interned;
+    }
+
+    countObject(OBJ_STRING, 1);
+    countString(length, 1);
+    return string;
+}
+
+/**
+ * @brief Take another reference to an interned string,
+ * which the caller already holds one to.
+ */
+void retainSharedString(ObjString* string)
+{
+    atomic_fetch_add_explicit(&string->refCount, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Drop a reference to a string, freeing it if it was the last.
+ * A count above one is dropped without the lock. The last reference is only
+ * dropped under the write lock, so no lookup can take a new one meanwhile.
+ */
+static void releaseSharedString(ObjString* string)
+{
+    int count = atomic_load_explicit(&string->refCount, memory_order_relaxed);
+    while (count > 1)
+    {
+        if (atomic_compare_exchange_weak_explicit(&string->refCount, &count, count - 1,
+                                                  memory_order_acq_rel, memory_order_relaxed))
+        {
+            return;
+        }
+    }
+
+    Shard* shard = shardFor(string->hash);
+
+    pthread_rwlock_wrlock(&shard->lock);
+    bool last = atomic_fetch_sub_explicit(&string->refCount, 1, memory_order_acq_rel) == 1;
+    if (last)
+    {
+        enterSharedHeap();
+        tableDelete(&shard->strings, OBJ_VAL(string));
+        leaveSharedHeap();
+    }
+    pthread_rwlock_unlock(&shard->lock);
+
+    if (last)
+    {
+        countObject(OBJ_STRING, -1);
+        countString(string->length, -1);
+        FREE_ARRAY(char, string->chars, string->length + 1);
+        FREE(ObjString, string);
+    }
+}
+
+/**
+ * @brief Release every string held by a table of interned strings,
+ * and free the table.
+ */
+void releaseStringTable(Table* strings)
+{
+    for (int i = 0; i < strings->capacity; i++)
+    {
+        Entry* entry = &strings->entries[i];
+        if (!IS_UNDEFINED(entry->key)) releaseSharedString(AS_STRING(entry->key));
+    }
+
+    freeTable(strings);
+}
@@ -0,0 +1,13 @@
+#ifndef CLOX_INTERN_H
+#define CLOX_INTERN_H
+
+#include "common.h"
+#include "object.h"
+#include "table.h"
+
+ObjString* findSharedString(const char* chars, int length, uint32_t hash);
+ObjString* addSharedString(char* chars, int length, uint32_t hash);
+void retainSharedString(ObjString* string);
+void releaseStringTable(Table* strings);
+
+#endif
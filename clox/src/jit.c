@@ -0,0 +1,815 @@
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "jit.h"
+#include "memory.h"
+
+static atomic_bool jitOn = false;
+
+/**
+ * @brief Turn compiling programs to machine code on or off.
+ * Only has an effect on platforms with a JIT.
+ */
+void enableJit(bool enabled)
+{
+    atomic_store(&jitOn, enabled);
+}
+
+/**
+ * @brief Check if programs should be compiled to machine code.
+ */
+bool jitEnabled()
+{
+    return atomic_load(&jitOn);
+}
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/*
+ * A copy-and-patch baseline JIT. Each instruction is compiled by copying
+ * one or more stencils (fixed machine code templates) into a buffer and
+ * patching their holes with operands: constant addresses, stack offsets,
+ * helper addresses and jump targets.
+ *
+ * While compiled code runs, rbx holds the stack top and r12 points to
+ * the VM. The stack top is written back to the VM around helper calls.
+ * Instructions without a stencil of their own (and the slow paths of
+ * those with one) call runInstruction(), so they behave exactly as in
+ * the interpreter, including runtime errors and their line numbers.
+ *
+ * Values are moved as two quadwords (type, payload), never as one
+ * 16-byte access, since arithmetic writes only the payload and a wide
+ * load spanning a narrower store cannot be forwarded from it.
+ */
+
+#define H 0x00 // A hole, patched after copying.
+
+// push rbx; push r12; push r13; mov r12, rdi; mov rbx, [r12 + stackTop]
+static const uint8_t PROLOGUE[] = {
+    0x53, 0x41, 0x54, 0x41, 0x55, 0x49, 0x89, 0xFC,
+    0x49, 0x8B, 0x9C, 0x24, H, H, H, H,
+};
+#define PROLOGUE_STACK_TOP 12
+
+// mov [r12 + stackTop], rbx; pop r13; pop r12; pop rbx; ret
+static const uint8_t EPILOGUE[] = {
+    0x49, 0x89, 0x9C, 0x24, H, H, H, H,
+    0x41, 0x5D, 0x41, 0x5C, 0x5B, 0xC3,
+};
+#define EPILOGUE_STACK_TOP 4
+
+// xor eax, eax; jmp epilogue
+static const uint8_t RETURN[] = {
+    0x31, 0xC0, 0xE9, H, H, H, H,
+};
+#define RETURN_EXIT 3
+
+// mov [r12 + stackTop], rbx; mov edi, offset; mov rax, helper; call rax;
+// mov rbx, [r12 + stackTop]; test eax, eax; jnz epilogue
+static const uint8_t CALL[] = {
+    0x49, 0x89, 0x9C, 0x24, H, H, H, H,
+    0xBF, H, H, H, H,
+    0x48, 0xB8, H, H, H, H, H, H, H, H,
+    0xFF, 0xD0,
+    0x49, 0x8B, 0x9C, 0x24, H, H, H, H,
+    0x85, 0xC0, 0x0F, 0x85, H, H, H, H,
+};
+#define CALL_SAVE_STACK_TOP 4
+#define CALL_OFFSET 9
+#define CALL_HELPER 15
+#define CALL_LOAD_STACK_TOP 29
+#define CALL_EXIT 37
+
+// mov rax, &constant; mov rdx, [rax + 8]; mov rax, [rax];
+// mov [rbx], rax; mov [rbx + 8], rdx; add rbx, 16
+static const uint8_t CONSTANT[] = {
+    0x48, 0xB8, H, H, H, H, H, H, H, H,
+    0x48, 0x8B, 0x50, 0x08, 0x48, 0x8B, 0x00,
+    0x48, 0x89, 0x03, 0x48, 0x89, 0x53, 0x08,
+    0x48, 0x83, 0xC3, 0x10,
+};
+#define CONSTANT_ADDRESS 2
+
+// mov qword [rbx], type; mov qword [rbx + 8], payload; add rbx, 16
+static const uint8_t LITERAL[] = {
+    0x48, 0xC7, 0x03, H, H, H, H,
+    0x48, 0xC7, 0x43, 0x08, H, H, H, H,
+    0x48, 0x83, 0xC3, 0x10,
+};
+#define LITERAL_TYPE 3
+#define LITERAL_PAYLOAD 11
+
+// sub rbx, 16 * count
+static const uint8_t POPN[] = {
+    0x48, 0x81, 0xEB, H, H, H, H,
+};
+#define POPN_BYTES 3
+
+// mov rax, [r12 + slot]; mov rdx, [r12 + slot + 8];
+// mov [rbx], rax; mov [rbx + 8], rdx; add rbx, 16
+static const uint8_t GET_LOCAL[] = {
+    0x49, 0x8B, 0x84, 0x24, H, H, H, H,
+    0x49, 0x8B, 0x94, 0x24, H, H, H, H,
+    0x48, 0x89, 0x03, 0x48, 0x89, 0x53, 0x08,
+    0x48, 0x83, 0xC3, 0x10,
+};
+#define GET_LOCAL_TYPE 4
+#define GET_LOCAL_PAYLOAD 12
+
+// mov rax, [rbx - 16]; mov rdx, [rbx - 8];
+// mov [r12 + slot], rax; mov [r12 + slot + 8], rdx
+static const uint8_t SET_LOCAL[] = {
+    0x48, 0x8B, 0x43, 0xF0, 0x48, 0x8B, 0x53, 0xF8,
+    0x49, 0x89, 0x84, 0x24, H, H, H, H,
+    0x49, 0x89, 0x94, 0x24, H, H, H, H,
+};
+#define SET_LOCAL_TYPE 12
+#define SET_LOCAL_PAYLOAD 20
+
+// cmp dword [rbx - 16], type; jne other; cmp dword [rbx - 32], type; jne other
+static const uint8_t GUARD_TYPES[] = {
+    0x83, 0x7B, 0xF0, H, 0x0F, 0x85, H, H, H, H,
+    0x83, 0x7B, 0xE0, H, 0x0F, 0x85, H, H, H, H,
+};
+#define GUARD_TYPE_B 3
+#define GUARD_OTHER_B 6
+#define GUARD_TYPE_A 13
+#define GUARD_OTHER_A 16
+
+// Load a number, whichever way it is stored, into xmm<n> as a double:
+// cmp dword [rbx + type], VAL_INT; jne double; pxor xmm<n>, xmm<n>;
+// cvtsi2sd xmm<n>, dword [rbx + payload]; jmp loaded;
+// double: cmp dword [rbx + type], VAL_NUMBER; jne slow; movsd xmm<n>, [rbx + payload]
+// (Clearing the register first keeps the conversion from depending on its old value.)
+static const uint8_t LOAD_NUMBER[] = {
+    0x83, 0x7B, H, H,
+    0x75, 0x0B,
+    0x66, 0x0F, 0xEF, H,
+    0xF2, 0x0F, 0x2A, H, H,
+    0xEB, 0x0F,
+    0x83, 0x7B, H, H,
+    0x0F, 0x85, H, H, H, H,
+    0xF2, 0x0F, 0x10, H, H,
+};
+#define LOAD_TYPE_INT 2
+#define LOAD_INT 3
+#define LOAD_CLEAR 9
+#define LOAD_CONVERT 13
+#define LOAD_CONVERT_PAYLOAD 14
+#define LOAD_TYPE_NUMBER 19
+#define LOAD_NUMBER_TYPE 20
+#define LOAD_SLOW 23
+#define LOAD_MOVE 30
+#define LOAD_MOVE_PAYLOAD 31
+
+// movsd xmm0, [rbx - 24]; <op>sd xmm0, [rbx - 8]; movsd [rbx - 24], xmm0; sub rbx, 16
+static const uint8_t DOUBLE_ARITHMETIC[] = {
+    0xF2, 0x0F, 0x10, 0x43, 0xE8,
+    0xF2, 0x0F, H, 0x43, 0xF8,
+    0xF2, 0x0F, 0x11, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+};
+#define DOUBLE_ARITHMETIC_OP 7
+
+// movsd xmm0, [left]; ucomisd xmm0, [right]; set<cc> al; movzx eax, al;
+// mov qword [rbx - 32], VAL_BOOL; mov [rbx - 24], rax; sub rbx, 16
+static const uint8_t DOUBLE_COMPARE[] = {
+    0xF2, 0x0F, 0x10, 0x43, H,
+    0x66, 0x0F, 0x2E, 0x43, H,
+    0x0F, H, 0xC0,
+    0x0F, 0xB6, 0xC0,
+    0x48, 0xC7, 0x43, 0xE0, H, H, H, H,
+    0x48, 0x89, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+};
+#define DOUBLE_COMPARE_LEFT 4
+#define DOUBLE_COMPARE_RIGHT 9
+#define DOUBLE_COMPARE_SETCC 11
+#define DOUBLE_COMPARE_TYPE 20
+
+// <op>sd xmm0, xmm1; movsd [rbx - 24], xmm0; mov qword [rbx - 32], VAL_NUMBER;
+// sub rbx, 16; jmp done
+static const uint8_t ARITHMETIC[] = {
+    0xF2, 0x0F, H, 0xC1,
+    0xF2, 0x0F, 0x11, 0x43, 0xE8,
+    0x48, 0xC7, 0x43, 0xE0, H, H, H, H,
+    0x48, 0x83, 0xEB, 0x10,
+    0xE9, H, H, H, H,
+};
+#define ARITHMETIC_OP 2
+#define ARITHMETIC_TYPE 13
+#define ARITHMETIC_DONE 22
+
+// ucomisd <left>, <right>; set<cc> al; movzx eax, al;
+// mov qword [rbx - 32], VAL_BOOL; mov [rbx - 24], rax; sub rbx, 16; jmp done
+static const uint8_t COMPARE[] = {
+    0x66, 0x0F, 0x2E, H,
+    0x0F, H, 0xC0,
+    0x0F, 0xB6, 0xC0,
+    0x48, 0xC7, 0x43, 0xE0, H, H, H, H,
+    0x48, 0x89, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+    0xE9, H, H, H, H,
+};
+#define COMPARE_REGISTERS 3
+#define COMPARE_SETCC 5
+#define COMPARE_TYPE 14
+#define COMPARE_DONE 27
+
+// jmp target
+static const uint8_t JUMP[] = {
+    0xE9, H, H, H, H,
+};
+#define JUMP_TARGET 1
+
+// mov eax, [rbx - 24]; <op> eax, [rbx - 8]; jo slow; mov [rbx - 24], rax;
+// sub rbx, 16; jmp done
+static const uint8_t INT_ARITHMETIC[] = {
+    0x8B, 0x43, 0xE8,
+    H, 0x43, 0xF8,
+    0x0F, 0x80, H, H, H, H,
+    0x48, 0x89, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+    0xE9, H, H, H, H,
+};
+#define INT_ARITHMETIC_OP 3
+#define INT_ARITHMETIC_SLOW 8
+#define INT_ARITHMETIC_DONE 21
+
+// mov eax, [rbx - 24]; imul eax, [rbx - 8]; jo slow; test eax, eax; jz slow;
+// mov [rbx - 24], rax; sub rbx, 16; jmp done
+static const uint8_t INT_MULTIPLY[] = {
+    0x8B, 0x43, 0xE8,
+    0x0F, 0xAF, 0x43, 0xF8,
+    0x0F, 0x80, H, H, H, H,
+    0x85, 0xC0, 0x0F, 0x84, H, H, H, H,
+    0x48, 0x89, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+    0xE9, H, H, H, H,
+};
+#define INT_MULTIPLY_SLOW 9
+#define INT_MULTIPLY_ZERO 17
+#define INT_MULTIPLY_DONE 30
+
+// mov eax, [rbx - 24]; cmp eax, [rbx - 8]; set<cc> al; movzx eax, al;
+// mov qword [rbx - 32], VAL_BOOL; mov [rbx - 24], rax; sub rbx, 16; jmp done
+static const uint8_t INT_COMPARE[] = {
+    0x8B, 0x43, 0xE8,
+    0x3B, 0x43, 0xF8,
+    0x0F, H, 0xC0,
+    0x0F, 0xB6, 0xC0,
+    0x48, 0xC7, 0x43, 0xE0, H, H, H, H,
+    0x48, 0x89, 0x43, 0xE8,
+    0x48, 0x83, 0xEB, 0x10,
+    0xE9, H, H, H, H,
+};
+#define INT_COMPARE_SETCC 7
+#define INT_COMPARE_TYPE 16
+#define INT_COMPARE_DONE 29
+
+#undef H
+
+// Displacements of the operands' types and payloads from the stack top.
+#define OPERAND_A_TYPE (-32)
+#define OPERAND_A (-24)
+#define OPERAND_B_TYPE (-16)
+#define OPERAND_B (-8)
+
+// The registers doubles are loaded into.
+#define XMM_A 0
+#define XMM_B 1
+
+#define INT_ADD 0x03
+#define INT_SUBTRACT 0x2B
+#define INT_MULTIPLY_OP 0x0F // Stands for the two-byte imul.
+#define NO_INT_OP 0x00
+#define SSE_ADD 0x58
+#define SSE_MULTIPLY 0x59
+#define SSE_SUBTRACT 0x5C
+#define SSE_DIVIDE 0x5E
+#define SETA 0x97
+#define SETBE 0x96
+#define SETL 0x9C
+#define SETGE 0x9D
+#define SETLE 0x9E
+#define SETG 0x9F
+
+/**
+ * @brief A binary operation on two numbers.
+ * @param intOp The small integer instruction, or NO_INT_OP to
+ * leave two small integers to the doubles.
+ * @param intSetcc The condition a comparison of small integers tests for.
+ * @param sseOp The double instruction, or 0 for a comparison.
+ * @param left The register to compare against the other.
+ * @param setcc The condition a comparison of doubles tests for.
+ */
+typedef struct
+{
+    uint8_t intOp;
+    uint8_t intSetcc;
+    uint8_t sseOp;
+    uint8_t left;
+    uint8_t right;
+    uint8_t setcc;
+} NumberOp;
+
+/**
+ * @brief The rest of a number operation, for operands other than two
+ * doubles. It is placed after all the instructions, which keeps the
+ * common paths close together.
+ * @param guard The position of the guard jumping to it.
+ * @param resume Where to continue once the instruction has run.
+ */
+typedef struct
+{
+    int offset;
+    NumberOp op;
+    int guard;
+    int resume;
+} NumberTail;
+
+/**
+ * @brief A buffer of machine code being assembled.
+ * @param exits Positions of jumps to the epilogue, patched once it is placed.
+ * @param tails Number operation tails to place once the instructions are.
+ */
+typedef struct
+{
+    int capacity;
+    int count;
+    uint8_t* code;
+    int exitCapacity;
+    int exitCount;
+    int* exits;
+    int tailCapacity;
+    int tailCount;
+    NumberTail* tails;
+} Assembler;
+
+static void patch8(Assembler* assembler, int at, uint8_t value)
+{
+    assembler->code[at] = value;
+}
+
+static void patch32(Assembler* assembler, int at, int32_t value)
+{
+    memcpy(assembler->code + at, &value, sizeof(value));
+}
+
+static void patch64(Assembler* assembler, int at, uint64_t value)
+{
+    memcpy(assembler->code + at, &value, sizeof(value));
+}
+
+/**
+ * @brief Patch a rel32 jump operand to land on a target position.
+ */
+static void patchJump(Assembler* assembler, int at, int target)
+{
+    patch32(assembler, at, target - (at + 4));
+}
+
+/**
+ * @brief Copy a stencil to the end of the code.
+ * @return The position of the copy, which holes are relative to.
+ */
+static int copyStencil(Assembler* assembler, const uint8_t* stencil, int size)
+{
+    if (assembler->count + size > assembler->capacity)
+    {
+        int oldCapacity = assembler->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < assembler->count + size) capacity *= 2;
+        assembler->code = GROW_ARRAY(uint8_t, assembler->code, oldCapacity, capacity);
+        assembler->capacity = capacity;
+    }
+
+    int start = assembler->count;
+    memcpy(assembler->code + start, stencil, size);
+    assembler->count += size;
+    return start;
+}
+
+#define COPY(assembler, stencil) copyStencil(assembler, stencil, sizeof(stencil))
+
+/**
+ * @brief Remember a jump to the epilogue.
+ */
+static void addExit(Assembler* assembler, int at)
+{
+    if (assembler->exitCount == assembler->exitCapacity)
+    {
+        int oldCapacity = assembler->exitCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        assembler->exits = GROW_ARRAY(int, assembler->exits, oldCapacity, capacity);
+        assembler->exitCapacity = capacity;
+    }
+
+    assembler->exits[assembler->exitCount++] = at;
+}
+
+/**
+ * @brief Emit a call to the interpreter for the instruction at an offset.
+ * @return The position of the call.
+ */
+static int emitCall(Assembler* assembler, int offset)
+{
+    int at = COPY(assembler, CALL);
+    patch32(assembler, at + CALL_SAVE_STACK_TOP, offsetof(VM, stackTop));
+    patch32(assembler, at + CALL_OFFSET, offset);
+    patch64(assembler, at + CALL_HELPER, (uint64_t)(uintptr_t)runInstruction);
+    patch32(assembler, at + CALL_LOAD_STACK_TOP, offsetof(VM, stackTop));
+    addExit(assembler, at + CALL_EXIT);
+    return at;
+}
+
+/**
+ * @brief Emit a push of a literal value.
+ */
+static void emitLiteral(Assembler* assembler, ValueType type, int32_t payload)
+{
+    int at = COPY(assembler, LITERAL);
+    patch32(assembler, at + LITERAL_TYPE, type);
+    patch32(assembler, at + LITERAL_PAYLOAD, payload);
+}
+
+/**
+ * @brief Emit a load of an operand into a register as a double.
+ * @return The position of the load, whose slow jump is taken
+ * if the operand is not a number.
+ */
+static int emitLoadNumber(Assembler* assembler, int8_t type, int8_t payload, uint8_t xmm)
+{
+    int at = COPY(assembler, LOAD_NUMBER);
+    patch8(assembler, at + LOAD_TYPE_INT, (uint8_t)type);
+    patch8(assembler, at + LOAD_INT, VAL_INT);
+    patch8(assembler, at + LOAD_CLEAR, 0xC0 | xmm << 3 | xmm);
+    patch8(assembler, at + LOAD_CONVERT, 0x43 | xmm << 3);
+    patch8(assembler, at + LOAD_CONVERT_PAYLOAD, (uint8_t)payload);
+    patch8(assembler, at + LOAD_TYPE_NUMBER, (uint8_t)type);
+    patch8(assembler, at + LOAD_NUMBER_TYPE, VAL_NUMBER);
+    patch8(assembler, at + LOAD_MOVE, 0x43 | xmm << 3);
+    patch8(assembler, at + LOAD_MOVE_PAYLOAD, (uint8_t)payload);
+    return at;
+}
+
+/**
+ * @brief Emit a guard that both operands have a type.
+ * @return The position of the guard, whose jumps are taken if not.
+ */
+static int emitGuard(Assembler* assembler, ValueType type)
+{
+    int at = COPY(assembler, GUARD_TYPES);
+    patch8(assembler, at + GUARD_TYPE_B, (uint8_t)type);
+    patch8(assembler, at + GUARD_TYPE_A, (uint8_t)type);
+    return at;
+}
+
+/**
+ * @brief Emit a binary operation on two numbers, for now only for two doubles.
+ * The rest of it is emitted by emitNumberTail().
+ */
+static void emitNumberOp(Assembler* assembler, int offset, NumberOp op)
+{
+    int guard = emitGuard(assembler, VAL_NUMBER);
+
+    if (op.sseOp == 0)
+    {
+        int at = COPY(assembler, DOUBLE_COMPARE);
+        patch8(assembler, at + DOUBLE_COMPARE_LEFT, op.left == XMM_A ? OPERAND_A : OPERAND_B);
+        patch8(assembler, at + DOUBLE_COMPARE_RIGHT, op.right == XMM_A ? OPERAND_A : OPERAND_B);
+        patch8(assembler, at + DOUBLE_COMPARE_SETCC, op.setcc);
+        patch32(assembler, at + DOUBLE_COMPARE_TYPE, VAL_BOOL);
+    }
+    else
+    {
+        int at = COPY(assembler, DOUBLE_ARITHMETIC);
+        patch8(assembler, at + DOUBLE_ARITHMETIC_OP, op.sseOp);
+    }
+
+    if (assembler->tailCount == assembler->tailCapacity)
+    {
+        int oldCapacity = assembler->tailCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        assembler->tails = GROW_ARRAY(NumberTail, assembler->tails, oldCapacity, capacity);
+        assembler->tailCapacity = capacity;
+    }
+
+    assembler->tails[assembler->tailCount++] =
+        (NumberTail){offset, op, guard, assembler->count};
+}
+
+/**
+ * @brief Emit the rest of a number operation. Two small integers are
+ * operated on as such, as long as the result is one too. Otherwise both
+ * operands are loaded as doubles, and anything other than a number falls
+ * back to the interpreter.
+ */
+static void emitNumberTail(Assembler* assembler, NumberTail* tail)
+{
+    NumberOp op = tail->op;
+    bool compare = op.sseOp == 0;
+    int slowJumps[4];
+    int slowJumpCount = 0;
+
+    patchJump(assembler, tail->guard + GUARD_OTHER_B, assembler->count);
+    patchJump(assembler, tail->guard + GUARD_OTHER_A, assembler->count);
+
+    if (compare || op.intOp != NO_INT_OP)
+    {
+        int guard = emitGuard(assembler, VAL_INT);
+        if (compare)
+        {
+            int at = COPY(assembler, INT_COMPARE);
+            patch8(assembler, at + INT_COMPARE_SETCC, op.intSetcc);
+            patch32(assembler, at + INT_COMPARE_TYPE, VAL_BOOL);
+            patchJump(assembler, at + INT_COMPARE_DONE, tail->resume);
+        }
+        else if (op.intOp == INT_MULTIPLY_OP)
+        {
+            // A zero product might have to be -0, so let the interpreter decide.
+            int at = COPY(assembler, INT_MULTIPLY);
+            slowJumps[slowJumpCount++] = at + INT_MULTIPLY_SLOW;
+            slowJumps[slowJumpCount++] = at + INT_MULTIPLY_ZERO;
+            patchJump(assembler, at + INT_MULTIPLY_DONE, tail->resume);
+        }
+        else
+        {
+            int at = COPY(assembler, INT_ARITHMETIC);
+            patch8(assembler, at + INT_ARITHMETIC_OP, op.intOp);
+            slowJumps[slowJumpCount++] = at + INT_ARITHMETIC_SLOW;
+            patchJump(assembler, at + INT_ARITHMETIC_DONE, tail->resume);
+        }
+        patchJump(assembler, guard + GUARD_OTHER_B, assembler->count);
+        patchJump(assembler, guard + GUARD_OTHER_A, assembler->count);
+    }
+
+    int loadA = emitLoadNumber(assembler, OPERAND_A_TYPE, OPERAND_A, XMM_A);
+    int loadB = emitLoadNumber(assembler, OPERAND_B_TYPE, OPERAND_B, XMM_B);
+    slowJumps[slowJumpCount++] = loadA + LOAD_SLOW;
+    slowJumps[slowJumpCount++] = loadB + LOAD_SLOW;
+
+    if (compare)
+    {
+        int at = COPY(assembler, COMPARE);
+        patch8(assembler, at + COMPARE_REGISTERS, 0xC0 | op.left << 3 | op.right);
+        patch8(assembler, at + COMPARE_SETCC, op.setcc);
+        patch32(assembler, at + COMPARE_TYPE, VAL_BOOL);
+        patchJump(assembler, at + COMPARE_DONE, tail->resume);
+    }
+    else
+    {
+        int at = COPY(assembler, ARITHMETIC);
+        patch8(assembler, at + ARITHMETIC_OP, op.sseOp);
+        patch32(assembler, at + ARITHMETIC_TYPE, VAL_NUMBER);
+        patchJump(assembler, at + ARITHMETIC_DONE, tail->resume);
+    }
+
+    int slow = emitCall(assembler, tail->offset);
+    for (int i = 0; i < slowJumpCount; i++) patchJump(assembler, slowJumps[i], slow);
+    int at = COPY(assembler, JUMP);
+    patchJump(assembler, at + JUMP_TARGET, tail->resume);
+}
+
+/**
+ * @brief Emit an arithmetic operation on two numbers.
+ */
+static void emitArithmetic(Assembler* assembler, int offset, uint8_t intOp, uint8_t sseOp)
+{
+    emitNumberOp(assembler, offset, (NumberOp){intOp, 0, sseOp, 0, 0, 0});
+}
+
+/**
+ * @brief Emit a comparison of two numbers, a NaN operand being unordered.
+ * @param intSetcc The condition to test small integers for.
+ * @param left The double register to compare against the other.
+ * @param setcc The condition to test doubles for.
+ */
+static void emitCompare(Assembler* assembler, int offset, uint8_t intSetcc,
+                        uint8_t left, uint8_t right, uint8_t setcc)
+{
+    emitNumberOp(assembler, offset, (NumberOp){NO_INT_OP, intSetcc, 0, left, right, setcc});
+}
+
+/**
+ * @brief Emit the code for one instruction.
+ * @return False if the instruction is not supported.
+ */
+static bool emitInstruction(Assembler* assembler, Chunk* chunk, int offset)
+{
+    uint8_t* operands = chunk->code + offset + 1;
+
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+    {
+        int at = COPY(assembler, CONSTANT);
+        patch64(assembler, at + CONSTANT_ADDRESS,
+                (uint64_t)(uintptr_t)&chunk->constants.values[operands[0]]);
+        return true;
+    }
+
+    case OP_INT8:
+        emitLiteral(assembler, VAL_INT, operands[0]);
+        return true;
+    case OP_INT16:
+        emitLiteral(assembler, VAL_INT, (operands[0] << 8) | operands[1]);
+        return true;
+
+    case OP_NIL:   emitLiteral(assembler, VAL_NIL, 0);   return true;
+    case OP_TRUE:  emitLiteral(assembler, VAL_BOOL, 1);  return true;
+    case OP_FALSE: emitLiteral(assembler, VAL_BOOL, 0);  return true;
+
+    case OP_POP:
+    case OP_POPN:
+    {
+        int count = chunk->code[offset] == OP_POP ? 1 : operands[0];
+        int at = COPY(assembler, POPN);
+        patch32(assembler, at + POPN_BYTES, count * (int32_t)sizeof(Value));
+        return true;
+    }
+
+    case OP_GET_LOCAL:
+    {
+        int slot = offsetof(VM, stack) + operands[0] * sizeof(Value);
+        int at = COPY(assembler, GET_LOCAL);
+        patch32(assembler, at + GET_LOCAL_TYPE, slot);
+        patch32(assembler, at + GET_LOCAL_PAYLOAD, slot + 8);
+        return true;
+    }
+
+    case OP_SET_LOCAL:
+    {
+        int slot = offsetof(VM, stack) + operands[0] * sizeof(Value);
+        int at = COPY(assembler, SET_LOCAL);
+        patch32(assembler, at + SET_LOCAL_TYPE, slot);
+        patch32(assembler, at + SET_LOCAL_PAYLOAD, slot + 8);
+        return true;
+    }
+
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_INT:
+        emitArithmetic(assembler, offset, INT_ADD, SSE_ADD);
+        return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_SUBTRACT_INT:
+        emitArithmetic(assembler, offset, INT_SUBTRACT, SSE_SUBTRACT);
+        return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_MULTIPLY_INT:
+        emitArithmetic(assembler, offset, INT_MULTIPLY_OP, SSE_MULTIPLY);
+        return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        emitArithmetic(assembler, offset, NO_INT_OP, SSE_DIVIDE);
+        return true;
+
+    // a > b, and b > a for a < b. The negated comparisons are
+    // "below or equal", which is also true for unordered operands.
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_GREATER_INT:
+        emitCompare(assembler, offset, SETG, XMM_A, XMM_B, SETA);
+        return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_LESS_INT:
+        emitCompare(assembler, offset, SETL, XMM_B, XMM_A, SETA);
+        return true;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_GREATER_EQUAL_INT:
+        emitCompare(assembler, offset, SETGE, XMM_B, XMM_A, SETBE);
+        return true;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM:
+    case OP_LESS_EQUAL_INT:
+        emitCompare(assembler, offset, SETLE, XMM_A, XMM_B, SETBE);
+        return true;
+
+    case OP_RETURN:
+    {
+        int at = COPY(assembler, RETURN);
+        addExit(assembler, at + RETURN_EXIT);
+        return true;
+    }
+
+    // Instructions which only ever continue with the next one
+    // can be left to the interpreter.
+    case OP_DEFINE_GLOBAL:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_NOT:
+    case OP_NEGATE:
+    case OP_PRINT:
+    case OP_ADD_STR:
+    case OP_ADD_ANY:
+    case OP_CONCAT_N:
+    case OP_CALL:
+    case OP_BUILD_LIST:
+    case OP_GET_INDEX:
+    case OP_SET_INDEX:
+        emitCall(assembler, offset);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Compile a verified chunk to machine code.
+ * @return The code, or NULL if the chunk has an instruction the
+ * JIT does not support, in which case it is only interpreted.
+ */
+JitCode* compileJit(Chunk* chunk)
+{
+    Assembler assembler = {0, 0, NULL, 0, 0, NULL, 0, 0, NULL};
+
+    int prologue = COPY(&assembler, PROLOGUE);
+    patch32(&assembler, prologue + PROLOGUE_STACK_TOP, offsetof(VM, stackTop));
+
+    bool supported = true;
+    for (int offset = 0; offset < chunk->count && supported;
+         offset += instructionSize(chunk->code[offset]))
+    {
+        supported = emitInstruction(&assembler, chunk, offset);
+    }
+
+    JitCode* jit = NULL;
+    if (supported)
+    {
+        for (int i = 0; i < assembler.tailCount; i++)
+        {
+            emitNumberTail(&assembler, &assembler.tails[i]);
+        }
+
+        int epilogue = COPY(&assembler, EPILOGUE);
+        patch32(&assembler, epilogue + EPILOGUE_STACK_TOP, offsetof(VM, stackTop));
+        for (int i = 0; i < assembler.exitCount; i++)
+        {
+            patchJump(&assembler, assembler.exits[i], epilogue);
+        }
+
+        // Write the code while the memory is writable,
+        // then make it executable (but no longer writable).
+        void* memory = mmap(NULL, assembler.count, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            memcpy(memory, assembler.code, assembler.count);
+            if (mprotect(memory, assembler.count, PROT_READ | PROT_EXEC) == 0)
+            {
+                jit = ALLOCATE(JitCode, 1);
+                jit->memory = memory;
+                jit->size = assembler.count;
+                jit->entry = (CompiledCode)memory;
+            }
+            else
+            {
+                munmap(memory, assembler.count);
+            }
+        }
+    }
+
+    FREE_ARRAY(uint8_t, assembler.code, assembler.capacity);
+    FREE_ARRAY(int, assembler.exits, assembler.exitCapacity);
+    FREE_ARRAY(NumberTail, assembler.tails, assembler.tailCapacity);
+    return jit;
+}
+
+/**
+ * @brief Free compiled machine code.
+ */
+void freeJit(JitCode* jit)
+{
+    if (jit == NULL) return;
+
+    munmap(jit->memory, jit->size);
+    FREE(JitCode, jit);
+}
+
+#else
+
+/**
+ * @brief There is no JIT for this platform, so chunks are only interpreted.
+ */
+JitCode* compileJit(Chunk* chunk)
+{
+    return NULL;
+}
+
+void freeJit(JitCode* jit)
+{
+}
+
+#endif
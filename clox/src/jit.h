@@ -0,0 +1,23 @@
+#ifndef CLOX_JIT_H
+#define CLOX_JIT_H
+
+#include "chunk.h"
+#include "common.h"
+#include "vm.h"
+
+/**
+ * @brief Machine code compiled from a chunk.
+ */
+typedef struct JitCode
+{
+    void* memory;
+    size_t size;
+    CompiledCode entry;
+} JitCode;
+
+void enableJit(bool enabled);
+bool jitEnabled();
+JitCode* compileJit(Chunk* chunk);
+void freeJit(JitCode* jit);
+
+#endif
@@ -1,8 +1,18 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include "actor.h"
 #include "common.h"
+#include "compiler.h"
+#include "jit.h"
+#include "metrics.h"
+#include "trace.h"
+#include "transpiler.h"
 #include "vm.h"
 
 static void repl()
@@ -28,6 +38,7 @@ static void repl()
  */
 static char* readFile(const char* path)
 {
+    uint64_t start = traceStart();
     FILE* file = fopen(path, "rb");
     if (file == NULL)
     {
@@ -60,6 +71,7 @@ static char* readFile(const char* path)
     buffer[bytesRead] = '\0';
 
     fclose(file);
+    traceEnd("readFile", start);
     return buffer;
 }
 
@@ -68,27 +80,175 @@ static void runFile(const char* path)
     char* source = readFile(path);
     InterpretResult result = interpret(source);
     free(source);
+    waitForActors();
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+    if (result == INTERPRET_RUNTIME_ERROR || result == INTERPRET_OUT_OF_MEMORY) exit(70);
+}
+
+/**
+ * @brief Read the next part of a script from a file descriptor,
+ * returning whatever is available rather than waiting for a full buffer.
+ */
+static int readDescriptor(char* buffer, int size, void* context)
+{
+    int fd = *(int*)context;
+    ssize_t count;
+    do
+    {
+        count = read(fd, buffer, size);
+    } while (count < 0 && errno == EINTR);
+
+    return count > 0 ? (int)count : 0;
+}
+
+/**
+ * @brief Run a script as it is read, from a file or from standard input.
+ * @param path The file, or NULL for standard input.
+ */
+static void streamFile(const char* path)
+{
+    int fd = STDIN_FILENO;
+    if (path != NULL)
+    {
+        fd = open(path, O_RDONLY);
+        if (fd < 0)
+        {
+            fprintf(stderr, "Could not open file \"%s\".\n", path);
+            exit(74);
+        }
+    }
+
+    InterpretResult result = interpretStream(readDescriptor, &fd);
+    if (path != NULL) close(fd);
+    waitForActors();
+
+    if (result == INTERPRET_COMPILE_ERROR) exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR || result == INTERPRET_OUT_OF_MEMORY) exit(70);
+}
+
+/**
+ * @brief Translate a script to a C program which runs it.
+ */
+static void emitFile(const char* path, const char* output)
+{
+    char* source = readFile(path);
+    Program* program = compileProgram(source);
+    free(source);
+
+    if (program == NULL) exit(65);
+
+    FILE* file = fopen(output, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\".\n", output);
+        exit(74);
+    }
+
+    bool transpiled = transpileChunk(&program->chunk, file);
+    fclose(file);
+    releaseProgram(program);
+
+    if (!transpiled)
+    {
+        fprintf(stderr, "Could not translate \"%s\" to C.\n", path);
+        remove(output);
+        exit(65);
+    }
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: clox [--jit] [--parallel-compile] [--max-heap bytes] [--timings trace.json]"
+                    " [--metrics file [--metrics-interval seconds]] [--stream] [--emit-c output] [path]\n");
+    exit(64);
 }
 
 int main(int argc, const char* argv[])
 {
+    const char* path = NULL;
+    const char* output = NULL;
+    size_t heapLimit = 0;
+    bool stream = false;
+    const char* metricsPath = NULL;
+    int metricsInterval = 0;
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--jit") == 0)
+        {
+            enableJit(true);
+        }
+        else if (strcmp(argv[i], "--parallel-compile") == 0)
+        {
+            enableParallelCompile(true);
+        }
+        else if (strcmp(argv[i], "--stream") == 0)
+        {
+            stream = true;
+        }
+        else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc)
+        {
+            char* end;
+            heapLimit = strtoull(argv[++i], &end, 10);
+            if (*end != '\0' || heapLimit == 0) usage();
+        }
+        else if (strcmp(argv[i], "--timings") == 0 && i + 1 < argc)
+        {
+            startTrace(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc)
+        {
+            metricsPath = argv[++i];
+        }
+        else if (strcmp(argv[i], "--metrics-interval") == 0 && i + 1 < argc)
+        {
+            char* end;
+            metricsInterval = (int)strtol(argv[++i], &end, 10);
+            if (*end != '\0' || metricsInterval <= 0) usage();
+        }
+        else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc && output == NULL)
+        {
+            output = argv[++i];
+        }
+        else if (argv[i][0] == '-' || path != NULL)
+        {
+            usage();
+        }
+        else
+        {
+            path = argv[i];
+        }
+    }
+
+    if (output != NULL && (path == NULL || stream)) usage();
+    if (metricsInterval != 0 && metricsPath == NULL) usage();
+
+    // Started before any other thread, which must leave SIGUSR1 to it.
+    if (metricsPath != NULL) startMetrics(metricsPath, metricsInterval);
+
+    // Writing to a closed pipe should fail, not end the process.
+    signal(SIGPIPE, SIG_IGN);
+
     initVM();
+    setHeapLimit(heapLimit);
 
-    if (argc == 1)
+    if (output != NULL)
     {
-        repl();
+        emitFile(path, output);
+    }
+    else if (stream)
+    {
+        streamFile(path);
     }
-    else if (argc == 2)
+    else if (path == NULL)
     {
-        runFile(argv[1]);
+        repl();
+        waitForActors();
     }
     else
     {
-        fprintf(stderr, "Usage: clox [path]\n");
-        exit(64);
+        runFile(path);
     }
 
     freeVM();
@@ -1,36 +1,131 @@
 #include <stdlib.h>
 
 #include "memory.h"
+#include "metrics.h"
+#include "program.h"
+#include "trace.h"
 #include "vm.h"
 
+/**
+ * @brief Report that the VM is out of memory and unwind to the code
+ * running it, or exit if nothing is running.
+ */
+static void outOfMemory()
+{
+    if (vm.outOfMemory == NULL) exit(1);
+
+    runtimeError("Out of memory.");
+    longjmp(*vm.outOfMemory, 1);
+}
+
+/**
+ * @brief Allocate, resize or free memory, counting it against
+ * the VM's heap limit unless it is in the shared heap.
+ */
 void* reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
+    bool counted = vm.sharedHeapDepth == 0;
+    if (counted)
+    {
+        // Memory freed on this thread may have been counted by another VM.
+        size_t freed = oldSize < vm.bytesAllocated ? oldSize : vm.bytesAllocated;
+        vm.bytesAllocated -= freed;
+        if (vm.heapLimit != 0 && newSize > oldSize && vm.bytesAllocated + newSize > vm.heapLimit)
+        {
+            vm.bytesAllocated += freed;
+            outOfMemory();
+        }
+    }
+
     if (newSize == 0)
     {
         free(pointer);
+        traceAllocation(oldSize, 0);
+        countHeap(oldSize, 0);
         return NULL;
     }
 
     void* result = realloc(pointer, newSize);
-    if (result == NULL) exit(1);
-    
+    if (result == NULL)
+    {
+        if (!counted) exit(1);
+        vm.bytesAllocated += oldSize;
+        outOfMemory();
+    }
+
+    if (counted) vm.bytesAllocated += newSize;
+    traceAllocation(oldSize, newSize);
+    countHeap(oldSize, newSize);
     return result;
 }
 
+/**
+ * @brief Start allocating memory which belongs to no VM, like programs
+ * and process-wide tables. It may be freed on any thread, so it does not
+ * count against the heap limit, and running out of it exits the process.
+ */
+void enterSharedHeap()
+{
+    vm.sharedHeapDepth++;
+}
+
+/**
+ * @brief Go back to allocating memory in the VM's heap.
+ */
+void leaveSharedHeap()
+{
+    vm.sharedHeapDepth--;
+}
+
 static void freeObject(Obj* object)
 {
+    countObject(object->type, -1);
+
     switch (object->type)
     {
     case OBJ_STRING:
         ObjString* string = (ObjString*)object;
+        countString(string->length, -1);
         FREE_ARRAY(char, string->chars, string->length + 1);
         FREE(ObjString, object);
+        break;
+    case OBJ_NATIVE:
+        FREE(ObjNative, object);
+        break;
+    case OBJ_STRING_BUILDER:
+        ObjStringBuilder* builder = (ObjStringBuilder*)object;
+        FREE_ARRAY(char, builder->chars, builder->capacity);
+        FREE(ObjStringBuilder, object);
+        break;
+    case OBJ_LIST:
+        freeValueArray(&((ObjList*)object)->elements);
+        FREE(ObjList, object);
+        break;
+    case OBJ_ARRAY:
+        FREE_ARRAY(double, ((ObjArray*)object)->values, ((ObjArray*)object)->count);
+        FREE(ObjArray, object);
+        break;
+    case OBJ_MAP:
+        freeTable(&((ObjMap*)object)->table);
+        FREE(ObjMap, object);
+        break;
+    case OBJ_FIBER:
+        ObjFiber* fiber = (ObjFiber*)object;
+        if (fiber->program != NULL) releaseProgram(fiber->program);
+        FREE_ARRAY(Value, fiber->stack, fiber->capacity);
+        FREE(ObjFiber, object);
+        break;
+    case OBJ_ACTOR:
+        FREE(ObjActor, object);
+        break;
     }
 }
 
-void freeObjects()
+/**
+ * @brief Free every object in a linked list of objects.
+ */
+void freeObjectList(Obj* object)
 {
-    Obj* object = vm.objects;
     while (object != NULL)
     {
         Obj* next = object->next;
@@ -38,3 +133,11 @@ void freeObjects()
         object = next;
     }
 }
+
+/**
+ * @brief Free all objects owned by the VM.
+ */
+void freeObjects()
+{
+    freeObjectList(vm.objects);
+}
@@ -19,6 +19,9 @@
     reallocate(pointer, sizeof(type) * (oldCount), 0)
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void enterSharedHeap();
+void leaveSharedHeap();
+void freeObjectList(Obj* object);
 void freeObjects();
 
 #endif
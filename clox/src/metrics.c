@@ -0,0 +1,216 @@
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "metrics.h"
+
+bool metricsEnabled = false;
+
+#define OBJ_TYPE_COUNT (OBJ_ACTOR + 1)
+
+// The label of each type of object, indexed by ObjType.
+static const char* objectTypeNames[OBJ_TYPE_COUNT] = {
+    [OBJ_STRING] = "string",
+    [OBJ_NATIVE] = "native",
+    [OBJ_STRING_BUILDER] = "string_builder",
+    [OBJ_LIST] = "list",
+    [OBJ_ARRAY] = "array",
+    [OBJ_MAP] = "map",
+    [OBJ_FIBER] = "fiber",
+    [OBJ_ACTOR] = "actor",
+};
+
+/**
+ * @brief Counters kept for the whole process, by every thread.
+ * @param path Where snapshots are written, and temporaryPath
+ * where each is written first, so that it replaces the last at once.
+ * @param interval How many seconds between snapshots, or 0 to
+ * only write one when the process is sent SIGUSR1.
+ * @param stringTableCount, stringTableCapacity The entries and capacity
+ * of the tables of interned strings of all VMs, added up.
+ */
+typedef struct
+{
+    const char* path;
+    char* temporaryPath;
+    int interval;
+    sigset_t signals;
+    atomic_llong instructions;
+    atomic_llong objects[OBJ_TYPE_COUNT];
+    atomic_llong strings;
+    atomic_llong stringBytes;
+    atomic_llong stringTableCount;
+    atomic_llong stringTableCapacity;
+    atomic_llong allocatedBytes;
+    atomic_llong heapBytes;
+    atomic_llong scripts;
+} Metrics;
+
+static Metrics metrics;
+
+void recordInstructions(uint64_t count)
+{
+    atomic_fetch_add_explicit(&metrics.instructions, count, memory_order_relaxed);
+}
+
+void recordObject(ObjType type, int change)
+{
+    atomic_fetch_add_explicit(&metrics.objects[type], change, memory_order_relaxed);
+}
+
+void recordString(int length, int change)
+{
+    atomic_fetch_add_explicit(&metrics.strings, change, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.stringBytes, (long long)length * change, memory_order_relaxed);
+}
+
+void recordStringTable(int count, int capacity)
+{
+    atomic_fetch_add_explicit(&metrics.stringTableCount, count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&metrics.stringTableCapacity, capacity, memory_order_relaxed);
+}
+
+void recordHeap(size_t oldSize, size_t newSize)
+{
+    if (newSize > oldSize)
+    {
+        atomic_fetch_add_explicit(&metrics.allocatedBytes, newSize - oldSize, memory_order_relaxed);
+    }
+    atomic_fetch_add_explicit(&metrics.heapBytes, (long long)newSize - (long long)oldSize,
+                              memory_order_relaxed);
+}
+
+void recordScript()
+{
+    atomic_fetch_add_explicit(&metrics.scripts, 1, memory_order_relaxed);
+}
+
+/**
+ * @brief Write one metric without labels, with its help and type lines.
+ */
+static void writeMetric(FILE* file, const char* name, const char* type,
+                        const char* help, long long value)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s %s\n%s %lld\n", name, help, name, type, name, value);
+}
+
+/**
+ * @brief Write a snapshot of the counters in the Prometheus text
+ * exposition format.
+ */
+static bool writeSnapshot(FILE* file)
+{
+    writeMetric(file, "clox_instructions_total", "counter",
+                "Bytecode instructions run by the interpreter.",
+                atomic_load(&metrics.instructions));
+    writeMetric(file, "clox_scripts_total", "counter",
+                "Scripts compiled and run.", atomic_load(&metrics.scripts));
+
+    fprintf(file, "# HELP clox_objects Objects alive, by type.\n# TYPE clox_objects gauge\n");
+    for (int type = 0; type < OBJ_TYPE_COUNT; type++)
+    {
+        fprintf(file, "clox_objects{type=\"%s\"} %lld\n",
+                objectTypeNames[type], (long long)atomic_load(&metrics.objects[type]));
+    }
+
+    writeMetric(file, "clox_interned_strings", "gauge",
+                "Interned strings alive.", atomic_load(&metrics.strings));
+    writeMetric(file, "clox_interned_string_bytes", "gauge",
+                "Characters in the interned strings alive.", atomic_load(&metrics.stringBytes));
+
+    long long count = atomic_load(&metrics.stringTableCount);
+    long long capacity = atomic_load(&metrics.stringTableCapacity);
+    fprintf(file, "# HELP clox_vm_strings_load_factor Entries per slot of the VMs' tables "
+            "of interned strings.\n# TYPE clox_vm_strings_load_factor gauge\n"
+            "clox_vm_strings_load_factor %g\n", capacity > 0 ? (double)count / capacity : 0.0);
+
+    writeMetric(file, "clox_allocated_bytes_total", "counter",
+                "Bytes allocated through the VM's allocator.", atomic_load(&metrics.allocatedBytes));
+    writeMetric(file, "clox_heap_bytes", "gauge",
+                "Bytes allocated through the VM's allocator and not freed.",
+                atomic_load(&metrics.heapBytes));
+
+    return !ferror(file);
+}
+
+/**
+ * @brief Write a snapshot to a temporary file and then move it into place,
+ * so that a scraper never reads one which is half written.
+ */
+static void writeMetrics()
+{
+    FILE* file = fopen(metrics.temporaryPath, "w");
+    bool written = file != NULL && writeSnapshot(file);
+    if (file != NULL && fclose(file) != 0) written = false;
+
+    if (!written || rename(metrics.temporaryPath, metrics.path) != 0)
+    {
+        fprintf(stderr, "Could not write metrics to \"%s\".\n", metrics.path);
+        remove(metrics.temporaryPath);
+    }
+}
+
+/**
+ * @brief Write a snapshot each time the process is sent SIGUSR1,
+ * and every interval if there is one.
+ * The signal is handled on this thread, outside of any signal handler,
+ * so writing the file is safe.
+ */
+static void* runMetrics(void* context)
+{
+    (void)context;
+
+    while (true)
+    {
+        if (metrics.interval > 0)
+        {
+            struct timespec timeout = {.tv_sec = metrics.interval};
+            sigtimedwait(&metrics.signals, NULL, &timeout);
+        }
+        else
+        {
+            int signal;
+            sigwait(&metrics.signals, &signal);
+        }
+
+        writeMetrics();
+    }
+
+    return NULL;
+}
+
+/**
+ * @brief Start keeping counters, and a thread which writes them to a file
+ * when the process is sent SIGUSR1. This must be called before any other
+ * thread is started, as they must all leave the signal to that thread.
+ * @param path The file, which must live as long as the process.
+ * @param interval How many seconds between snapshots written anyway, or 0.
+ */
+void startMetrics(const char* path, int interval)
+{
+    metrics.path = path;
+    metrics.interval = interval;
+
+    size_t length = strlen(path);
+    metrics.temporaryPath = malloc(length + sizeof(".tmp"));
+    if (metrics.temporaryPath == NULL) exit(1);
+    memcpy(metrics.temporaryPath, path, length);
+    memcpy(metrics.temporaryPath + length, ".tmp", sizeof(".tmp"));
+
+    sigemptyset(&metrics.signals);
+    sigaddset(&metrics.signals, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &metrics.signals, NULL);
+
+    metricsEnabled = true;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, runMetrics, NULL) != 0)
+    {
+        fprintf(stderr, "Could not start the metrics thread.\n");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
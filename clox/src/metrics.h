@@ -0,0 +1,67 @@
+#ifndef CLOX_METRICS_H
+#define CLOX_METRICS_H
+
+#include "common.h"
+#include "value.h"
+
+// Set once, before any other thread starts, and never changed after.
+extern bool metricsEnabled;
+
+void startMetrics(const char* path, int interval);
+void recordInstructions(uint64_t count);
+void recordObject(ObjType type, int change);
+void recordString(int length, int change);
+void recordStringTable(int count, int capacity);
+void recordHeap(size_t oldSize, size_t newSize);
+void recordScript();
+
+/**
+ * @brief Count instructions run by an interpreter, if metrics are on.
+ */
+static inline void countInstructions(uint64_t count)
+{
+    if (metricsEnabled) recordInstructions(count);
+}
+
+/**
+ * @brief Count an object being made (1) or freed (-1), if metrics are on.
+ */
+static inline void countObject(ObjType type, int change)
+{
+    if (metricsEnabled) recordObject(type, change);
+}
+
+/**
+ * @brief Count an interned string being made (1) or freed (-1), if metrics are on.
+ */
+static inline void countString(int length, int change)
+{
+    if (metricsEnabled) recordString(length, change);
+}
+
+/**
+ * @brief Count a change in the entries and capacity of a VM's
+ * table of interned strings, if metrics are on.
+ */
+static inline void countStringTable(int count, int capacity)
+{
+    if (metricsEnabled) recordStringTable(count, capacity);
+}
+
+/**
+ * @brief Count an allocation, resizing or freeing of memory, if metrics are on.
+ */
+static inline void countHeap(size_t oldSize, size_t newSize)
+{
+    if (metricsEnabled) recordHeap(oldSize, newSize);
+}
+
+/**
+ * @brief Count a script being run, if metrics are on.
+ */
+static inline void countScript()
+{
+    if (metricsEnabled) recordScript();
+}
+
+#endif
@@ -0,0 +1,729 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "actor.h"
+#include "eventloop.h"
+#include "memory.h"
+#include "natives.h"
+#include "numeric.h"
+#include "object.h"
+#include "vm.h"
+
+/**
+ * @brief Append a value to a string builder the way print would show it.
+ */
+static void appendValue(ObjStringBuilder* builder, Value value)
+{
+    TextSink sink = {NULL, builder};
+    formatValue(&sink, value);
+}
+
+/**
+ * @brief stringBuilder() returns a new, empty string builder.
+ */
+static bool stringBuilderNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    *result = OBJ_VAL(newStringBuilder());
+    return true;
+}
+
+/**
+ * @brief Get a list argument.
+ * @return False after reporting a runtime error.
+ */
+static bool listArgument(Value arg, ObjList** list)
+{
+    if (!IS_LIST(arg))
+    {
+        runtimeError("Expected a list.");
+        return false;
+    }
+
+    *list = AS_LIST(arg);
+    return true;
+}
+
+/**
+ * @brief Get an array argument.
+ * @return False after reporting a runtime error.
+ */
+static bool arrayArgument(Value arg, ObjArray** array)
+{
+    if (!IS_ARRAY(arg))
+    {
+        runtimeError("Expected an array.");
+        return false;
+    }
+
+    *array = AS_ARRAY(arg);
+    return true;
+}
+
+/**
+ * @brief Get two array arguments of the same length.
+ * @return False after reporting a runtime error.
+ */
+static bool arrayArguments(Value* args, ObjArray** a, ObjArray** b)
+{
+    if (!arrayArgument(args[0], a) || !arrayArgument(args[1], b)) return false;
+
+    if ((*a)->count != (*b)->count)
+    {
+        runtimeError("Arrays must have the same length.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief Get a number argument.
+ * @return False after reporting a runtime error.
+ */
+static bool numberArgument(Value arg, double* number)
+{
+    if (!IS_NUMBER(arg))
+    {
+        runtimeError("Expected a number.");
+        return false;
+    }
+
+    *number = AS_NUMBER(arg);
+    return true;
+}
+
+/**
+ * @brief Get a count argument.
+ * @return False after reporting a runtime error.
+ */
+static bool countArgument(Value arg, int* count)
+{
+    int32_t index;
+    if (!asIndex(arg, &index) || index < 0)
+    {
+        runtimeError("Count must be a non-negative integer.");
+        return false;
+    }
+
+    *count = index;
+    return true;
+}
+
+/**
+ * @brief Get an argument which is a position in a list or array
+ * of count elements, counting the position just past the end.
+ * @return False after reporting a runtime error.
+ */
+static bool positionArgument(Value arg, int count, int* position)
+{
+    int32_t index;
+    if (!asIndex(arg, &index))
+    {
+        runtimeError("Index must be an integer.");
+        return false;
+    }
+
+    if (index < 0 || index > count)
+    {
+        runtimeError("Index out of range.");
+        return false;
+    }
+
+    *position = index;
+    return true;
+}
+
+/**
+ * @brief Make room in a list for a number of elements in one allocation.
+ */
+static void reserveElements(ValueArray* elements, int count)
+{
+    if (count <= elements->capacity) return;
+
+    elements->values = GROW_ARRAY(Value, elements->values, elements->capacity, count);
+    elements->capacity = count;
+}
+
+/**
+ * @brief append(builder, value) appends a value, shown as print would
+ * show it, to a string builder. append(list, value) appends a value
+ * to a list. Either returns its first argument.
+ */
+static bool appendNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (IS_STRING_BUILDER(args[0]))
+    {
+        appendValue(AS_STRING_BUILDER(args[0]), args[1]);
+    }
+    else if (IS_LIST(args[0]))
+    {
+        writeValueArray(&AS_LIST(args[0])->elements, args[1]);
+    }
+    else
+    {
+        runtimeError("Can only append to a list or a string builder.");
+        return false;
+    }
+
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief length(value) returns the length of a list, an array,
+ * a string or a string builder.
+ */
+static bool lengthNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (IS_LIST(args[0]))
+    {
+        *result = INT_VAL(AS_LIST(args[0])->elements.count);
+    }
+    else if (IS_ARRAY(args[0]))
+    {
+        *result = INT_VAL(AS_ARRAY(args[0])->count);
+    }
+    else if (IS_STRING(args[0]))
+    {
+        *result = INT_VAL(AS_STRING(args[0])->length);
+    }
+    else if (IS_STRING_BUILDER(args[0]))
+    {
+        *result = INT_VAL(AS_STRING_BUILDER(args[0])->length);
+    }
+    else
+    {
+        runtimeError("Can only get the length of lists, arrays and strings.");
+        return false;
+    }
+
+    return true;
+}
+
+/**
+ * @brief fill(list, value, count) makes a list or an array hold count
+ * elements, all of them the value, and returns it.
+ */
+static bool fillNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    int count;
+    if (!countArgument(args[2], &count)) return false;
+
+    if (IS_ARRAY(args[0]))
+    {
+        double value;
+        if (!numberArgument(args[1], &value)) return false;
+
+        ObjArray* array = AS_ARRAY(args[0]);
+        resizeArray(array, count);
+        fillDoubles(array->values, value, count);
+    }
+    else
+    {
+        ObjList* list;
+        if (!listArgument(args[0], &list)) return false;
+
+        ValueArray* elements = &list->elements;
+        reserveElements(elements, count);
+        for (int i = 0; i < count; i++) elements->values[i] = args[1];
+        elements->count = count;
+    }
+
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief slice(list, start, end) returns a new list or array with the
+ * elements of a list or array from start up to (but excluding) end.
+ */
+static bool sliceNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    int count;
+    if (IS_ARRAY(args[0]))
+    {
+        count = AS_ARRAY(args[0])->count;
+    }
+    else
+    {
+        ObjList* list;
+        if (!listArgument(args[0], &list)) return false;
+        count = list->elements.count;
+    }
+
+    int start;
+    int end;
+    if (!positionArgument(args[1], count, &start) ||
+        !positionArgument(args[2], count, &end))
+    {
+        return false;
+    }
+    int length = end > start ? end - start : 0;
+
+    if (IS_ARRAY(args[0]))
+    {
+        ObjArray* slice = newArray(length);
+        if (length > 0)
+        {
+            memcpy(slice->values, AS_ARRAY(args[0])->values + start, sizeof(double) * length);
+        }
+        *result = OBJ_VAL(slice);
+        return true;
+    }
+
+    ObjList* slice = newList();
+    if (length > 0)
+    {
+        reserveElements(&slice->elements, length);
+        memcpy(slice->elements.values, AS_LIST(args[0])->elements.values + start,
+               sizeof(Value) * length);
+        slice->elements.count = length;
+    }
+
+    *result = OBJ_VAL(slice);
+    return true;
+}
+
+/**
+ * @brief Order two doubles ascending, with NaN after every other number.
+ */
+static int orderDoubles(double x, double y)
+{
+    if (isnan(x) || isnan(y)) return isnan(x) - isnan(y);
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Order numbers ascending.
+ */
+static int compareNumbers(const void* a, const void* b)
+{
+    return orderDoubles(AS_NUMBER(*(const Value*)a), AS_NUMBER(*(const Value*)b));
+}
+
+/**
+ * @brief Order the elements of an array ascending.
+ */
+static int compareDoubles(const void* a, const void* b)
+{
+    return orderDoubles(*(const double*)a, *(const double*)b);
+}
+
+/**
+ * @brief Order strings by their bytes.
+ */
+static int compareStrings(const void* a, const void* b)
+{
+    ObjString* x = AS_STRING(*(const Value*)a);
+    ObjString* y = AS_STRING(*(const Value*)b);
+    int length = x->length < y->length ? x->length : y->length;
+    int order = memcmp(x->chars, y->chars, length);
+    return order != 0 ? order : (x->length > y->length) - (x->length < y->length);
+}
+
+/**
+ * @brief sort(list) sorts a list of numbers or a list of strings, or
+ * an array, in place, in ascending order, and returns it.
+ */
+static bool sortNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (IS_ARRAY(args[0]))
+    {
+        ObjArray* array = AS_ARRAY(args[0]);
+        if (array->count > 1) qsort(array->values, array->count, sizeof(double), compareDoubles);
+        *result = args[0];
+        return true;
+    }
+
+    ObjList* list;
+    if (!listArgument(args[0], &list)) return false;
+
+    ValueArray* elements = &list->elements;
+    bool numbers = true;
+    bool strings = true;
+    for (int i = 0; i < elements->count; i++)
+    {
+        numbers = numbers && IS_NUMBER(elements->values[i]);
+        strings = strings && IS_STRING(elements->values[i]);
+    }
+
+    if (!numbers && !strings)
+    {
+        runtimeError("Can only sort lists of numbers or lists of strings.");
+        return false;
+    }
+
+    if (elements->count > 1)
+    {
+        qsort(elements->values, elements->count, sizeof(Value),
+              numbers ? compareNumbers : compareStrings);
+    }
+
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief toString(value) returns a value as a string, shown as print
+ * would show it. A string builder's contents are interned only here.
+ */
+static bool toStringNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (IS_STRING(args[0]))
+    {
+        *result = args[0];
+        return true;
+    }
+
+    if (IS_STRING_BUILDER(args[0]))
+    {
+        *result = OBJ_VAL(builderToString(AS_STRING_BUILDER(args[0])));
+        return true;
+    }
+
+    ObjStringBuilder builder = {{OBJ_STRING_BUILDER, NULL}, 0, 0, NULL};
+    appendValue(&builder, args[0]);
+    *result = OBJ_VAL(builderToString(&builder));
+    FREE_ARRAY(char, builder.chars, builder.capacity);
+    return true;
+}
+
+/**
+ * @brief array(count) returns an array of count zeros.
+ * array(list) returns an array with the numbers of a list.
+ */
+static bool arrayNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    if (!IS_LIST(args[0]))
+    {
+        int count;
+        if (!countArgument(args[0], &count)) return false;
+        *result = OBJ_VAL(newArray(count));
+        return true;
+    }
+
+    ValueArray* elements = &AS_LIST(args[0])->elements;
+    for (int i = 0; i < elements->count; i++)
+    {
+        if (!IS_NUMBER(elements->values[i]))
+        {
+            runtimeError("Array elements must be numbers.");
+            return false;
+        }
+    }
+
+    ObjArray* array = newArray(elements->count);
+    for (int i = 0; i < elements->count; i++)
+    {
+        array->values[i] = AS_NUMBER(elements->values[i]);
+    }
+
+    *result = OBJ_VAL(array);
+    return true;
+}
+
+/**
+ * @brief add(a, b) adds the elements of array b to those
+ * of array a, which is returned.
+ */
+static bool addNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* a;
+    ObjArray* b;
+    if (!arrayArguments(args, &a, &b)) return false;
+
+    addDoubles(a->values, b->values, a->count);
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief multiply(a, b) multiplies the elements of array a
+ * by those of array b, and returns a.
+ */
+static bool multiplyNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* a;
+    ObjArray* b;
+    if (!arrayArguments(args, &a, &b)) return false;
+
+    multiplyDoubles(a->values, b->values, a->count);
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief scale(array, factor) multiplies the elements of
+ * an array by a number, and returns the array.
+ */
+static bool scaleNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* array;
+    double factor;
+    if (!arrayArgument(args[0], &array) || !numberArgument(args[1], &factor)) return false;
+
+    scaleDoubles(array->values, factor, array->count);
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief sum(array) returns the sum of the elements of an array.
+ */
+static bool sumNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* array;
+    if (!arrayArgument(args[0], &array)) return false;
+
+    *result = NUMBER_VAL(sumDoubles(array->values, array->count));
+    return true;
+}
+
+/**
+ * @brief dot(a, b) returns the dot product of two arrays.
+ */
+static bool dotNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* a;
+    ObjArray* b;
+    if (!arrayArguments(args, &a, &b)) return false;
+
+    *result = NUMBER_VAL(dotDoubles(a->values, b->values, a->count));
+    return true;
+}
+
+/**
+ * @brief min(array) returns the least element of an array, or nil if it is empty.
+ */
+static bool minNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* array;
+    if (!arrayArgument(args[0], &array)) return false;
+
+    *result = array->count > 0 ? NUMBER_VAL(minDoubles(array->values, array->count)) : NIL_VAL;
+    return true;
+}
+
+/**
+ * @brief max(array) returns the greatest element of an array, or nil if it is empty.
+ */
+static bool maxNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjArray* array;
+    if (!arrayArgument(args[0], &array)) return false;
+
+    *result = array->count > 0 ? NUMBER_VAL(maxDoubles(array->values, array->count)) : NIL_VAL;
+    return true;
+}
+
+/**
+ * @brief Get a map argument.
+ * @return False after reporting a runtime error.
+ */
+static bool mapArgument(Value arg, ObjMap** map)
+{
+    if (!IS_MAP(arg))
+    {
+        runtimeError("Expected a map.");
+        return false;
+    }
+
+    *map = AS_MAP(arg);
+    return true;
+}
+
+/**
+ * @brief map() returns a new, empty map.
+ */
+static bool mapNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+    (void)args;
+
+    *result = OBJ_VAL(newMap());
+    return true;
+}
+
+/**
+ * @brief get(map, key) returns the value of a key in a map, or nil if it has none.
+ */
+static bool getNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjMap* map;
+    if (!mapArgument(args[0], &map)) return false;
+
+    if (!tableGet(&map->table, args[1], result)) *result = NIL_VAL;
+    return true;
+}
+
+/**
+ * @brief set(map, key, value) sets the value of a key in a map, and returns the map.
+ */
+static bool setNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjMap* map;
+    if (!mapArgument(args[0], &map)) return false;
+
+    if (tableSet(&map->table, args[1], args[2])) map->count++;
+    *result = args[0];
+    return true;
+}
+
+/**
+ * @brief delete(map, key) removes a key from a map.
+ * It returns whether the map had the key.
+ */
+static bool deleteNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjMap* map;
+    if (!mapArgument(args[0], &map)) return false;
+
+    bool deleted = tableDelete(&map->table, args[1]);
+    if (deleted) map->count--;
+    *result = BOOL_VAL(deleted);
+    return true;
+}
+
+/**
+ * @brief contains(map, key) returns whether a map has a key.
+ */
+static bool containsNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjMap* map;
+    if (!mapArgument(args[0], &map)) return false;
+
+    Value value;
+    *result = BOOL_VAL(tableGet(&map->table, args[1], &value));
+    return true;
+}
+
+/**
+ * @brief size(map) returns the number of keys in a map.
+ */
+static bool sizeNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjMap* map;
+    if (!mapArgument(args[0], &map)) return false;
+
+    *result = INT_VAL(map->count);
+    return true;
+}
+
+/**
+ * @brief Get a fiber argument.
+ * @return False after reporting a runtime error.
+ */
+static bool fiberArgument(Value arg, ObjFiber** fiber)
+{
+    if (!IS_FIBER(arg))
+    {
+        runtimeError("Expected a fiber.");
+        return false;
+    }
+
+    *fiber = AS_FIBER(arg);
+    return true;
+}
+
+/**
+ * @brief resume(fiber) runs a fiber until it yields, and returns the
+ * yielded value. Once the fiber's body finishes, it returns nil.
+ */
+static bool resumeNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjFiber* fiber;
+    if (!fiberArgument(args[0], &fiber)) return false;
+
+    return resumeFiber(fiber, result);
+}
+
+/**
+ * @brief done(fiber) returns whether a fiber's body has finished.
+ */
+static bool doneNative(int argCount, Value* args, Value* result)
+{
+    (void)argCount;
+
+    ObjFiber* fiber;
+    if (!fiberArgument(args[0], &fiber)) return false;
+
+    *result = BOOL_VAL(fiber->state == FIBER_DONE);
+    return true;
+}
+
+/**
+ * @brief Define the native functions as globals of this thread's VM.
+ */
+void defineNatives()
+{
+    defineNative("stringBuilder", 0, stringBuilderNative);
+    defineNative("append", 2, appendNative);
+    defineNative("toString", 1, toStringNative);
+    defineNative("length", 1, lengthNative);
+    defineNative("fill", 3, fillNative);
+    defineNative("slice", 3, sliceNative);
+    defineNative("sort", 1, sortNative);
+    defineNative("array", 1, arrayNative);
+    defineNative("add", 2, addNative);
+    defineNative("multiply", 2, multiplyNative);
+    defineNative("scale", 2, scaleNative);
+    defineNative("sum", 1, sumNative);
+    defineNative("dot", 2, dotNative);
+    defineNative("min", 1, minNative);
+    defineNative("max", 1, maxNative);
+    defineNative("map", 0, mapNative);
+    defineNative("get", 2, getNative);
+    defineNative("set", 3, setNative);
+    defineNative("delete", 2, deleteNative);
+    defineNative("contains", 2, containsNative);
+    defineNative("size", 1, sizeNative);
+    defineNative("resume", 1, resumeNative);
+    defineNative("done", 1, doneNative);
+    defineEventNatives();
+    defineActorNatives();
+}
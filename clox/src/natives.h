@@ -0,0 +1,8 @@
+#ifndef CLOX_NATIVES_H
+#define CLOX_NATIVES_H
+
+#include "common.h"
+
+void defineNatives();
+
+#endif
@@ -0,0 +1,170 @@
+#include <string.h>
+
+#include "numeric.h"
+
+/*
+ * Bulk kernels over packed doubles. They are written with vectors of
+ * four doubles, which the compiler maps to AVX2 registers or to pairs
+ * of SSE2 registers. On x86-64 Linux each kernel is compiled for both,
+ * and the dynamic loader picks the best one the CPU supports. Elsewhere
+ * the vectors are lowered to whatever the target has, down to scalar code.
+ *
+ * Reductions keep one partial result per lane and combine the lanes in
+ * a fixed order, so they round the same way whichever version runs
+ * (but not always the same way as adding the elements one by one).
+ */
+
+#if defined(__x86_64__) && defined(__linux__)
+#define KERNEL __attribute__((target_clones("avx2", "default")))
+#else
+#define KERNEL
+#endif
+
+#define LANES 4
+
+typedef double Lanes __attribute__((vector_size(LANES * sizeof(double))));
+typedef int64_t Mask __attribute__((vector_size(LANES * sizeof(double))));
+
+// Vectors are loaded and stored unaligned, since the arrays are only
+// as aligned as malloc() makes them.
+#define LOAD(pointer) ({ Lanes lanes; memcpy(&lanes, (pointer), sizeof(Lanes)); lanes; })
+#define STORE(pointer, lanes) memcpy((pointer), &(lanes), sizeof(Lanes))
+
+/**
+ * @brief Pick, in each lane, the value from a where the mask is set and from b elsewhere.
+ */
+#define SELECT(mask, a, b) ((Lanes)(((mask) & (Mask)(a)) | (~(mask) & (Mask)(b))))
+
+/**
+ * @brief Add the elements of source to those of target.
+ */
+KERNEL void addDoubles(double* target, const double* source, int count)
+{
+    int i = 0;
+    for (; i + LANES <= count; i += LANES)
+    {
+        Lanes sum = LOAD(target + i) + LOAD(source + i);
+        STORE(target + i, sum);
+    }
+    for (; i < count; i++) target[i] += source[i];
+}
+
+/**
+ * @brief Multiply the elements of target by those of source.
+ */
+KERNEL void multiplyDoubles(double* target, const double* source, int count)
+{
+    int i = 0;
+    for (; i + LANES <= count; i += LANES)
+    {
+        Lanes product = LOAD(target + i) * LOAD(source + i);
+        STORE(target + i, product);
+    }
+    for (; i < count; i++) target[i] *= source[i];
+}
+
+/**
+ * @brief Multiply every element by a factor.
+ */
+KERNEL void scaleDoubles(double* values, double factor, int count)
+{
+    Lanes factors = {factor, factor, factor, factor};
+    int i = 0;
+    for (; i + LANES <= count; i += LANES)
+    {
+        Lanes product = LOAD(values + i) * factors;
+        STORE(values + i, product);
+    }
+    for (; i < count; i++) values[i] *= factor;
+}
+
+/**
+ * @brief Set every element to a value.
+ */
+KERNEL void fillDoubles(double* values, double value, int count)
+{
+    Lanes lanes = {value, value, value, value};
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) STORE(values + i, lanes);
+    for (; i < count; i++) values[i] = value;
+}
+
+// Add up partial sums, one per lane, in a fixed order.
+#define SUM_LANES(sums) (((sums)[0] + (sums)[1]) + ((sums)[2] + (sums)[3]))
+
+/**
+ * @brief Sum the elements.
+ */
+KERNEL double sumDoubles(const double* values, int count)
+{
+    Lanes sums = {0};
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) sums += LOAD(values + i);
+
+    double sum = SUM_LANES(sums);
+    for (; i < count; i++) sum += values[i];
+    return sum;
+}
+
+/**
+ * @brief Sum the products of the elements of two arrays of the same length.
+ */
+KERNEL double dotDoubles(const double* a, const double* b, int count)
+{
+    Lanes sums = {0};
+    int i = 0;
+    for (; i + LANES <= count; i += LANES) sums += LOAD(a + i) * LOAD(b + i);
+
+    double sum = SUM_LANES(sums);
+    for (; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+/**
+ * @brief Find the least or greatest element of a non-empty array.
+ * Any NaN element makes the result NaN.
+ */
+#define EXTREME(values, count, better) \
+    do { \
+        Lanes best = {values[0], values[0], values[0], values[0]}; \
+        Mask unordered = {0}; \
+        int i = 0; \
+        for (; i + LANES <= count; i += LANES) \
+        { \
+            Lanes lanes = LOAD(values + i); \
+            unordered |= lanes != lanes; \
+            best = SELECT(lanes better best, lanes, best); \
+        } \
+        \
+        double result = values[0]; \
+        bool nan = false; \
+        for (int lane = 0; lane < LANES; lane++) \
+        { \
+            nan = nan || unordered[lane] != 0; \
+            if (best[lane] better result) result = best[lane]; \
+        } \
+        for (; i < count; i++) \
+        { \
+            nan = nan || values[i] != values[i]; \
+            if (values[i] better result) result = values[i]; \
+        } \
+        return nan ? __builtin_nan("") : result; \
+    } while (false)
+
+/**
+ * @brief Find the least element of a non-empty array.
+ */
+KERNEL double minDoubles(const double* values, int count)
+{
+    EXTREME(values, count, <);
+}
+
+/**
+ * @brief Find the greatest element of a non-empty array.
+ */
+KERNEL double maxDoubles(const double* values, int count)
+{
+    EXTREME(values, count, >);
+}
+
+#undef EXTREME
@@ -0,0 +1,15 @@
+#ifndef CLOX_NUMERIC_H
+#define CLOX_NUMERIC_H
+
+#include "common.h"
+
+void addDoubles(double* target, const double* source, int count);
+void multiplyDoubles(double* target, const double* source, int count);
+void scaleDoubles(double* values, double factor, int count);
+void fillDoubles(double* values, double value, int count);
+double sumDoubles(const double* values, int count);
+double dotDoubles(const double* a, const double* b, int count);
+double minDoubles(const double* values, int count);
+double maxDoubles(const double* values, int count);
+
+#endif
@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "memory.h"
+#include "metrics.h"
 #include "object.h"
 #include "table.h"
 #include "value.h"
@@ -17,6 +18,7 @@ static Obj* allocateObject(size_t size, ObjType type)
 {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
+    countObject(type, 1);
 
     // Add the object to the global object linked list.
     object->next = vm.objects;
@@ -31,11 +33,11 @@ static Obj* allocateObject(size_t size, ObjType type)
  */
 static ObjString* allocateString(char* chars, int length, uint32_t hash)
 {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-    string->length = length;
-    string->chars = chars;
-    string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    // The process-wide table owns the string, and this VM's table caches
+    // it. Room is made first, so that the reference is never lost.
+    tableReserve(&vm.strings);
+    ObjString* string = addSharedString(chars, length, hash);
+    tableSet(&vm.strings, OBJ_VAL(string), NIL_VAL);
     return string;
 }
 
@@ -43,7 +45,7 @@ static ObjString* allocateString(char* chars, int length, uint32_t hash)
  * @brief Calculate the hash of a string using the
  * FNV-1a algorithm.
  */
-static uint32_t hashString(const char* key, int length)
+uint32_t hashString(const char* key, int length)
 {
     uint32_t hash = 2166136261u;
     for (int i = 0; i < length; i++)
@@ -54,6 +56,29 @@ static uint32_t hashString(const char* key, int length)
     return hash;
 }
 
+/**
+ * @brief Find an interned string equal to a given buffer.
+ * Constants of the running program are shared with it
+ * instead of being interned again in this VM.
+ */
+static ObjString* findInterned(const char* chars, int length, uint32_t hash)
+{
+    if (vm.program != NULL)
+    {
+        ObjString* constant = tableFindString(&vm.program->strings, chars, length, hash);
+        if (constant != NULL) return constant;
+    }
+
+    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    if (interned != NULL) return interned;
+
+    // Not in this VM's cache, so look in the process-wide table.
+    tableReserve(&vm.strings);
+    interned = findSharedString(chars, length, hash);
+    if (interned != NULL) tableSet(&vm.strings, OBJ_VAL(interned), NIL_VAL);
+    return interned;
+}
+
 /**
  * @brief Create a string object with a given buffer.
  * @param chars The string's buffer.
@@ -65,7 +90,7 @@ ObjString* takeString(char* chars, int length)
     uint32_t hash = hashString(chars, length);
 
     // If the string already exists, free the buffer and return that one.
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL)
     {
         FREE_ARRAY(char, chars, length + 1);
@@ -86,7 +111,7 @@ ObjString* copyString(const char* chars, int length)
 {
     uint32_t hash = hashString(chars, length);
 
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(chars, length, hash);
     if (interned != NULL) return interned;
 
     char* heapChars = ALLOCATE(char, length + 1);
@@ -96,14 +121,307 @@ ObjString* copyString(const char* chars, int length)
 }
 
 /**
- * @brief Print an object to stdout.
+ * @brief Create a native function object.
+ * @param name The function's name, which must outlive it.
+ */
+ObjNative* newNative(NativeFn function, int arity, const char* name)
+{
+    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+    native->function = function;
+    native->arity = arity;
+    native->name = name;
+    return native;
+}
+
+/**
+ * @brief Create an empty string builder.
+ */
+ObjStringBuilder* newStringBuilder()
+{
+    ObjStringBuilder* builder = ALLOCATE_OBJ(ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    return builder;
+}
+
+/**
+ * @brief Append characters to a string builder,
+ * growing its buffer geometrically when it is full.
+ * The characters may be the builder's own.
  */
-void printObject(Value value)
+void appendToBuilder(ObjStringBuilder* builder, const char* chars, int length)
 {
+    if (length == 0) return;
+
+    if (builder->length + length > builder->capacity)
+    {
+        bool own = chars >= builder->chars && chars < builder->chars + builder->length;
+        size_t from = own ? (size_t)(chars - builder->chars) : 0;
+
+        int oldCapacity = builder->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < builder->length + length) capacity *= 2;
+        builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+        builder->capacity = capacity;
+        if (own) chars = builder->chars + from;
+    }
+
+    memcpy(builder->chars + builder->length, chars, length);
+    builder->length += length;
+}
+
+/**
+ * @brief Get the interned string with a string builder's contents.
+ * The builder is left as it is and can still be appended to.
+ */
+ObjString* builderToString(ObjStringBuilder* builder)
+{
+    return copyString(builder->chars != NULL ? builder->chars : "", builder->length);
+}
+
+/**
+ * @brief Create an empty list.
+ */
+ObjList* newList()
+{
+    ObjList* list = ALLOCATE_OBJ(ObjList, OBJ_LIST);
+    initValueArray(&list->elements);
+    return list;
+}
+
+/**
+ * @brief Create an array of a number of zeros.
+ */
+ObjArray* newArray(int count)
+{
+    ObjArray* array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+    array->count = 0;
+    array->values = NULL;
+    resizeArray(array, count);
+    return array;
+}
+
+/**
+ * @brief Change the length of an array. New elements are zeros.
+ */
+void resizeArray(ObjArray* array, int count)
+{
+    array->values = GROW_ARRAY(double, array->values, array->count, count);
+    if (count > array->count)
+    {
+        memset(array->values + array->count, 0, sizeof(double) * (count - array->count));
+    }
+    array->count = count;
+}
+
+/**
+ * @brief Create an empty map.
+ */
+ObjMap* newMap()
+{
+    ObjMap* map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+    initTable(&map->table);
+    map->count = 0;
+    return map;
+}
+
+/**
+ * @brief Create a suspended fiber, which starts running at the
+ * first instruction of a fiber body when it is first resumed.
+ * @param program The program whose verified chunk contains the body.
+ */
+ObjFiber* newFiber(Program* program, uint8_t* ip)
+{
+    ObjFiber* fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+    fiber->state = FIBER_SUSPENDED;
+    fiber->scheduled = false;
+    fiber->program = NULL;
+    fiber->chunk = &program->chunk;
+    fiber->body = ip;
+    fiber->ip = ip;
+    fiber->capacity = 0;
+    fiber->stack = NULL;
+    fiber->stack = ALLOCATE(Value, program->chunk.maxStack);
+    fiber->capacity = program->chunk.maxStack;
+    fiber->stackTop = fiber->stack;
+    fiber->program = retainProgram(program);
+    return fiber;
+}
+
+/**
+ * @brief Create a reference to an actor.
+ */
+ObjActor* newActorReference(struct Actor* actor)
+{
+    ObjActor* reference = ALLOCATE_OBJ(ObjActor, OBJ_ACTOR);
+    reference->actor = actor;
+    return reference;
+}
+
+/**
+ * @brief A list or map being formatted, in a chain of those enclosing it,
+ * so that one containing itself is not formatted forever.
+ */
+typedef struct FormatChain
+{
+    Obj* object;
+    struct FormatChain* enclosing;
+} FormatChain;
+
+/**
+ * @brief Check if a list or map is already being formatted,
+ * further out in a chain.
+ */
+static bool isBeingFormatted(FormatChain* chain, Obj* object)
+{
+    for (; chain != NULL; chain = chain->enclosing)
+    {
+        if (chain->object == object) return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Write text to a sink.
+ */
+static void writeText(TextSink* sink, const char* chars, int length)
+{
+    if (sink->file != NULL)
+    {
+        if (length > 0) fwrite(chars, 1, length, sink->file);
+    }
+    else
+    {
+        appendToBuilder(sink->builder, chars, length);
+    }
+}
+
+/**
+ * @brief Write a number to a sink.
+ */
+static void writeNumber(TextSink* sink, double number)
+{
+    char buffer[32];
+    writeText(sink, buffer, snprintf(buffer, sizeof(buffer), "%g", number));
+}
+
+/**
+ * @brief Write a value to a sink, inside the lists and maps of a chain.
+ * A list or map inside itself is shown as [...] or {...}.
+ */
+static void formatValueWithin(TextSink* sink, Value value, FormatChain* enclosing)
+{
+    switch (value.type)
+    {
+    case VAL_BOOL:
+        if (AS_BOOL(value)) writeText(sink, "true", 4);
+        else writeText(sink, "false", 5);
+        return;
+    case VAL_NIL:
+        writeText(sink, "nil", 3);
+        return;
+    case VAL_NUMBER:
+    case VAL_INT:
+        writeNumber(sink, AS_NUMBER(value));
+        return;
+    case VAL_OBJ:
+        break;
+    case VAL_UNDEFINED:
+        return; // Unreachable.
+    }
+
     switch (OBJ_TYPE(value))
     {
     case OBJ_STRING:
-        printf("%s", AS_CSTRING(value));
+        writeText(sink, AS_CSTRING(value), AS_STRING(value)->length);
+        break;
+    case OBJ_NATIVE:
+    {
+        const char* name = AS_NATIVE(value)->name;
+        writeText(sink, "<native fn ", 11);
+        writeText(sink, name, (int)strlen(name));
+        writeText(sink, ">", 1);
         break;
     }
+    case OBJ_STRING_BUILDER:
+    {
+        ObjStringBuilder* builder = AS_STRING_BUILDER(value);
+        writeText(sink, builder->chars, builder->length);
+        break;
+    }
+    case OBJ_LIST:
+    {
+        if (isBeingFormatted(enclosing, AS_OBJ(value)))
+        {
+            writeText(sink, "[...]", 5);
+            break;
+        }
+
+        FormatChain chain = {AS_OBJ(value), enclosing};
+        ValueArray* elements = &AS_LIST(value)->elements;
+        writeText(sink, "[", 1);
+        for (int i = 0; i < elements->count; i++)
+        {
+            if (i > 0) writeText(sink, ", ", 2);
+            formatValueWithin(sink, elements->values[i], &chain);
+        }
+        writeText(sink, "]", 1);
+        break;
+    }
+    case OBJ_ARRAY:
+    {
+        ObjArray* array = AS_ARRAY(value);
+        writeText(sink, "[", 1);
+        for (int i = 0; i < array->count; i++)
+        {
+            if (i > 0) writeText(sink, ", ", 2);
+            writeNumber(sink, array->values[i]);
+        }
+        writeText(sink, "]", 1);
+        break;
+    }
+    case OBJ_MAP:
+    {
+        if (isBeingFormatted(enclosing, AS_OBJ(value)))
+        {
+            writeText(sink, "{...}", 5);
+            break;
+        }
+
+        FormatChain chain = {AS_OBJ(value), enclosing};
+        Table* table = &AS_MAP(value)->table;
+        bool first = true;
+        writeText(sink, "{", 1);
+        for (int i = 0; i < table->capacity; i++)
+        {
+            Entry* entry = &table->entries[i];
+            if (IS_UNDEFINED(entry->key)) continue;
+
+            if (!first) writeText(sink, ", ", 2);
+            first = false;
+            formatValueWithin(sink, entry->key, &chain);
+            writeText(sink, ": ", 2);
+            formatValueWithin(sink, entry->value, &chain);
+        }
+        writeText(sink, "}", 1);
+        break;
+    }
+    case OBJ_FIBER:
+        writeText(sink, "<fiber>", 7);
+        break;
+    case OBJ_ACTOR:
+        writeText(sink, "<actor>", 7);
+        break;
+    }
+}
+
+/**
+ * @brief Write a value to a sink the way print shows it.
+ * Both print and toString() format values here, so they always agree.
+ */
+void formatValue(TextSink* sink, Value value)
+{
+    formatValueWithin(sink, value, NULL);
 }
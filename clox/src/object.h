@@ -1,15 +1,34 @@
 #ifndef CLOX_OBJECT_H
 #define CLOX_OBJECT_H
 
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "chunk.h"
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
+#define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
+#define IS_LIST(value) isObjType(value, OBJ_LIST)
+#define IS_ARRAY(value) isObjType(value, OBJ_ARRAY)
+#define IS_MAP(value) isObjType(value, OBJ_MAP)
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
+#define IS_ACTOR(value) isObjType(value, OBJ_ACTOR)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (AS_STRING(value)->chars)
+#define AS_NATIVE(value) ((ObjNative*)AS_OBJ(value))
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
+#define AS_LIST(value) ((ObjList*)AS_OBJ(value))
+#define AS_ARRAY(value) ((ObjArray*)AS_OBJ(value))
+#define AS_MAP(value) ((ObjMap*)AS_OBJ(value))
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
+#define AS_ACTOR(value) ((ObjActor*)AS_OBJ(value))
 
 struct Obj
 {
@@ -17,17 +36,153 @@ struct Obj
     struct Obj* next;
 };
 
+/**
+ * @brief An immutable, interned string.
+ * @param refCount How many tables of interned strings hold the string,
+ * if it is in the process-wide table. Unused otherwise.
+ */
 struct ObjString
 {
     Obj obj;
     int length;
+    atomic_int refCount;
     char* chars;
     uint32_t hash;
 };
 
+/**
+ * @brief A function implemented in C.
+ * @param args The arguments.
+ * @param result Where to store the return value.
+ * @return False if the call failed, after reporting a runtime error.
+ */
+typedef bool (*NativeFn)(int argCount, Value* args, Value* result);
+
+/**
+ * @brief A native function value.
+ * @param arity The number of arguments it takes.
+ */
+typedef struct
+{
+    Obj obj;
+    NativeFn function;
+    int arity;
+    const char* name;
+} ObjNative;
+
+/**
+ * @brief A growable buffer for building a string piece by piece.
+ * Unlike strings it is mutable and not interned, so appending is
+ * amortized O(1) and only the finished string is hashed.
+ */
+typedef struct
+{
+    Obj obj;
+    int length;
+    int capacity;
+    char* chars;
+} ObjStringBuilder;
+
+/**
+ * @brief A mutable list, whose elements are stored contiguously.
+ */
+typedef struct
+{
+    Obj obj;
+    ValueArray elements;
+} ObjList;
+
+/**
+ * @brief An array of numbers, packed as doubles so that
+ * bulk operations can work on them directly.
+ */
+typedef struct
+{
+    Obj obj;
+    int count;
+    double* values;
+} ObjArray;
+
+/**
+ * @brief A hash map from any values to values.
+ * @param count The number of keys, which unlike the
+ * table's count does not include tombstones.
+ */
+typedef struct
+{
+    Obj obj;
+    Table table;
+    int count;
+} ObjMap;
+
+typedef enum
+{
+    FIBER_SUSPENDED,
+    FIBER_RUNNING,
+    FIBER_WAITING, // For I/O or a timer, until the event loop resumes it.
+    FIBER_DONE
+} FiberState;
+
+/**
+ * @brief A coroutine running a fiber body of a chunk.
+ * It has its own value stack, which is never moved or copied:
+ * switching to a fiber only switches the VM's pointers.
+ * @param program The program whose chunk it is, which it holds
+ * a reference to, as it points into its code.
+ * @param body The first instruction of its body.
+ * @param ip The next instruction to run when it is resumed.
+ * @param capacity The size of the stack, the chunk's maxStack.
+ * @param scheduled Whether it is queued to be resumed by the event loop.
+ */
+typedef struct
+{
+    Obj obj;
+    FiberState state;
+    bool scheduled;
+    struct Program* program;
+    Chunk* chunk;
+    uint8_t* body;
+    uint8_t* ip;
+    int capacity;
+    Value* stack;
+    Value* stackTop;
+} ObjFiber;
+
+/**
+ * @brief A reference to an actor, which may run on any thread.
+ * Each VM has references of its own to the actors it knows of.
+ */
+typedef struct
+{
+    Obj obj;
+    struct Actor* actor;
+} ObjActor;
+
+uint32_t hashString(const char* key, int length);
 ObjString* takeString(char* chars, int length);
 ObjString* copyString(const char* chars, int length);
-void printObject(Value value);
+ObjNative* newNative(NativeFn function, int arity, const char* name);
+ObjStringBuilder* newStringBuilder();
+void appendToBuilder(ObjStringBuilder* builder, const char* chars, int length);
+ObjString* builderToString(ObjStringBuilder* builder);
+ObjList* newList();
+ObjArray* newArray(int count);
+void resizeArray(ObjArray* array, int count);
+ObjMap* newMap();
+ObjFiber* newFiber(struct Program* program, uint8_t* ip);
+ObjActor* newActorReference(struct Actor* actor);
+
+/**
+ * @brief Where a formatted value is written: a stream,
+ * or a string builder if the stream is NULL.
+ */
+typedef struct
+{
+    FILE* file;
+    ObjStringBuilder* builder;
+} TextSink;
+
+void formatValue(TextSink* sink, Value value);
 
 static inline bool isObjType(Value value, ObjType type)
 {
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "optimizer.h"
+#include "trace.h"
+
+// The most operand bytes any instruction has.
+#define OPERANDS_MAX 2
+
+/**
+ * @brief An instruction of the chunk being optimized.
+ * @param op The (possibly rewritten) opcode.
+ * @param operands The instruction's (possibly rewritten) operands.
+ */
+typedef struct
+{
+    uint8_t op;
+    uint8_t operands[OPERANDS_MAX];
+    int size;
+    int line;
+} Instruction;
+
+/**
+ * @brief The optimized instruction sequence. Rewrites only
+ * ever look at (and replace) the end of the sequence.
+ */
+typedef struct
+{
+    int capacity;
+    int count;
+    Instruction* instructions;
+} Peephole;
+
+/**
+ * @brief Check if an instruction only pushes a value,
+ * without side effects or possible runtime errors.
+ */
+static bool isPurePush(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_CONSTANT:
+    case OP_INT8:
+    case OP_INT16:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_GET_LOCAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Get how many values an instruction discards.
+ * @return The count, or 0 if the instruction does something else.
+ */
+static int popCount(Instruction* instruction)
+{
+    switch (instruction->op)
+    {
+    case OP_POP:  return 1;
+    case OP_POPN: return instruction->operands[0];
+    default:      return 0;
+    }
+}
+
+/**
+ * @brief Check if an instruction always leaves a boolean on the stack.
+ */
+static bool producesBool(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NOT:
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Get the comparison which is the negation of another.
+ * @return The negated opcode, or -1 if the instruction is not a comparison.
+ */
+static int negatedComparison(uint8_t op)
+{
+    switch (op)
+    {
+    case OP_EQUAL:         return OP_NOT_EQUAL;
+    case OP_NOT_EQUAL:     return OP_EQUAL;
+    case OP_GREATER:       return OP_LESS_EQUAL;
+    case OP_LESS_EQUAL:    return OP_GREATER;
+    case OP_LESS:          return OP_GREATER_EQUAL;
+    case OP_GREATER_EQUAL: return OP_LESS;
+    default:               return -1;
+    }
+}
+
+static void append(Peephole* peephole, Instruction instruction);
+
+/**
+ * @brief Remove the last n instructions.
+ */
+static void drop(Peephole* peephole, int n)
+{
+    peephole->count -= n;
+}
+
+/**
+ * @brief Get the instruction n places before the last one.
+ */
+static Instruction* last(Peephole* peephole, int n)
+{
+    return &peephole->instructions[peephole->count - 1 - n];
+}
+
+/**
+ * @brief Append an operand-less instruction.
+ */
+static void appendSimple(Peephole* peephole, uint8_t op, int line)
+{
+    Instruction instruction = {op, {0}, 1, line};
+    append(peephole, instruction);
+}
+
+/**
+ * @brief Append the instructions to discard a number of values.
+ */
+static void appendPops(Peephole* peephole, int count, int line)
+{
+    while (count > 0)
+    {
+        int batch = count > UINT8_MAX ? UINT8_MAX : count;
+        if (batch == 1)
+        {
+            appendSimple(peephole, OP_POP, line);
+        }
+        else
+        {
+            Instruction instruction = {OP_POPN, {(uint8_t)batch}, 2, line};
+            append(peephole, instruction);
+        }
+        count -= batch;
+    }
+}
+
+/**
+ * @brief Try to rewrite the end of the sequence, which ends with a
+ * just appended instruction. Rewritten instructions are appended
+ * again, so that rewrites can enable further rewrites.
+ * @return True if a rewrite was made.
+ */
+static bool rewriteTail(Peephole* peephole)
+{
+    if (peephole->count < 2) return false;
+
+    uint8_t current = last(peephole, 0)->op;
+    uint8_t previous = last(peephole, 1)->op;
+    int line = last(peephole, 1)->line;
+    int popLine = last(peephole, 0)->line;
+
+    if (current == OP_NOT)
+    {
+        int negated = negatedComparison(previous);
+        if (negated != -1)
+        {
+            // Fuse a comparison and a negation into the opposite comparison.
+            // The fused comparisons are defined as negations, so this
+            // stays exact even for NaN operands.
+            drop(peephole, 2);
+            appendSimple(peephole, (uint8_t)negated, line);
+            return true;
+        }
+
+        if (previous == OP_NOT && peephole->count >= 3 &&
+            producesBool(last(peephole, 2)->op))
+        {
+            // Negating a boolean twice gives the same boolean.
+            drop(peephole, 2);
+            return true;
+        }
+
+        if (previous == OP_TRUE || previous == OP_FALSE || previous == OP_NIL)
+        {
+            // Fold the negation of a literal.
+            drop(peephole, 2);
+            appendSimple(peephole, previous == OP_TRUE ? OP_FALSE : OP_TRUE, line);
+            return true;
+        }
+    }
+    else if (current == OP_ADD_STR && peephole->count >= 3 &&
+             (isPurePush(previous) || previous == OP_GET_GLOBAL))
+    {
+        Instruction* chain = last(peephole, 2);
+        Instruction push = *last(peephole, 1);
+        int count = chain->op == OP_ADD || chain->op == OP_ADD_STR ? 2 :
+                    chain->op == OP_CONCAT_N ? chain->operands[0] : 0;
+
+        // Only chains the compiler knows to join strings are fused, as
+        // additions of numbers are faster quickened, or as machine code.
+        if (count >= 2 && count < UINT8_MAX &&
+            chain->line == popLine && line == popLine)
+        {
+            // Add all the values of a chain of additions in one instruction.
+            // The push is moved before the earlier additions, which is only
+            // unobservable because it has no side effects. A pure push can
+            // not fail. A global read fails only if it is undefined, and the
+            // chain then fails either way, although if the earlier additions
+            // were to fail too, it is the read's error that is reported.
+            // Keeping to one line keeps the line numbers of errors.
+            drop(peephole, 3);
+            append(peephole, push);
+            Instruction concat = {OP_CONCAT_N, {(uint8_t)(count + 1)}, 2, line};
+            append(peephole, concat);
+            return true;
+        }
+    }
+    else if (popCount(last(peephole, 0)) > 0)
+    {
+        int pops = popCount(last(peephole, 0));
+        int previousPops = popCount(last(peephole, 1));
+
+        if (isPurePush(previous))
+        {
+            // A value which is pushed and immediately discarded.
+            drop(peephole, 2);
+            appendPops(peephole, pops - 1, popLine);
+            return true;
+        }
+
+        if (previous == OP_NOT)
+        {
+            // The negation can not fail, so just discard its operand.
+            drop(peephole, 2);
+            appendPops(peephole, pops, popLine);
+            return true;
+        }
+
+        if (previous == OP_EQUAL || previous == OP_NOT_EQUAL)
+        {
+            // Equality can not fail, so just discard both operands.
+            drop(peephole, 2);
+            appendPops(peephole, pops + 1, popLine);
+            return true;
+        }
+
+        if (previousPops > 0 && previousPops + pops <= UINT8_MAX)
+        {
+            // Discard values in one instruction.
+            drop(peephole, 2);
+            appendPops(peephole, previousPops + pops, popLine);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/**
+ * @brief Append an instruction and rewrite the end of the sequence if possible.
+ */
+static void append(Peephole* peephole, Instruction instruction)
+{
+    if (peephole->count == peephole->capacity)
+    {
+        int oldCapacity = peephole->capacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        peephole->instructions = GROW_ARRAY(Instruction, peephole->instructions,
+                                            oldCapacity, capacity);
+        peephole->capacity = capacity;
+    }
+
+    peephole->instructions[peephole->count] = instruction;
+    peephole->count++;
+    rewriteTail(peephole);
+}
+
+/**
+ * @brief Run peephole optimizations over a finished chunk.
+ * Comparisons followed by a negation are fused, double negations
+ * are cancelled, chains of additions of strings are joined and
+ * expression statements without side effects are removed. The chunk's line
+ * information and the sizes of fiber bodies are rebuilt to match.
+ */
+void optimizeChunk(Chunk* chunk)
+{
+    uint64_t start = traceStart();
+    Peephole peephole;
+    peephole.capacity = 0;
+    peephole.count = 0;
+    peephole.instructions = NULL;
+
+    // Decode the instructions, tracking the line of each.
+    int lineIndex = 0;
+    int lineBytesLeft = chunk->lines.data[0].count;
+
+    for (int offset = 0; offset < chunk->count;)
+    {
+        Instruction instruction;
+        instruction.op = chunk->code[offset];
+        instruction.size = instructionSize(instruction.op);
+        instruction.line = chunk->lines.data[lineIndex].number;
+        for (int i = 0; i < instruction.size - 1; i++)
+        {
+            instruction.operands[i] = chunk->code[offset + 1 + i];
+        }
+        append(&peephole, instruction);
+
+        offset += instruction.size;
+        lineBytesLeft -= instruction.size;
+        while (lineBytesLeft <= 0 && lineIndex + 1 < chunk->lines.count)
+        {
+            lineIndex++;
+            lineBytesLeft += chunk->lines.data[lineIndex].count;
+        }
+    }
+
+    // Encode the optimized instructions into a new chunk,
+    // which takes over the constants of the old one.
+    Chunk optimized;
+    initChunk(&optimized);
+
+    // Rewrites may change the size of fiber bodies, so the
+    // size operand of each OP_FIBER is recomputed at its end.
+    int fiberStarts[FIBER_NESTING_MAX];
+    int fiberCount = 0;
+
+    for (int i = 0; i < peephole.count; i++)
+    {
+        Instruction* instruction = &peephole.instructions[i];
+        if (instruction->op == OP_FIBER) fiberStarts[fiberCount++] = optimized.count;
+
+        writeChunk(&optimized, instruction->op, instruction->line);
+        for (int j = 0; j < instruction->size - 1; j++)
+        {
+            writeChunk(&optimized, instruction->operands[j], instruction->line);
+        }
+
+        if (instruction->op == OP_END_FIBER)
+        {
+            int start = fiberStarts[--fiberCount];
+            int bodySize = optimized.count - (start + 3);
+            optimized.code[start + 1] = (bodySize >> 8) & 0xff;
+            optimized.code[start + 2] = bodySize & 0xff;
+        }
+    }
+
+    optimized.constants = chunk->constants;
+    initValueArray(&chunk->constants);
+    freeChunk(chunk);
+    *chunk = optimized;
+
+    FREE_ARRAY(Instruction, peephole.instructions, peephole.capacity);
+    traceEnd("optimize", start);
+}
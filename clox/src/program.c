@@ -0,0 +1,202 @@
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "globals.h"
+#include "jit.h"
+#include "memory.h"
+#include "program.h"
+#include "trace.h"
+#include "verifier.h"
+#include "vm.h"
+
+/**
+ * @brief Allocate an empty program, in the shared heap.
+ */
+static Program* newProgram()
+{
+    Program* program = ALLOCATE(Program, 1);
+    atomic_init(&program->refCount, 1);
+    initChunk(&program->chunk);
+    initTable(&program->strings);
+    program->objects = NULL;
+    program->jit = NULL;
+    program->slotCount = 0;
+    program->slots = NULL;
+    program->size = 0;
+    return program;
+}
+
+static int compareSlots(const void* a, const void* b)
+{
+    return *(const int*)a - *(const int*)b;
+}
+
+/**
+ * @brief Take a reference to each global slot the code of a program uses,
+ * so that the slots keep their names for as long as the program lives.
+ */
+static void retainSlots(Program* program)
+{
+    Chunk* chunk = &program->chunk;
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset]))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_DEFINE_GLOBAL || instruction == OP_GET_GLOBAL ||
+            instruction == OP_SET_GLOBAL)
+        {
+            count++;
+        }
+    }
+    if (count == 0) return;
+
+    int* slots = ALLOCATE(int, count);
+    int index = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset]))
+    {
+        uint8_t instruction = chunk->code[offset];
+        if (instruction == OP_DEFINE_GLOBAL || instruction == OP_GET_GLOBAL ||
+            instruction == OP_SET_GLOBAL)
+        {
+            slots[index++] = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        }
+    }
+
+    // Each slot is referenced once, however often the code uses it.
+    qsort(slots, count, sizeof(int), compareSlots);
+    int distinct = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (distinct > 0 && slots[distinct - 1] == slots[i]) continue;
+        slots[distinct++] = slots[i];
+        retainGlobal(slots[i]);
+    }
+
+    program->slots = GROW_ARRAY(int, slots, count, distinct);
+    program->slotCount = distinct;
+}
+
+/**
+ * @brief Estimate how much memory a program takes.
+ */
+static size_t programSize(Program* program)
+{
+    Chunk* chunk = &program->chunk;
+    size_t size = sizeof(Program) + sizeof(int) * program->slotCount + chunk->capacity +
+                  sizeof(ChunkLineData) * chunk->lines.capacity +
+                  sizeof(Value) * chunk->constants.capacity +
+                  sizeof(Entry) * program->strings.capacity;
+    for (int i = 0; i < program->strings.capacity; i++)
+    {
+        Entry* entry = &program->strings.entries[i];
+        if (!IS_UNDEFINED(entry->key)) size += sizeof(ObjString) + AS_STRING(entry->key)->length + 1;
+    }
+    return size;
+}
+
+/**
+ * @brief Build a new program whose chunk is written by a function.
+ * Objects created while building (the constants) are allocated and
+ * interned as usual, but into the program instead of this thread's VM,
+ * and like the rest of the program they are in the shared heap.
+ * @param build Writes the chunk, returning false if it failed to.
+ * @return The program with a reference count of one,
+ * or NULL if the chunk could not be built or verified.
+ */
+Program* buildProgram(ChunkBuilder build, const void* context)
+{
+    enterSharedHeap();
+    beginResolvingGlobals();
+    Program* program = newProgram();
+
+    Program* running = vm.program;
+    Obj* objects = vm.objects;
+    Table strings = vm.strings;
+    vm.program = NULL;
+    vm.objects = program->objects;
+    vm.strings = program->strings;
+
+    uint64_t start = traceStart();
+    bool built = build(&program->chunk, context);
+    traceEnd("compile", start);
+
+    program->objects = vm.objects;
+    program->strings = vm.strings;
+    vm.program = running;
+    vm.objects = objects;
+    vm.strings = strings;
+
+    // The VM trusts the bytecode it runs, so check it once up front.
+    start = traceStart();
+    bool verified = built && verifyChunk(&program->chunk);
+    traceEnd("verify", start);
+    if (!verified)
+    {
+        releaseProgram(program);
+        endResolvingGlobals();
+        leaveSharedHeap();
+        return NULL;
+    }
+
+    retainSlots(program);
+    endResolvingGlobals();
+    program->size = programSize(program);
+
+    // Compile to machine code once, up front, so running the program never changes more than its opcodes.
+    if (jitEnabled())
+    {
+        start = traceStart();
+        program->jit = compileJit(&program->chunk);
+        traceEnd("jit", start);
+    }
+
+    leaveSharedHeap();
+    return program;
+}
+
+static bool compileSource(Chunk* chunk, const void* source)
+{
+    return compile((const char*)source, chunk);
+}
+
+/**
+ * @brief Compile source into a new program.
+ * @return The program with a reference count of one,
+ * or NULL if there was a compile error.
+ */
+Program* compileProgram(const char* source)
+{
+    return buildProgram(compileSource, source);
+}
+
+/**
+ * @brief Take another reference to a program.
+ * @return The same program.
+ */
+Program* retainProgram(Program* program)
+{
+    atomic_fetch_add_explicit(&program->refCount, 1, memory_order_relaxed);
+    return program;
+}
+
+/**
+ * @brief Drop a reference to a program.
+ * The program is freed when its last reference is dropped.
+ */
+void releaseProgram(Program* program)
+{
+    if (atomic_fetch_sub_explicit(&program->refCount, 1, memory_order_acq_rel) != 1) return;
+
+    enterSharedHeap();
+    freeJit(program->jit);
+    for (int i = 0; i < program->slotCount; i++)
+    {
+        releaseGlobal(program->slots[i]);
+    }
+    FREE_ARRAY(int, program->slots, program->slotCount);
+    freeChunk(&program->chunk);
+    releaseStringTable(&program->strings);
+    freeObjectList(program->objects);
+    FREE(Program, program);
+    leaveSharedHeap();
+}
@@ -0,0 +1,54 @@
+#ifndef CLOX_PROGRAM_H
+#define CLOX_PROGRAM_H
+
+#include <stdatomic.h>
+
+#include "chunk.h"
+#include "common.h"
+#include "intern.h"
+#include "table.h"
+
+/**
+ * @brief A compiled script.
+ * A program can be executed any number of times, by any number of VMs,
+ * concurrently. Its constant strings are interned in its own table and
+ * never belong to a VM. Once compiled, nothing in it changes but its
+ * reference count and the opcodes of its chunk.
+ *
+ * The opcodes change as VMs running the program rewrite an opcode
+ * into a quickened form, or back, as they see the types of its operands.
+ * Racing on those bytes is safe because every form of an instruction has
+ * the same operands, handles operands of any type by rewriting itself back
+ * to the generic form, and so computes the same result. Whichever form a
+ * VM reads, it runs the instruction correctly. Opcodes are written and
+ * read with relaxed atomic byte accesses, so no read is torn, and no order
+ * between them is needed. Code that reads the chunk while VMs may run it
+ * must load opcodes the same way.
+ * @param slots The global slots its code uses, slotCount of them,
+ * each of which it holds a reference to.
+ * @param size Roughly how much memory it takes.
+ */
+typedef struct Program
+{
+    atomic_int refCount;
+    Chunk chunk;
+    Table strings;
+    Obj* objects;
+    struct JitCode* jit;
+    int slotCount;
+    int* slots;
+    size_t size;
+} Program;
+
+/**
+ * @brief Writes the bytecode of a program being built into its chunk.
+ * @return False if the chunk could not be written.
+ */
+typedef bool (*ChunkBuilder)(Chunk* chunk, const void* context);
+
+Program* buildProgram(ChunkBuilder build, const void* context);
+Program* compileProgram(const char* source);
+Program* retainProgram(Program* program);
+void releaseProgram(Program* program);
+
+#endif
@@ -1,26 +1,189 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "common.h"
 #include "scanner.h"
 
+// How much of a streamed source is read at a time.
+#define STREAM_READ_SIZE 65536
+
+/**
+ * @brief Text read from a streamed source, ending with a null byte.
+ * @param next The buffer read before this one, which tokens may still point into.
+ */
+typedef struct SourceBuffer
+{
+    struct SourceBuffer* next;
+    int capacity;
+    char text[];
+} SourceBuffer;
+
+/**
+ * @brief Scanner struct.
+ * The remaining fields are only used when the source is streamed.
+ * @param read Reads more of the source, or is NULL once it has all been read.
+ * @param buffer The buffer being scanned, followed by older ones.
+ * @param end The end of the text read so far.
+ * @param keep The start of the text the compiler still needs.
+ * @param pausable Whether the next token may be a pause.
+ */
 typedef struct
 {
     const char* start;
     const char* current;
     int line;
+    SourceReader read;
+    void* context;
+    SourceBuffer* buffer;
+    const char* end;
+    const char* keep;
+    bool pausable;
 } Scanner;
 
-Scanner scanner;
+_Thread_local Scanner scanner;
 
 /**
  * @brief Initialize the scanner from a source of text.
  */
 void initScanner(const char* source)
+{
+    initScannerAt(source, 1);
+}
+
+/**
+ * @brief Initialize the scanner from a part of a source of text.
+ * @param line The line of the source the part starts on.
+ */
+void initScannerAt(const char* source, int line)
 {
     scanner.start = source;
     scanner.current = source;
+    scanner.line = line;
+    scanner.read = NULL;
+    scanner.buffer = NULL;
+}
+
+static SourceBuffer* newSourceBuffer(int capacity)
+{
+    SourceBuffer* buffer = malloc(sizeof(SourceBuffer) + capacity);
+    if (buffer == NULL)
+    {
+        fprintf(stderr, "Not enough memory to read the source.\n");
+        exit(74);
+    }
+
+    buffer->next = NULL;
+    buffer->capacity = capacity;
+    return buffer;
+}
+
+static void freeSourceBuffers(SourceBuffer* buffer)
+{
+    while (buffer != NULL)
+    {
+        SourceBuffer* next = buffer->next;
+        free(buffer);
+        buffer = next;
+    }
+}
+
+/**
+ * @brief Initialize the scanner from a source which is read as it is scanned,
+ * so only the text of the statements being compiled needs to be in memory.
+ */
+void initStreamScanner(SourceReader read, void* context)
+{
+    scanner.buffer = newSourceBuffer(STREAM_READ_SIZE + 1);
+    scanner.buffer->text[0] = '\0';
+    scanner.start = scanner.buffer->text;
+    scanner.current = scanner.buffer->text;
     scanner.line = 1;
+    scanner.read = read;
+    scanner.context = context;
+    scanner.end = scanner.buffer->text;
+    scanner.keep = scanner.buffer->text;
+    scanner.pausable = false;
+}
+
+/**
+ * @brief Free the buffers of a streamed source.
+ */
+void freeScanner()
+{
+    freeSourceBuffers(scanner.buffer);
+    scanner.buffer = NULL;
+    scanner.read = NULL;
+}
+
+/**
+ * @brief Tell the scanner that the compiler no longer needs any
+ * text before a token, so buffers holding only such text can be freed.
+ * @param start The start of a token scanned from the current buffer.
+ */
+void keepSourceFrom(const char* start)
+{
+    if (scanner.buffer == NULL) return;
+
+    freeSourceBuffers(scanner.buffer->next);
+    scanner.buffer->next = NULL;
+    scanner.keep = start;
+}
+
+/**
+ * @brief Let the next token be a pause if all of the streamed source
+ * read so far has been scanned, rather than waiting for more of it.
+ */
+void allowPause()
+{
+    scanner.pausable = scanner.read != NULL;
+}
+
+/**
+ * @brief Read the next part of a streamed source.
+ * If the buffer is nearly full, the text still needed moves to a new
+ * buffer. The old one is kept, as tokens may still point into it.
+ */
+static void refill()
+{
+    SourceBuffer* buffer = scanner.buffer;
+    char* end = (char*)scanner.end;
+    int room = buffer->capacity - (int)(end - buffer->text) - 1;
+
+    if (room < STREAM_READ_SIZE / 2)
+    {
+        int kept = (int)(scanner.end - scanner.keep);
+        SourceBuffer* fresh = newSourceBuffer(kept * 2 + STREAM_READ_SIZE + 1);
+        memcpy(fresh->text, scanner.keep, kept);
+
+        scanner.start = fresh->text + (scanner.start - scanner.keep);
+        scanner.current = fresh->text + (scanner.current - scanner.keep);
+        scanner.keep = fresh->text;
+        fresh->next = buffer;
+        scanner.buffer = fresh;
+
+        end = fresh->text + kept;
+        room = fresh->capacity - kept - 1;
+    }
+
+    int count = scanner.read(end, room, scanner.context);
+    if (count <= 0)
+    {
+        count = 0;
+        scanner.read = NULL;
+    }
+
+    end[count] = '\0';
+    scanner.end = end + count;
+}
+
+/**
+ * @brief Make sure a character of a streamed source has been read, if the source has it.
+ * @param ahead How far past the current character it is.
+ */
+static void fill(int ahead)
+{
+    while (scanner.read != NULL && scanner.current + ahead >= scanner.end) refill();
 }
 
 static bool isAlpha(char c)
@@ -37,6 +200,7 @@ static bool isDigit(char c)
 
 static bool isAtEnd()
 {
+    if (*scanner.current == '\0') fill(0);
     return *scanner.current == '\0';
 }
 
@@ -49,12 +213,14 @@ static char advance()
 
 static char peek()
 {
+    if (*scanner.current == '\0') fill(0);
     return *scanner.current;
 }
 
 static char peekNext()
 {
     if (isAtEnd()) return '\0';
+    if (*(scanner.current + 1) == '\0') fill(1);
     return *(scanner.current + 1);
 }
 
@@ -104,6 +270,9 @@ static void skipWhitespace()
 {
     while (true)
     {
+        // Between tokens is the only place where scanning can pause.
+        if (scanner.pausable && scanner.current == scanner.end) return;
+
         char c = peek();
         switch(c)
         {
@@ -171,6 +340,7 @@ static TokenType identifierType()
             switch (*(scanner.start + 1))
             {
             case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+            case 'i': return checkKeyword(2, 3, "ber", TOKEN_FIBER);
             case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
             case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
             }
@@ -194,6 +364,7 @@ static TokenType identifierType()
         break;
     case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
     case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    case 'y': return checkKeyword(1, 4, "ield", TOKEN_YIELD);
     }
 
     return TOKEN_IDENTIFIER;
@@ -255,6 +426,12 @@ Token scanToken()
     skipWhitespace();
     scanner.start = scanner.current;
 
+    if (scanner.pausable)
+    {
+        scanner.pausable = false;
+        if (scanner.current == scanner.end && scanner.read != NULL) return makeToken(TOKEN_PAUSE);
+    }
+
     if (isAtEnd()) return makeToken(TOKEN_EOF);
 
     char c = advance();
@@ -267,6 +444,8 @@ Token scanToken()
     case ')': return makeToken(TOKEN_RIGHT_PAREN);
     case '{': return makeToken(TOKEN_LEFT_BRACE);
     case '}': return makeToken(TOKEN_RIGHT_BRACE);
+    case '[': return makeToken(TOKEN_LEFT_BRACKET);
+    case ']': return makeToken(TOKEN_RIGHT_BRACKET);
     case ';': return makeToken(TOKEN_SEMICOLON);
     case ',': return makeToken(TOKEN_COMMA);
     case '.': return makeToken(TOKEN_DOT);
@@ -6,6 +6,7 @@ typedef enum
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
   TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
 
@@ -20,9 +21,12 @@ typedef enum
   
   // Keywords.
   TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
+  TOKEN_FIBER, TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
+
+  // A streamed source has no more text yet, where a statement may end.
+  TOKEN_PAUSE,
 
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -35,7 +39,18 @@ typedef struct
     int line;
 } Token;
 
+/**
+ * @brief Reads the next part of a streamed source into a buffer.
+ * @return How many characters were read, or 0 at the end of the source.
+ */
+typedef int (*SourceReader)(char* buffer, int size, void* context);
+
 void initScanner(const char* source);
+void initScannerAt(const char* source, int line);
+void initStreamScanner(SourceReader read, void* context);
+void freeScanner();
+void keepSourceFrom(const char* start);
+void allowPause();
 Token scanToken();
 
 #endif
@@ -1,3 +1,4 @@
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -27,12 +28,72 @@ void freeTable(Table* table)
     initTable(table);
 }
 
+/**
+ * @brief Hash a number by its value, so that a small integer and the
+ * equal double hash the same. -0 and 0 are equal, and NaN keys are all
+ * treated as one key, so each of them has a single hash.
+ */
+static uint32_t hashNumber(double number)
+{
+    if (number == 0) number = 0;
+    if (isnan(number)) number = NAN;
+
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+
+    // Mix the high bits (exponent and leading mantissa bits,
+    // where small integers differ) into the low ones.
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdu;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+/**
+ * @brief Hash a key. Keys which are equal have equal hashes.
+ */
+static inline uint32_t hashKey(Value key)
+{
+    switch (key.type)
+    {
+    case VAL_BOOL:   return AS_BOOL(key) ? 1231 : 1237;
+    case VAL_NIL:    return 0;
+    case VAL_NUMBER: return hashNumber(AS_NUMBER(key));
+    case VAL_INT:    return hashNumber(AS_INT(key));
+    case VAL_OBJ:
+        if (IS_STRING(key)) return AS_STRING(key)->hash;
+        return (uint32_t)((uintptr_t)AS_OBJ(key) >> 4);
+    default:         return 0; // Unreachable, keys are never undefined.
+    }
+}
+
+/**
+ * @brief Check if two keys are equal. Keys are equal when the values
+ * are, except that all NaNs are equal, so that they can be found again.
+ */
+static inline bool keysEqual(Value a, Value b)
+{
+    // The common case of interned strings and other objects.
+    if (IS_OBJ(a) && IS_OBJ(b) && AS_OBJ(a) == AS_OBJ(b)) return true;
+
+    if (IS_NUMBER(a) && IS_NUMBER(b))
+    {
+        if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+        double x = AS_NUMBER(a);
+        double y = AS_NUMBER(b);
+        return x == y || (isnan(x) && isnan(y));
+    }
+
+    return valuesEqual(a, b);
+}
+
 /**
  * @brief Find the appropriate place for a key in a table.
+ * @param hash The key's hash.
  */
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
+static Entry* findEntry(Entry* entries, int capacity, Value key, uint32_t hash)
 {
-    int index = key->hash % capacity;
+    int index = hash % capacity;
     Entry* tombstone = NULL; // The first tombstone we pass.
 
     // Do linear probing.
@@ -41,7 +102,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
         while (index < capacity)
         {
             Entry* entry = entries + index;
-            if (entry->key == NULL)
+            if (IS_UNDEFINED(entry->key))
             {
                 if (IS_NIL(entry->value))
                 {
@@ -56,7 +117,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
                     if (tombstone == NULL) tombstone = entry;
                 }
             }
-            else if (entry->key == key)
+            else if (entry->hash == hash && keysEqual(entry->key, key))
             {
                 // We found the key.
                 return entry;
@@ -76,12 +137,12 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key)
  * @param value The place to store the found entry's value.
  * @return Whether the entry was found.
  */
-bool tableGet(Table* table, ObjString* key, Value* value)
+bool tableGet(Table* table, Value key, Value* value)
 {
     if (table->count == 0) return false;
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hashKey(key));
+    if (IS_UNDEFINED(entry->key)) return false;
 
     *value = entry->value;
     return true;
@@ -91,16 +152,16 @@ bool tableGet(Table* table, ObjString* key, Value* value)
  * @brief Delete an entry from a table.
  * @return Whether the entry was found and deleted.
  */
-bool tableDelete(Table* table, ObjString* key)
+bool tableDelete(Table* table, Value key)
 {
     if (table->count == 0) return false;
 
     // Find the entry.
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    Entry* entry = findEntry(table->entries, table->capacity, key, hashKey(key));
+    if (IS_UNDEFINED(entry->key)) return false;
 
     // Place a tombstone in the entry.
-    entry->key = NULL;
+    entry->key = UNDEFINED_VAL;
     entry->value = BOOL_VAL(true);
     return true;
 }
@@ -115,7 +176,7 @@ static void adjustCapacity(Table* table, int capacity)
     Entry* entries = ALLOCATE(Entry, capacity);
     for (int i = 0; i < capacity; i++)
     {
-        entries[i].key = NULL;
+        entries[i].key = UNDEFINED_VAL;
         entries[i].value = NIL_VAL;
     }
 
@@ -124,10 +185,11 @@ static void adjustCapacity(Table* table, int capacity)
     for (int i = 0; i < table->capacity; i++)
     {
         Entry* entry = table->entries + i;
-        if (entry->key == NULL) continue;
+        if (IS_UNDEFINED(entry->key)) continue;
 
-        Entry* dest = findEntry(entries, capacity, entry->key);
+        Entry* dest = findEntry(entries, capacity, entry->key, entry->hash);
         dest->key = entry->key;
+        dest->hash = entry->hash;
         dest->value = entry->value;
         table->count++;
     }
@@ -138,6 +200,27 @@ static void adjustCapacity(Table* table, int capacity)
     table->capacity = capacity;
 }
 
+/**
+ * @brief Make room in a table for one more key, so that
+ * adding it next does not allocate.
+ */
+void tableReserve(Table* table)
+{
+    if (table->count == table->capacity * TABLE_MAX_LOAD)
+    {
+        int live = 0;
+        for (int i = 0; i < table->capacity; i++)
+        {
+            if (!IS_UNDEFINED(table->entries[i].key)) live++;
+        }
+
+        // If most of the load is tombstones, as when keys are added
+        // and removed over and over, clearing them makes enough room.
+        int capacity = live * 2 < table->count ? table->capacity : GROW_CAPACITY(table->capacity);
+        adjustCapacity(table, capacity);
+    }
+}
+
 /**
  * @brief Add entry to table.
  * @return True if a new entry was added
@@ -145,16 +228,13 @@ static void adjustCapacity(Table* table, int capacity)
  * @return False if an entry was overwritten
  * (the key was in the table).
  */
-bool tableSet(Table* table, ObjString* key, Value value)
+bool tableSet(Table* table, Value key, Value value)
 {
-    if (table->count == table->capacity * TABLE_MAX_LOAD)
-    {
-        int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
-    }
+    tableReserve(table);
 
-    Entry* entry = findEntry(table->entries, table->capacity, key);
-    bool isNewKey = entry->key == NULL;
+    uint32_t hash = hashKey(key);
+    Entry* entry = findEntry(table->entries, table->capacity, key, hash);
+    bool isNewKey = IS_UNDEFINED(entry->key);
 
     // Increment count only if inserting into a non-tombstone
     // empty position (only if not replacing a tombstone).
@@ -164,6 +244,7 @@ bool tableSet(Table* table, ObjString* key, Value value)
 
     entry->key = key;
     entry->value = value;
+    entry->hash = hash;
     return isNewKey;
 }
 
@@ -175,7 +256,7 @@ void tableAddAll(Table* from, Table* to)
     for (int i = 0; i < from->capacity; i++)
     {
         Entry* entry = from->entries + i;
-        if (entry->key != NULL)
+        if (!IS_UNDEFINED(entry->key))
         {
             tableSet(to, entry->key, entry->value);
         }
@@ -200,16 +281,20 @@ ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t
         while (index < table->capacity)
         {
             Entry* entry = table->entries + index;
-            if (entry->key == NULL)
+            if (IS_UNDEFINED(entry->key))
             {
                 // Stop if we find an empty non-tombstone entry.
                 if (IS_NIL(entry->value)) return NULL;
             }
-            else if (entry->key->length == length && entry->key->hash == hash
-                && memcmp(entry->key->chars, chars, length) == 0)
+            else if (entry->hash == hash && IS_STRING(entry->key))
             {
-                // We found the string.
-                return entry->key;
+                ObjString* key = AS_STRING(entry->key);
+                if (key->length == length && key->hash == hash &&
+                    memcmp(key->chars, chars, length) == 0)
+                {
+                    // We found the string.
+                    return key;
+                }
             }
 
             index++;
@@ -4,10 +4,18 @@
 #include "common.h"
 #include "value.h"
 
+/**
+ * @brief An entry of a hash table. An entry without a key
+ * (VAL_UNDEFINED) is empty if its value is nil and a
+ * tombstone otherwise.
+ * @param hash The key's hash, kept so that probing and growing
+ * the table do not need to look into the key.
+ */
 typedef struct
 {
-    ObjString* key;
+    Value key;
     Value value;
+    uint32_t hash;
 } Entry;
 
 typedef struct
@@ -19,9 +27,10 @@ typedef struct
 
 void initTable(Table* table);
 void freeTable(Table* table);
-bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
-bool tableDelete(Table* table, ObjString* key);
+bool tableGet(Table* table, Value key, Value* value);
+void tableReserve(Table* table);
+bool tableSet(Table* table, Value key, Value value);
+bool tableDelete(Table* table, Value key);
 void tableAddAll(Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
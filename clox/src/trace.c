@@ -0,0 +1,206 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "trace.h"
+
+bool traceEnabled = false;
+
+// How many kinds of spans the summary adds up.
+#define SUMMARY_MAX 32
+
+/**
+ * @brief Something which happened while tracing: a span
+ * of time, or a sample of the memory in use.
+ * @param thread The thread it happened on, numbered from 1.
+ */
+typedef struct
+{
+    const char* name;
+    bool sample;
+    uint64_t start;
+    uint64_t duration;
+    int thread;
+    int64_t bytes;
+} TraceEvent;
+
+/**
+ * @brief Everything recorded while tracing.
+ * Events are recorded by any thread, so they are kept under a lock,
+ * and in memory of their own so that they are not counted themselves.
+ * @param path Where the events are written when the process exits.
+ */
+typedef struct
+{
+    pthread_mutex_t lock;
+    const char* path;
+    uint64_t origin;
+    int count;
+    int capacity;
+    TraceEvent* events;
+    atomic_int threads;
+    atomic_llong allocations;
+    atomic_llong frees;
+    atomic_llong bytes;
+    atomic_llong peakBytes;
+} Trace;
+
+static Trace trace = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static _Thread_local int traceThread = 0;
+
+/**
+ * @brief Get the time in nanoseconds, from an arbitrary starting point.
+ */
+uint64_t traceClock()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void addEvent(TraceEvent event)
+{
+    if (traceThread == 0) traceThread = atomic_fetch_add(&trace.threads, 1) + 1;
+    event.thread = traceThread;
+
+    pthread_mutex_lock(&trace.lock);
+    if (trace.count == trace.capacity)
+    {
+        trace.capacity = trace.capacity < 256 ? 256 : trace.capacity * 2;
+        trace.events = realloc(trace.events, sizeof(TraceEvent) * trace.capacity);
+        if (trace.events == NULL) exit(1);
+    }
+    trace.events[trace.count++] = event;
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/**
+ * @brief Record a span of time from a start until now, followed by
+ * a sample of the memory in use at its end.
+ */
+void recordSpan(const char* name, uint64_t start)
+{
+    uint64_t end = traceClock();
+    addEvent((TraceEvent){.name = name, .start = start, .duration = end - start});
+    addEvent((TraceEvent){.name = "heap", .sample = true, .start = end, .bytes = atomic_load(&trace.bytes)});
+}
+
+/**
+ * @brief Count an allocation, resizing or freeing of memory by any thread.
+ */
+void recordAllocation(size_t oldSize, size_t newSize)
+{
+    if (oldSize == 0 && newSize != 0) atomic_fetch_add(&trace.allocations, 1);
+    if (newSize == 0 && oldSize != 0) atomic_fetch_add(&trace.frees, 1);
+
+    int64_t bytes = atomic_fetch_add(&trace.bytes, (int64_t)newSize - (int64_t)oldSize);
+    bytes += (int64_t)newSize - (int64_t)oldSize;
+
+    int64_t peak = atomic_load(&trace.peakBytes);
+    while (bytes > peak && !atomic_compare_exchange_weak(&trace.peakBytes, &peak, bytes));
+}
+
+/**
+ * @brief Write the events as Chrome trace-event JSON, which Perfetto
+ * and chrome://tracing can load. Times are in microseconds.
+ */
+static bool writeEvents(FILE* file)
+{
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"clox\"}}");
+
+    for (int i = 0; i < trace.count; i++)
+    {
+        TraceEvent* event = &trace.events[i];
+        double start = (event->start - trace.origin) / 1000.0;
+        if (!event->sample)
+        {
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"dur\": %.3f}",
+                    event->name, event->thread, start, event->duration / 1000.0);
+        }
+        else
+        {
+            fprintf(file, ",\n{\"name\": \"heap\", \"ph\": \"C\", \"pid\": 1, \"tid\": %d, "
+                    "\"ts\": %.3f, \"args\": {\"bytes\": %lld}}",
+                    event->thread, start, (long long)event->bytes);
+        }
+    }
+
+    fprintf(file, "\n]}\n");
+    return !ferror(file);
+}
+
+/**
+ * @brief Print the total time of each kind of span, in the order
+ * they first happened, and what was allocated, on one line.
+ */
+static void printSummary()
+{
+    const char* names[SUMMARY_MAX];
+    uint64_t totals[SUMMARY_MAX];
+    int kinds = 0;
+
+    for (int i = 0; i < trace.count; i++)
+    {
+        TraceEvent* event = &trace.events[i];
+        if (event->sample) continue;
+
+        int kind = 0;
+        while (kind < kinds && strcmp(names[kind], event->name) != 0) kind++;
+        if (kind == kinds)
+        {
+            if (kinds == SUMMARY_MAX) continue;
+            names[kinds] = event->name;
+            totals[kinds] = 0;
+            kinds++;
+        }
+        totals[kind] += event->duration;
+    }
+
+    fprintf(stderr, "timings:");
+    for (int i = 0; i < kinds; i++)
+    {
+        fprintf(stderr, " %s %.3fms,", names[i], totals[i] / 1e6);
+    }
+
+    fprintf(stderr, " %lld allocations, %lld frees, %.1f KB peak\n",
+            (long long)atomic_load(&trace.allocations), (long long)atomic_load(&trace.frees),
+            atomic_load(&trace.peakBytes) / 1024.0);
+}
+
+/**
+ * @brief Write the trace and its summary, once the process exits.
+ */
+static void finishTrace()
+{
+    pthread_mutex_lock(&trace.lock);
+
+    FILE* file = fopen(trace.path, "w");
+    if (file == NULL || !writeEvents(file))
+    {
+        fprintf(stderr, "Could not write trace to \"%s\".\n", trace.path);
+    }
+    if (file != NULL) fclose(file);
+
+    printSummary();
+    pthread_mutex_unlock(&trace.lock);
+}
+
+/**
+ * @brief Start recording spans of time and allocations, to be written
+ * to a file when the process exits. This must be called before any
+ * other thread is started.
+ * @param path The file, which must live as long as the process.
+ */
+void startTrace(const char* path)
+{
+    trace.path = path;
+    trace.origin = traceClock();
+    traceEnabled = true;
+    atexit(finishTrace);
+}
@@ -0,0 +1,39 @@
+#ifndef CLOX_TRACE_H
+#define CLOX_TRACE_H
+
+#include "common.h"
+
+// Set once, before any thread starts recording, and never changed after.
+extern bool traceEnabled;
+
+void startTrace(const char* path);
+uint64_t traceClock();
+void recordSpan(const char* name, uint64_t start);
+void recordAllocation(size_t oldSize, size_t newSize);
+
+/**
+ * @brief Get the start of a span of time being traced, or 0 if tracing is off.
+ */
+static inline uint64_t traceStart()
+{
+    return traceEnabled ? traceClock() : 0;
+}
+
+/**
+ * @brief Record a span of time from a start until now, if tracing is on.
+ * @param name A name for the span, which must live as long as the process.
+ */
+static inline void traceEnd(const char* name, uint64_t start)
+{
+    if (traceEnabled) recordSpan(name, start);
+}
+
+/**
+ * @brief Record an allocation, resizing or freeing of memory, if tracing is on.
+ */
+static inline void traceAllocation(size_t oldSize, size_t newSize)
+{
+    if (traceEnabled) recordAllocation(oldSize, newSize);
+}
+
+#endif
@@ -0,0 +1,427 @@
+#include <math.h>
+#include <string.h>
+
+#include "globals.h"
+#include "object.h"
+#include "transpiler.h"
+#include "verifier.h"
+
+/*
+ * Translates a verified chunk to a C program which links against the
+ * runtime (bin/libclox.a, see 'make lib'). The program carries the chunk's
+ * bytecode, lines and constants, rebuilds it as a Program at startup and
+ * runs it with a C function in place of the interpreter.
+ *
+ * The depth of the value stack is known at every instruction, so each
+ * stack slot becomes a C local (s0, s1, ...) which the C compiler can keep
+ * in registers. The common cases of instructions are implemented inline on
+ * those locals. Everything else, including every runtime error, is handed
+ * to runInstruction(): the locals are stored to the VM's stack first, and
+ * the instruction's results loaded back after. Errors and their line
+ * numbers are therefore exactly those of the interpreter.
+ */
+
+static const char PRELUDE[] =
+    "#include <math.h>\n"
+    "#include <stdio.h>\n"
+    "#include <string.h>\n"
+    "\n"
+    "#include \"globals.h\"\n"
+    "#include \"object.h\"\n"
+    "#include \"program.h\"\n"
+    "#include \"vm.h\"\n"
+    "\n"
+    "// Let the interpreter run an instruction, leaving on a runtime error.\n"
+    "#define INTERPRET(offset, depth) \\\n"
+    "    do { \\\n"
+    "        vm->stackTop = vm->stack + (depth); \\\n"
+    "        if (runInstruction(offset) != INTERPRET_OK) return INTERPRET_RUNTIME_ERROR; \\\n"
+    "    } while (false)\n"
+    "#define BOTH_INTS(a, b) __builtin_expect(IS_INT(a) && IS_INT(b), 1)\n"
+    "#define BOTH_NUMBERS(a, b) __builtin_expect(IS_NUMBER(a) && IS_NUMBER(b), 1)\n"
+    "#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))\n"
+    "\n";
+
+static const char MAIN[] =
+    "int main()\n"
+    "{\n"
+    "    initVM();\n"
+    "\n"
+    "    // Hand out the global slots in the order the bytecode expects.\n"
+    "    beginResolvingGlobals();\n"
+    "    for (int i = 0; GLOBALS[i] != NULL; i++)\n"
+    "    {\n"
+    "        resolveGlobal(GLOBALS[i], (int)strlen(GLOBALS[i]));\n"
+    "    }\n"
+    "\n"
+    "    Program* program = buildProgram(buildChunk, NULL);\n"
+    "    endResolvingGlobals();\n"
+    "    if (program == NULL) return 70;\n"
+    "\n"
+    "    InterpretResult result = runCompiledProgram(program, script);\n"
+    "\n"
+    "    releaseProgram(program);\n"
+    "    freeVM();\n"
+    "    return result == INTERPRET_RUNTIME_ERROR ? 70 : 0;\n"
+    "}\n";
+
+/**
+ * @brief Write characters as the contents of a C string literal.
+ */
+static void writeString(FILE* out, const char* chars, int length)
+{
+    for (int i = 0; i < length; i++)
+    {
+        unsigned char c = (unsigned char)chars[i];
+        if (c == '"' || c == '\\' || c == '?' || c < ' ' || c > '~')
+        {
+            // Octal escapes are always three digits, so they never
+            // run into a following digit.
+            fprintf(out, "\\%03o", c);
+        }
+        else
+        {
+            fputc(c, out);
+        }
+    }
+}
+
+/**
+ * @brief Write an expression which creates a constant.
+ * @return False if the constant cannot be written.
+ */
+static bool writeConstant(FILE* out, Value value)
+{
+    if (IS_INT(value))
+    {
+        fprintf(out, "INT_VAL(%d)", AS_INT(value));
+        return true;
+    }
+
+    if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        if (isnan(number)) return false;
+
+        // Hexadecimal floats are exact.
+        if (isinf(number)) fprintf(out, "NUMBER_VAL(%sHUGE_VAL)", number < 0 ? "-" : "");
+        else fprintf(out, "NUMBER_VAL(%a)", number);
+        return true;
+    }
+
+    if (IS_STRING(value))
+    {
+        ObjString* string = AS_STRING(value);
+        fputs("OBJ_VAL(copyString(\"", out);
+        writeString(out, string->chars, string->length);
+        fprintf(out, "\", %d))", string->length);
+        return true;
+    }
+
+    return false;
+}
+
+/**
+ * @brief Write the data the chunk is rebuilt from, and the function rebuilding it.
+ */
+static bool writeChunkData(FILE* out, Chunk* chunk)
+{
+    fputs("static const uint8_t CODE[] = {", out);
+    for (int i = 0; i < chunk->count; i++)
+    {
+        fprintf(out, "%s%d,", i % 16 == 0 ? "\n    " : " ", chunk->code[i]);
+    }
+    fputs("\n};\n\n", out);
+
+    fputs("// The line of each run of bytes, and the run's length.\n", out);
+    fputs("static const int LINES[][2] = {\n", out);
+    for (int i = 0; i < chunk->lines.count; i++)
+    {
+        fprintf(out, "    {%d, %d},\n", chunk->lines.data[i].number, chunk->lines.data[i].count);
+    }
+    fputs("};\n\n", out);
+
+    // Terminated by NULL, so that the array is never empty.
+    fputs("static const char* const GLOBALS[] = {\n", out);
+    for (int slot = 0; slot < globalCount(); slot++)
+    {
+        const char* name = globalName(slot);
+        if (name == NULL)
+        {
+            // A free slot, held for a name no script can use so that the
+            // slots after it keep their numbers.
+            fprintf(out, "    \"#%d\",\n", slot);
+            continue;
+        }
+
+        fputs("    \"", out);
+        writeString(out, name, (int)strlen(name));
+        fputs("\",\n", out);
+    }
+    fputs("    NULL,\n};\n\n", out);
+
+    fputs("static bool buildChunk(Chunk* chunk, const void* context)\n{\n", out);
+    fputs("    (void)context;\n\n", out);
+    fputs("    int offset = 0;\n", out);
+    fputs("    for (size_t i = 0; i < sizeof(LINES) / sizeof(LINES[0]); i++)\n", out);
+    fputs("    {\n", out);
+    fputs("        for (int j = 0; j < LINES[i][1]; j++)\n", out);
+    fputs("        {\n", out);
+    fputs("            writeChunk(chunk, CODE[offset++], LINES[i][0]);\n", out);
+    fputs("        }\n", out);
+    fputs("    }\n\n", out);
+
+    for (int i = 0; i < chunk->constants.count; i++)
+    {
+        fputs("    addConstant(chunk, ", out);
+        if (!writeConstant(out, chunk->constants.values[i])) return false;
+        fputs(");\n", out);
+    }
+
+    fputs("    return true;\n}\n\n", out);
+    return true;
+}
+
+static int readSlot(uint8_t* operands)
+{
+    return (operands[0] << 8) | operands[1];
+}
+
+/**
+ * @brief Write a call to the interpreter for an instruction.
+ * @param depth The depth of the stack before the instruction.
+ */
+static void writeInterpret(FILE* out, int offset, int depth, StackEffect effect)
+{
+    fputs("{ ", out);
+    for (int i = 0; i < depth; i++) fprintf(out, "vm->stack[%d] = s%d; ", i, i);
+    fprintf(out, "INTERPRET(%d, %d); ", offset, depth);
+
+    int top = depth - effect.pops;
+    for (int i = top; i < top + effect.pushes; i++) fprintf(out, "s%d = vm->stack[%d]; ", i, i);
+    fputs("}", out);
+}
+
+/**
+ * @brief Write a binary operation on two numbers, which the
+ * interpreter does for operands of any other type.
+ * @param intOp The function doing the operation on small integers,
+ * or NULL if it is a comparison, which always works on them.
+ */
+static void writeNumberOp(FILE* out, int offset, int depth, const char* valueType,
+                          const char* op, const char* intOp)
+{
+    int a = depth - 2;
+    int b = depth - 1;
+    if (intOp != NULL)
+    {
+        fprintf(out, "if (BOTH_INTS(s%d, s%d) && %s(AS_INT(s%d), AS_INT(s%d), &result)) "
+                     "s%d = INT_VAL(result);\n", a, b, intOp, a, b, a);
+    }
+    else
+    {
+        fprintf(out, "if (BOTH_INTS(s%d, s%d)) s%d = %s(AS_INT(s%d) %s AS_INT(s%d));\n",
+                a, b, a, valueType, a, op, b);
+    }
+    fprintf(out, "    else if (BOTH_NUMBERS(s%d, s%d)) s%d = %s(AS_NUMBER(s%d) %s AS_NUMBER(s%d));\n",
+            a, b, a, valueType, a, op, b);
+    fputs("    else ", out);
+    writeInterpret(out, offset, depth, (StackEffect){2, 1});
+    fputs("\n", out);
+}
+
+/**
+ * @brief Write the statements for one instruction.
+ * @param depth The depth of the stack before the instruction.
+ * @return False if the instruction is not supported.
+ */
+static bool writeInstruction(FILE* out, Chunk* chunk, int offset, int depth)
+{
+    uint8_t* operands = chunk->code + offset + 1;
+    int top = depth - 1;
+
+    fputs("    ", out);
+    switch (chunk->code[offset])
+    {
+    case OP_CONSTANT:
+        fprintf(out, "s%d = constants[%d];\n", depth, operands[0]);
+        return true;
+    case OP_INT8:
+        fprintf(out, "s%d = INT_VAL(%d);\n", depth, operands[0]);
+        return true;
+    case OP_INT16:
+        fprintf(out, "s%d = INT_VAL(%d);\n", depth, (operands[0] << 8) | operands[1]);
+        return true;
+    case OP_NIL:   fprintf(out, "s%d = NIL_VAL;\n", depth);          return true;
+    case OP_TRUE:  fprintf(out, "s%d = BOOL_VAL(true);\n", depth);   return true;
+    case OP_FALSE: fprintf(out, "s%d = BOOL_VAL(false);\n", depth);  return true;
+
+    // Popped values are simply no longer used.
+    case OP_POP:   fputs("// pop\n", out);                          return true;
+    case OP_POPN:  fprintf(out, "// pop %d\n", operands[0]);         return true;
+
+    case OP_GET_LOCAL:
+        fprintf(out, "s%d = s%d;\n", depth, operands[0]);
+        return true;
+    case OP_SET_LOCAL:
+        fprintf(out, "s%d = s%d;\n", operands[0], top);
+        return true;
+
+    case OP_DEFINE_GLOBAL:
+        fprintf(out, "defineGlobal(%d, s%d);\n", readSlot(operands), top);
+        return true;
+    case OP_GET_GLOBAL:
+        fprintf(out, "if (IS_UNDEFINED(vm->globals.values[%d])) ", readSlot(operands));
+        writeInterpret(out, offset, depth, (StackEffect){0, 1});
+        fprintf(out, "\n    s%d = vm->globals.values[%d];\n", depth, readSlot(operands));
+        return true;
+    case OP_SET_GLOBAL:
+        fprintf(out, "if (IS_UNDEFINED(vm->globals.values[%d])) ", readSlot(operands));
+        writeInterpret(out, offset, depth, (StackEffect){1, 1});
+        fprintf(out, "\n    vm->globals.values[%d] = s%d;\n", readSlot(operands), top);
+        return true;
+
+    case OP_EQUAL:
+        fprintf(out, "s%d = BOOL_VAL(valuesEqual(s%d, s%d));\n", top - 1, top - 1, top);
+        return true;
+    case OP_NOT_EQUAL:
+        fprintf(out, "s%d = NOT_BOOL_VAL(valuesEqual(s%d, s%d));\n", top - 1, top - 1, top);
+        return true;
+
+    case OP_GREATER:
+    case OP_GREATER_NUM:
+    case OP_GREATER_INT:
+        writeNumberOp(out, offset, depth, "BOOL_VAL", ">", NULL);
+        return true;
+    case OP_GREATER_EQUAL:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_GREATER_EQUAL_INT:
+        writeNumberOp(out, offset, depth, "NOT_BOOL_VAL", "<", NULL);
+        return true;
+    case OP_LESS:
+    case OP_LESS_NUM:
+    case OP_LESS_INT:
+        writeNumberOp(out, offset, depth, "BOOL_VAL", "<", NULL);
+        return true;
+    case OP_LESS_EQUAL:
+    case OP_LESS_EQUAL_NUM:
+    case OP_LESS_EQUAL_INT:
+        writeNumberOp(out, offset, depth, "NOT_BOOL_VAL", ">", NULL);
+        return true;
+
+    // Strings are concatenated by the interpreter.
+    case OP_ADD:
+    case OP_ADD_NUM:
+    case OP_ADD_INT:
+    case OP_ADD_STR:
+    case OP_ADD_ANY:
+        writeNumberOp(out, offset, depth, "NUMBER_VAL", "+", "addInts");
+        return true;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM:
+    case OP_SUBTRACT_INT:
+        writeNumberOp(out, offset, depth, "NUMBER_VAL", "-", "subtractInts");
+        return true;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM:
+    case OP_MULTIPLY_INT:
+        writeNumberOp(out, offset, depth, "NUMBER_VAL", "*", "multiplyInts");
+        return true;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM:
+        writeNumberOp(out, offset, depth, "NUMBER_VAL", "/", "divideInts");
+        return true;
+
+    case OP_CONCAT_N:
+        writeInterpret(out, offset, depth, (StackEffect){operands[0], 1});
+        fputs("\n", out);
+        return true;
+    case OP_CALL:
+        writeInterpret(out, offset, depth, (StackEffect){operands[0] + 1, 1});
+        fputs("\n", out);
+        return true;
+    case OP_BUILD_LIST:
+        writeInterpret(out, offset, depth, (StackEffect){operands[0], 1});
+        fputs("\n", out);
+        return true;
+    case OP_GET_INDEX:
+        writeInterpret(out, offset, depth, (StackEffect){2, 1});
+        fputs("\n", out);
+        return true;
+    case OP_SET_INDEX:
+        writeInterpret(out, offset, depth, (StackEffect){3, 1});
+        fputs("\n", out);
+        return true;
+
+    case OP_NOT:
+        fprintf(out, "s%d = BOOL_VAL(IS_NIL(s%d) || (IS_BOOL(s%d) && !AS_BOOL(s%d)));\n",
+                top, top, top, top);
+        return true;
+    case OP_NEGATE:
+        fprintf(out, "if (IS_INT(s%d) && negateInt(AS_INT(s%d), &result)) s%d = INT_VAL(result);\n",
+                top, top, top);
+        fprintf(out, "    else if (IS_NUMBER(s%d)) s%d = NUMBER_VAL(-AS_NUMBER(s%d));\n", top, top, top);
+        fputs("    else ", out);
+        writeInterpret(out, offset, depth, (StackEffect){1, 1});
+        fputs("\n", out);
+        return true;
+
+    case OP_PRINT:
+        fprintf(out, "printValue(s%d); printf(\"\\n\");\n", top);
+        return true;
+
+    case OP_RETURN:
+        for (int i = 0; i < depth; i++) fprintf(out, "vm->stack[%d] = s%d; ", i, i);
+        fprintf(out, "vm->stackTop = vm->stack + %d; return INTERPRET_OK;\n", depth);
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Write a standalone C program which runs a verified chunk.
+ * Global slots are written by name in the order they were handed out,
+ * so the chunk should be the only one compiled by this process.
+ * @return False if the chunk has something that cannot be translated.
+ */
+bool transpileChunk(Chunk* chunk, FILE* out)
+{
+    fputs("// Generated by clox --emit-c.\n", out);
+    fputs(PRELUDE, out);
+    if (!writeChunkData(out, chunk)) return false;
+
+    fputs("static InterpretResult script(VM* vm)\n{\n", out);
+    fputs("    Value* constants = vm->chunk->constants.values;\n", out);
+    fputs("    __attribute__((unused)) int32_t result;\n", out);
+    if (chunk->maxStack > 0)
+    {
+        fputs("    Value", out);
+        for (int i = 0; i < chunk->maxStack; i++) fprintf(out, "%s s%d", i == 0 ? "" : ",", i);
+        fputs(";\n", out);
+    }
+
+    int line = -1;
+    int depth = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionSize(chunk->code[offset]))
+    {
+        if (getLine(chunk, offset) != line)
+        {
+            line = getLine(chunk, offset);
+            fprintf(out, "\n    // line %d\n", line);
+        }
+
+        StackEffect effect;
+        if (!stackEffect(chunk->code + offset, &effect) ||
+            !writeInstruction(out, chunk, offset, depth))
+        {
+            return false;
+        }
+        depth += effect.pushes - effect.pops;
+    }
+
+    fputs("}\n\n", out);
+    fputs(MAIN, out);
+    return true;
+}
@@ -0,0 +1,11 @@
+#ifndef CLOX_TRANSPILER_H
+#define CLOX_TRANSPILER_H
+
+#include <stdio.h>
+
+#include "chunk.h"
+#include "common.h"
+
+bool transpileChunk(Chunk* chunk, FILE* out);
+
+#endif
@@ -24,9 +24,12 @@ void writeValueArray(ValueArray* array, Value value)
     {
         // Not enough space in the allocated array.
         // Grow the array to make room.
+        // The capacity is only updated once the array has grown, as
+        // running out of memory unwinds out of GROW_ARRAY.
         int oldCapacity = array->capacity;
-        array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        int capacity = GROW_CAPACITY(oldCapacity);
+        array->values = GROW_ARRAY(Value, array->values, oldCapacity, capacity);
+        array->capacity = capacity;
     }
 
     array->values[array->count] = value;
@@ -47,21 +50,8 @@ void freeValueArray(ValueArray* array)
  */
 void printValue(Value value)
 {
-    switch(value.type)
-    {
-    case VAL_BOOL:
-        printf(AS_BOOL(value) ? "true" : "false");
-        break;
-    case VAL_NIL:
-        printf("nil");
-        break;
-    case VAL_NUMBER:
-        printf("%g", AS_NUMBER(value));
-        break;
-    case VAL_OBJ:
-        printObject(value);
-        break;
-    }
+    TextSink sink = {stdout, NULL};
+    formatValue(&sink, value);
 }
 
 /**
@@ -69,6 +59,10 @@ void printValue(Value value)
  */
 bool valuesEqual(Value a, Value b)
 {
+    // The same number may be stored as an int or as a double.
+    if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+    if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+
     if (a.type != b.type) return false;
     switch (a.type)
     {
@@ -78,9 +72,6 @@ bool valuesEqual(Value a, Value b)
     case VAL_NIL:
         return true;
 
-    case VAL_NUMBER:
-        return AS_NUMBER(a) == AS_NUMBER(b);
-
     case VAL_OBJ:
         return AS_OBJ(a) == AS_OBJ(b);
 
@@ -9,6 +9,13 @@ typedef struct ObjString ObjString;
 typedef enum
 {
     OBJ_STRING,
+    OBJ_NATIVE,
+    OBJ_STRING_BUILDER,
+    OBJ_LIST,
+    OBJ_ARRAY,
+    OBJ_MAP,
+    OBJ_FIBER,
+    OBJ_ACTOR,
 } ObjType;
 
 typedef enum
@@ -16,7 +23,9 @@ typedef enum
     VAL_BOOL,
     VAL_NIL,
     VAL_NUMBER,
+    VAL_INT, // A number which is a small integer, stored as one for fast arithmetic.
     VAL_OBJ,
+    VAL_UNDEFINED, // Internal marker for unset slots, never seen by Lox code.
 } ValueType;
 
 typedef struct
@@ -26,23 +35,93 @@ typedef struct
     {
         bool boolean;
         double number;
+        int64_t integer; // Always a small integer, but stored to fill the payload.
         Obj* obj;
     } as;
 } Value;
 
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+#define IS_NUMBER(value)  ((value).type == VAL_NUMBER || (value).type == VAL_INT)
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_DOUBLE(value)  ((value).type == VAL_NUMBER)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_NUMBER(value)  asNumber(value)
+#define AS_INT(value)     ((int32_t)(value).as.integer)
 #define AS_OBJ(value)     ((value).as.obj)
 
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
+#define UNDEFINED_VAL     ((Value){VAL_UNDEFINED, {.number = 0}})
+
+/**
+ * @brief Get the double a number is, whichever way it is stored.
+ */
+static inline double asNumber(Value value)
+{
+    return IS_INT(value) ? (double)AS_INT(value) : value.as.number;
+}
+
+/*
+ * Arithmetic on small integers. Each gives false if the result would
+ * not be a small integer, in which case the caller computes it with
+ * doubles instead. Results are exactly those of the doubles, including
+ * which zero a product or quotient is, since -0 is only a double.
+ */
+
+static inline bool addInts(int32_t a, int32_t b, int32_t* result)
+{
+    return !__builtin_add_overflow(a, b, result);
+}
+
+static inline bool subtractInts(int32_t a, int32_t b, int32_t* result)
+{
+    return !__builtin_sub_overflow(a, b, result);
+}
+
+static inline bool multiplyInts(int32_t a, int32_t b, int32_t* result)
+{
+    return !__builtin_mul_overflow(a, b, result) && (*result != 0 || (a >= 0 && b >= 0));
+}
+
+static inline bool divideInts(int32_t a, int32_t b, int32_t* result)
+{
+    if (b == 0 || (a == 0 && b < 0) || (a == INT32_MIN && b == -1) || a % b != 0) return false;
+    *result = a / b;
+    return true;
+}
+
+static inline bool negateInt(int32_t a, int32_t* result)
+{
+    if (a == 0 || a == INT32_MIN) return false;
+    *result = -a;
+    return true;
+}
+
+/**
+ * @brief Get a number as an index, if it is an integer.
+ */
+static inline bool asIndex(Value value, int32_t* index)
+{
+    if (IS_INT(value))
+    {
+        *index = AS_INT(value);
+        return true;
+    }
+
+    if (!IS_DOUBLE(value)) return false;
+
+    double number = value.as.number;
+    if (!(number >= INT32_MIN && number <= INT32_MAX)) return false;
+    *index = (int32_t)number;
+    return *index == number;
+}
 
 typedef struct
 {
@@ -0,0 +1,276 @@
+#include <stdio.h>
+
+#include "globals.h"
+#include "verifier.h"
+#include "vm.h"
+
+/**
+ * @brief Get the stack effect of an instruction.
+ * The instruction's operands must be in the code.
+ * @return False if the first byte is not a valid opcode.
+ */
+bool stackEffect(uint8_t* code, StackEffect* effect)
+{
+    switch (code[0])
+    {
+    case OP_POPN:
+        *effect = (StackEffect){code[1], 0};
+        return true;
+
+    case OP_CONCAT_N:
+        *effect = (StackEffect){code[1], 1};
+        return true;
+
+    case OP_CALL:
+        *effect = (StackEffect){code[1] + 1, 1};
+        return true;
+
+    case OP_BUILD_LIST:
+        *effect = (StackEffect){code[1], 1};
+        return true;
+
+    case OP_GET_INDEX:
+        *effect = (StackEffect){2, 1};
+        return true;
+
+    case OP_SET_INDEX:
+        *effect = (StackEffect){3, 1};
+        return true;
+
+    // A fiber body has a stack of its own, which starts out empty,
+    // so the verifier handles the stack around one specially.
+    // Within the body, a finished fiber pushes the nil resumed with.
+    case OP_FIBER:
+        *effect = (StackEffect){0, 0};
+        return true;
+    case OP_YIELD:
+        *effect = (StackEffect){1, 0};
+        return true;
+    case OP_END_FIBER:
+        *effect = (StackEffect){0, 1};
+        return true;
+
+    case OP_CONSTANT:
+    case OP_INT8:
+    case OP_INT16:
+    case OP_NIL:
+    case OP_TRUE:
+    case OP_FALSE:
+        *effect = (StackEffect){0, 1};
+        return true;
+
+    case OP_GET_LOCAL:
+    case OP_GET_GLOBAL:
+        *effect = (StackEffect){0, 1};
+        return true;
+
+    case OP_SET_LOCAL:
+    case OP_SET_GLOBAL:
+        *effect = (StackEffect){1, 1};
+        return true;
+
+    case OP_POP:
+    case OP_DEFINE_GLOBAL:
+    case OP_PRINT:
+        *effect = (StackEffect){1, 0};
+        return true;
+
+    case OP_EQUAL:
+    case OP_NOT_EQUAL:
+    case OP_GREATER:
+    case OP_GREATER_EQUAL:
+    case OP_LESS:
+    case OP_LESS_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+    case OP_GREATER_NUM:
+    case OP_GREATER_EQUAL_NUM:
+    case OP_LESS_NUM:
+    case OP_LESS_EQUAL_NUM:
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+    case OP_ADD_ANY:
+    case OP_SUBTRACT_NUM:
+    case OP_MULTIPLY_NUM:
+    case OP_DIVIDE_NUM:
+    case OP_GREATER_INT:
+    case OP_GREATER_EQUAL_INT:
+    case OP_LESS_INT:
+    case OP_LESS_EQUAL_INT:
+    case OP_ADD_INT:
+    case OP_SUBTRACT_INT:
+    case OP_MULTIPLY_INT:
+        *effect = (StackEffect){2, 1};
+        return true;
+
+    case OP_NOT:
+    case OP_NEGATE:
+        *effect = (StackEffect){1, 1};
+        return true;
+
+    case OP_RETURN:
+        *effect = (StackEffect){0, 0};
+        return true;
+
+    default:
+        return false;
+    }
+}
+
+/**
+ * @brief Report a verification error at an instruction.
+ */
+static bool verifyError(Chunk* chunk, int offset, const char* message)
+{
+    fprintf(stderr, "[line %d] Error in bytecode at %04d: %s\n",
+            getLine(chunk, offset), offset, message);
+    return false;
+}
+
+/**
+ * @brief Check that a chunk is well formed before it is run.
+ * Every opcode and constant index must be valid, the stack must never
+ * underflow or grow past STACK_MAX, and the code must end by returning.
+ * Fiber bodies must be properly nested, and only they may yield.
+ * On success, the chunk's maxStack is set to the deepest the stack gets,
+ * on the VM's stack or on the stack of any fiber.
+ * @return True if the chunk can be run safely.
+ */
+bool verifyChunk(Chunk* chunk)
+{
+    if (chunk->count == 0)
+    {
+        fprintf(stderr, "Error in bytecode: Empty chunk.\n");
+        return false;
+    }
+
+    int lineBytes = 0;
+    for (int i = 0; i < chunk->lines.count; i++)
+    {
+        lineBytes += chunk->lines.data[i].count;
+    }
+    if (lineBytes != chunk->count)
+    {
+        fprintf(stderr, "Error in bytecode: Line information does not match the code.\n");
+        return false;
+    }
+
+    int depth = 0;
+    int maxDepth = 0;
+    int offset = 0;
+
+    // The fiber bodies the instruction is in, innermost last, with
+    // their OP_FIBER offsets and the depths of the enclosing stacks.
+    int fiberStarts[FIBER_NESTING_MAX];
+    int fiberDepths[FIBER_NESTING_MAX];
+    int fiberCount = 0;
+    uint8_t instruction = OP_RETURN;
+
+    while (offset < chunk->count)
+    {
+        instruction = chunk->code[offset];
+
+        int size = instructionSize(instruction);
+        if (offset + size > chunk->count)
+        {
+            return verifyError(chunk, offset, "Instruction operands past the end of the code.");
+        }
+
+        StackEffect effect;
+        if (!stackEffect(chunk->code + offset, &effect))
+        {
+            return verifyError(chunk, offset, "Unknown opcode.");
+        }
+
+        if (instruction == OP_CONSTANT && chunk->code[offset + 1] >= chunk->constants.count)
+        {
+            return verifyError(chunk, offset, "Constant index out of range.");
+        }
+
+        if ((instruction == OP_DEFINE_GLOBAL || instruction == OP_GET_GLOBAL ||
+             instruction == OP_SET_GLOBAL) &&
+            ((chunk->code[offset + 1] << 8) | chunk->code[offset + 2]) >= globalCount())
+        {
+            return verifyError(chunk, offset, "Global slot out of range.");
+        }
+
+        if ((instruction == OP_GET_LOCAL || instruction == OP_SET_LOCAL) &&
+            chunk->code[offset + 1] >= depth)
+        {
+            return verifyError(chunk, offset, "Local slot out of range.");
+        }
+
+        if (instruction == OP_CONCAT_N && chunk->code[offset + 1] < 2)
+        {
+            return verifyError(chunk, offset, "Concatenation of fewer than two values.");
+        }
+
+        if ((instruction == OP_YIELD || instruction == OP_END_FIBER) && fiberCount == 0)
+        {
+            return verifyError(chunk, offset, "Fiber instruction outside a fiber body.");
+        }
+
+        if (instruction == OP_RETURN && fiberCount > 0)
+        {
+            return verifyError(chunk, offset, "Return inside a fiber body.");
+        }
+
+        if (depth < effect.pops)
+        {
+            return verifyError(chunk, offset, "Stack underflow.");
+        }
+
+        depth += effect.pushes - effect.pops;
+        if (depth > maxDepth) maxDepth = depth;
+        if (maxDepth > STACK_MAX)
+        {
+            return verifyError(chunk, offset, "Expression too complex, stack overflow.");
+        }
+
+        if (instruction == OP_FIBER)
+        {
+            if (fiberCount == FIBER_NESTING_MAX)
+            {
+                return verifyError(chunk, offset, "Fiber bodies nested too deeply.");
+            }
+            fiberStarts[fiberCount] = offset;
+            fiberDepths[fiberCount] = depth;
+            fiberCount++;
+            depth = 0;
+        }
+        else if (instruction == OP_END_FIBER)
+        {
+            // The enclosing code continues after the body, with the fiber pushed.
+            fiberCount--;
+            int start = fiberStarts[fiberCount];
+            int bodySize = (chunk->code[start + 1] << 8) | chunk->code[start + 2];
+            if (start + 3 + bodySize != offset + size)
+            {
+                return verifyError(chunk, start, "Fiber body size does not match its end.");
+            }
+            depth = fiberDepths[fiberCount] + 1;
+            if (depth > maxDepth) maxDepth = depth;
+            if (maxDepth > STACK_MAX)
+            {
+                return verifyError(chunk, offset, "Expression too complex, stack overflow.");
+            }
+        }
+
+        offset += size;
+    }
+
+    if (fiberCount > 0)
+    {
+        return verifyError(chunk, fiberStarts[fiberCount - 1], "Fiber body without an end.");
+    }
+
+    if (instruction != OP_RETURN)
+    {
+        return verifyError(chunk, chunk->count - 1, "Code does not end with a return.");
+    }
+
+    chunk->maxStack = maxDepth;
+    return true;
+}
@@ -0,0 +1,20 @@
+#ifndef CLOX_VERIFIER_H
+#define CLOX_VERIFIER_H
+
+#include "chunk.h"
+
+/**
+ * @brief The stack effect of an instruction.
+ * @param pops How many values the instruction needs on the stack.
+ * @param pushes How many values it leaves in their place.
+ */
+typedef struct
+{
+    int pops;
+    int pushes;
+} StackEffect;
+
+bool stackEffect(uint8_t* code, StackEffect* effect);
+bool verifyChunk(Chunk* chunk);
+
+#endif
@@ -1,21 +1,35 @@
 #include <stdarg.h>
 #include <stdio.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "eventloop.h"
+#include "globals.h"
+#include "jit.h"
 #include "memory.h"
+#include "metrics.h"
+#include "natives.h"
+#include "trace.h"
 #include "vm.h"
 
-VM vm;
+_Thread_local VM vm;
+
+// The kept programs are released once they take more memory than this,
+// and than the VM's heap, so that releasing them is cheap on average.
+#define PROGRAMS_MIN (64 * 1024)
 
 static void resetStack()
 {
-    vm.stackTop = vm.stack;
+    vm.stackTop = vm.slots;
 }
 
-static void runtimeError(const char* format, ...)
+/**
+ * @brief Report an error in the instruction being executed.
+ */
+void runtimeError(const char* format, ...)
 {
     va_list args;
     va_start(args, format);
@@ -34,14 +48,51 @@ static void runtimeError(const char* format, ...)
 
 void initVM()
 {
+    vm.bytesAllocated = 0;
+    vm.heapLimit = 0;
+    vm.sharedHeapDepth = 0;
+    vm.outOfMemory = NULL;
+    vm.slots = vm.stack;
     resetStack();
+    vm.fiber = NULL;
+    vm.program = NULL;
+    vm.chunk = NULL;
     vm.objects = NULL;
+    vm.loop = NULL;
+    vm.actor = NULL;
+    vm.instructionLimit = 0;
+    vm.timeLimit = 0;
+    vm.instructions = 0;
+    vm.countedStrings = 0;
+    vm.countedStringCapacity = 0;
+    initValueArray(&vm.globals);
+    vm.programCount = 0;
+    vm.programCapacity = 0;
+    vm.programs = NULL;
+    vm.programBytes = 0;
     initTable(&vm.strings);
+    defineNatives();
 }
 
 void freeVM()
 {
-    freeTable(&vm.strings);
+    freeEventLoop();
+    for (int slot = 0; slot < vm.globals.count; slot++)
+    {
+        if (!IS_UNDEFINED(vm.globals.values[slot])) releaseGlobal(slot);
+    }
+    freeValueArray(&vm.globals);
+    for (int i = 0; i < vm.programCount; i++)
+    {
+        releaseProgram(vm.programs[i]);
+    }
+    FREE_ARRAY(Program*, vm.programs, vm.programCapacity);
+    vm.programCount = 0;
+    vm.programCapacity = 0;
+    vm.programs = NULL;
+    vm.programBytes = 0;
+    releaseStringTable(&vm.strings);
+    publishMetrics();
     freeObjects();
 }
 
@@ -62,6 +113,74 @@ static Value peek(int distance)
     return *(vm.stackTop - 1 - distance);
 }
 
+/**
+ * @brief Call the value below a number of arguments on the stack,
+ * replacing it and the arguments with the result.
+ * @return False after reporting a runtime error.
+ */
+static bool callValue(int argCount)
+{
+    Value callee = peek(argCount);
+    if (!IS_NATIVE(callee))
+    {
+        runtimeError("Can only call functions and classes.");
+        return false;
+    }
+
+    ObjNative* native = AS_NATIVE(callee);
+    if (argCount != native->arity)
+    {
+        runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+        return false;
+    }
+
+    Value result;
+    if (!native->function(argCount, vm.stackTop - argCount, &result)) return false;
+
+    vm.stackTop -= argCount + 1;
+    push(result);
+    return true;
+}
+
+/**
+ * @brief Check the operands of an indexing instruction, a list
+ * or an array and an index into it.
+ * @param distance How far below the stack top the list or array is.
+ * @return False after reporting a runtime error.
+ */
+static bool indexOperands(int distance, int32_t* index)
+{
+    Value target = peek(distance);
+    int count;
+    if (IS_LIST(target))
+    {
+        count = AS_LIST(target)->elements.count;
+    }
+    else if (IS_ARRAY(target))
+    {
+        count = AS_ARRAY(target)->count;
+    }
+    else
+    {
+        runtimeError("Can only index lists and arrays.");
+        return false;
+    }
+
+    if (!asIndex(peek(distance - 1), index))
+    {
+        runtimeError("Index must be an integer.");
+        return false;
+    }
+
+    if (*index < 0 || *index >= count)
+    {
+        runtimeError("Index out of range.");
+        return false;
+    }
+
+    return true;
+}
+
 static bool isFalsey(Value value)
 {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
@@ -82,26 +201,199 @@ static void concatenate()
     push(OBJ_VAL(result));
 }
 
-static InterpretResult run()
+/**
+ * @brief Replace the top count values on the stack with their sum,
+ * the same as adding them from left to right. Strings are joined
+ * into one new string, without any intermediate ones.
+ * @return False if the values are not all numbers or all strings.
+ */
+static bool concatenateN(int count)
+{
+    Value* values = vm.stackTop - count;
+    bool strings = true;
+    bool numbers = true;
+    int length = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (IS_STRING(values[i]))
+        {
+            length += AS_STRING(values[i])->length;
+        }
+        else
+        {
+            strings = false;
+        }
+        numbers = numbers && IS_NUMBER(values[i]);
+    }
+
+    Value result;
+    if (strings)
+    {
+        char* chars = ALLOCATE(char, length + 1);
+        char* end = chars;
+        for (int i = 0; i < count; i++)
+        {
+            ObjString* string = AS_STRING(values[i]);
+            memcpy(end, string->chars, string->length);
+            end += string->length;
+        }
+        *end = '\0';
+        result = OBJ_VAL(takeString(chars, length));
+    }
+    else if (numbers)
+    {
+        result = values[0];
+        for (int i = 1; i < count; i++)
+        {
+            int32_t sum;
+            if (IS_INT(result) && IS_INT(values[i]) &&
+                addInts(AS_INT(result), AS_INT(values[i]), &sum))
+            {
+                result = INT_VAL(sum);
+            }
+            else
+            {
+                result = NUMBER_VAL(AS_NUMBER(result) + AS_NUMBER(values[i]));
+            }
+        }
+    }
+    else
+    {
+        return false;
+    }
+
+    vm.stackTop = values;
+    push(result);
+    return true;
+}
+
+/**
+ * @brief Get the time in microseconds, from an arbitrary starting point.
+ */
+static uint64_t now()
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t)time.tv_sec * 1000000 + time.tv_nsec / 1000;
+}
+
+/**
+ * @brief Start a slice of the running program, with a fresh budget.
+ */
+static void startSlice()
+{
+    vm.budget = vm.instructionLimit > 0 ? vm.instructionLimit : INT64_MAX;
+    vm.budgetMark = vm.ip;
+    vm.deadline = vm.timeLimit > 0 ? now() + vm.timeLimit : 0;
+}
+
+/**
+ * @brief Count the script's instructions since they were last counted,
+ * and check if the slice is over.
+ * Each instruction takes at least a byte, so the bytes run are counted
+ * instead, which may end the slice early but never late.
+ */
+static bool sliceOver()
+{
+    vm.budget -= vm.ip - vm.budgetMark;
+    vm.budgetMark = vm.ip;
+    return vm.budget <= 0 || (vm.deadline != 0 && now() >= vm.deadline);
+}
+
+/**
+ * @brief Execute instructions starting at vm.ip.
+ * @param singleInstruction If true, return after one instruction
+ * instead of running until the chunk returns.
+ */
+static inline __attribute__((always_inline)) InterpretResult execute(bool singleInstruction)
 {
 #define READ_BYTE() (*(vm.ip)++)
+// Opcodes may be quickened by VMs on other threads, so they are read atomically.
+#define READ_OPCODE() __atomic_load_n(vm.ip++, __ATOMIC_RELAXED)
+#define READ_SHORT() (vm.ip += 2, (uint16_t)((vm.ip[-2] << 8) | vm.ip[-1]))
 #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-#define BINARY_OP(valueType, op) \
+// Rewrite the current instruction into an equivalent one.
+#define QUICKEN(opcode) __atomic_store_n(vm.ip - 1, (uint8_t)(opcode), __ATOMIC_RELAXED)
+// Rewrite the current instruction back to its generic form and run that instead.
+#define DEOPTIMIZE(opcode) \
+    do { \
+        QUICKEN(opcode); \
+        vm.ip--; \
+    } while (false)
+#define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
+// Replace two numbers on the stack with the result of an arithmetic operator,
+// computed with small integers when both are ones and the result fits.
+#define ARITHMETIC(intOp, op) \
+    do { \
+        Value b = vm.stackTop[-1]; \
+        Value a = vm.stackTop[-2]; \
+        int32_t result; \
+        if (IS_INT(a) && IS_INT(b) && intOp(AS_INT(a), AS_INT(b), &result)) { \
+            vm.stackTop[-2] = INT_VAL(result); \
+        } else { \
+            vm.stackTop[-2] = NUMBER_VAL(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+        vm.stackTop--; \
+    } while (false)
+// Replace two numbers on the stack with the result of a comparison.
+#define COMPARISON(valueType, op) \
+    do { \
+        Value b = vm.stackTop[-1]; \
+        Value a = vm.stackTop[-2]; \
+        if (IS_INT(a) && IS_INT(b)) { \
+            vm.stackTop[-2] = valueType(AS_INT(a) op AS_INT(b)); \
+        } else { \
+            vm.stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } \
+        vm.stackTop--; \
+    } while (false)
+#define BINARY_OP(operation, intQuickened, quickened) \
     do { \
         if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
             runtimeError("Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        QUICKEN(IS_INT(peek(0)) && IS_INT(peek(1)) ? (intQuickened) : (quickened)); \
+        operation; \
+    } while (false)
+// Two doubles are the expected case, so they are checked for first.
+#define NUMBER_OP(valueType, op, operation, generic) \
+    do { \
+        Value b = vm.stackTop[-1]; \
+        Value a = vm.stackTop[-2]; \
+        if (IS_DOUBLE(a) && IS_DOUBLE(b)) { \
+            vm.stackTop[-2] = valueType(a.as.number op b.as.number); \
+            vm.stackTop--; \
+        } else if (IS_NUMBER(a) && IS_NUMBER(b)) { \
+            operation; \
+        } else { \
+            DEOPTIMIZE(generic); \
+        } \
+    } while (false)
+// Return to the embedder if the slice is over. This is only checked after
+// calls, the only instructions which take more than a moment, and only in the
+// script itself, as fibers run on the C stack of the code resuming them.
+#define SAFEPOINT() \
+    do { \
+        if (!singleInstruction && vm.fiber == NULL && sliceOver()) return INTERPRET_YIELDED; \
+    } while (false)
+#define INT_OP(operation, generic) \
+    do { \
+        if (!IS_INT(peek(0)) || !IS_INT(peek(1))) { \
+            DEOPTIMIZE(generic); \
+            break; \
+        } \
+        operation; \
     } while (false)
 
     while (true)
     {
+        uint8_t* instructionStart = vm.ip;
+        vm.instructions++;
+
 #ifdef DEBUG_TRACE_EXECUTION
         printf("          ");
-        for (Value* slot = vm.stack; slot < vm.stackTop; slot++)
+        for (Value* slot = vm.slots; slot < vm.stackTop; slot++)
         {
             printf("[ ");
             printValue(*slot);
@@ -112,34 +404,98 @@ static InterpretResult run()
         disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code), -1);
 #endif
 
-        uint8_t instruction = READ_BYTE();
+        uint8_t instruction = READ_OPCODE();
         switch (instruction)
         {
         case OP_CONSTANT: push(READ_CONSTANT());    break;
+        case OP_INT8:     push(INT_VAL(READ_BYTE())); break;
+        case OP_INT16:    push(INT_VAL(READ_SHORT())); break;
         case OP_NIL:      push(NIL_VAL);            break;
         case OP_TRUE:     push(BOOL_VAL(true));     break;
         case OP_FALSE:    push(BOOL_VAL(false));    break;
         case OP_POP:      pop();                    break;
+        case OP_POPN:     vm.stackTop -= READ_BYTE(); break;
+
+        case OP_GET_LOCAL:
+            push(vm.slots[READ_BYTE()]);
+            break;
+
+        case OP_SET_LOCAL:
+            vm.slots[READ_BYTE()] = peek(0);
+            break;
+
+        case OP_DEFINE_GLOBAL:
+            defineGlobal(READ_SHORT(), pop());
+            break;
+
+        case OP_GET_GLOBAL:
+        {
+            uint16_t slot = READ_SHORT();
+            Value value = vm.globals.values[slot];
+            if (IS_UNDEFINED(value))
+            {
+                runtimeError("Undefined variable '%s'.", globalName(slot));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            push(value);
+            break;
+        }
+
+        case OP_SET_GLOBAL:
+        {
+            // Assignment does not define a variable.
+            uint16_t slot = READ_SHORT();
+            if (IS_UNDEFINED(vm.globals.values[slot]))
+            {
+                runtimeError("Undefined variable '%s'.", globalName(slot));
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.globals.values[slot] = peek(0);
+            break;
+        }
         
         case OP_EQUAL:
+        {
             Value b = pop();
             Value a = pop();
             push(BOOL_VAL(valuesEqual(a, b)));
             break;
+        }
 
-        case OP_GREATER:  BINARY_OP(BOOL_VAL, >);   break;
-        case OP_LESS:     BINARY_OP(BOOL_VAL, <);   break;
+        case OP_NOT_EQUAL:
+        {
+            Value b = pop();
+            Value a = pop();
+            push(BOOL_VAL(!valuesEqual(a, b)));
+            break;
+        }
+
+        // The fused comparisons are negations, like the
+        // instruction pairs they replace (which matters for NaN).
+        case OP_GREATER:
+            BINARY_OP(COMPARISON(BOOL_VAL, >), OP_GREATER_INT, OP_GREATER_NUM);
+            break;
+        case OP_GREATER_EQUAL:
+            BINARY_OP(COMPARISON(NOT_BOOL_VAL, <), OP_GREATER_EQUAL_INT, OP_GREATER_EQUAL_NUM);
+            break;
+        case OP_LESS:
+            BINARY_OP(COMPARISON(BOOL_VAL, <), OP_LESS_INT, OP_LESS_NUM);
+            break;
+        case OP_LESS_EQUAL:
+            BINARY_OP(COMPARISON(NOT_BOOL_VAL, >), OP_LESS_EQUAL_INT, OP_LESS_EQUAL_NUM);
+            break;
 
         case OP_ADD:
+        case OP_ADD_ANY:
             if (IS_STRING(peek(0)) && IS_STRING(peek(1)))
             {
+                if (instruction == OP_ADD) QUICKEN(OP_ADD_STR);
                 concatenate();
             }
             else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1)))
             {
-                double b = AS_NUMBER(pop());
-                double a = AS_NUMBER(pop());
-                push(NUMBER_VAL(a + b));
+                if (instruction == OP_ADD) QUICKEN(IS_INT(peek(0)) && IS_INT(peek(1)) ? OP_ADD_INT : OP_ADD_NUM);
+                ARITHMETIC(addInts, +);
             }
             else
             {
@@ -148,22 +504,131 @@ static InterpretResult run()
             }
             break;
         
-        case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-        case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-        case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /); break;
+        case OP_CONCAT_N:
+            if (!concatenateN(READ_BYTE()))
+            {
+                runtimeError("Operands must be two numbers or two strings.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            break;
+
+        case OP_SUBTRACT:
+            BINARY_OP(ARITHMETIC(subtractInts, -), OP_SUBTRACT_INT, OP_SUBTRACT_NUM);
+            break;
+        case OP_MULTIPLY:
+            BINARY_OP(ARITHMETIC(multiplyInts, *), OP_MULTIPLY_INT, OP_MULTIPLY_NUM);
+            break;
+        // Quotients of integers are rarely integers, so they are left to OP_DIVIDE_NUM.
+        case OP_DIVIDE:
+            BINARY_OP(ARITHMETIC(divideInts, /), OP_DIVIDE_NUM, OP_DIVIDE_NUM);
+            break;
+
+        case OP_CALL:
+            if (!callValue(READ_BYTE())) return INTERPRET_RUNTIME_ERROR;
+            // The call's result is left in place until the fiber is resumed.
+            if (vm.fiber != NULL && vm.fiber->state == FIBER_WAITING) return INTERPRET_OK;
+            if (metricsEnabled) publishMetrics();
+            SAFEPOINT();
+            break;
+
+        case OP_BUILD_LIST:
+        {
+            int count = READ_BYTE();
+            ObjList* list = newList();
+            for (int i = count; i > 0; i--)
+            {
+                writeValueArray(&list->elements, peek(i - 1));
+            }
+            vm.stackTop -= count;
+            push(OBJ_VAL(list));
+            break;
+        }
+
+        case OP_GET_INDEX:
+        {
+            int32_t index;
+            if (!indexOperands(1, &index)) return INTERPRET_RUNTIME_ERROR;
+            Value target = peek(1);
+            vm.stackTop -= 2;
+            if (IS_LIST(target))
+            {
+                push(AS_LIST(target)->elements.values[index]);
+            }
+            else
+            {
+                push(NUMBER_VAL(AS_ARRAY(target)->values[index]));
+            }
+            break;
+        }
+
+        case OP_SET_INDEX:
+        {
+            int32_t index;
+            if (!indexOperands(2, &index)) return INTERPRET_RUNTIME_ERROR;
+            Value target = peek(2);
+            Value value = peek(0);
+            if (IS_LIST(target))
+            {
+                AS_LIST(target)->elements.values[index] = value;
+            }
+            else if (IS_NUMBER(value))
+            {
+                AS_ARRAY(target)->values[index] = AS_NUMBER(value);
+            }
+            else
+            {
+                runtimeError("Array elements must be numbers.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+            vm.stackTop -= 3;
+            push(value);
+            break;
+        }
+
+        case OP_FIBER:
+        {
+            // The body follows, to be run by the fiber and skipped here.
+            uint16_t bodySize = READ_SHORT();
+            push(OBJ_VAL(newFiber(vm.program, vm.ip)));
+            vm.ip += bodySize;
+            // The body is not run here, so it does not count against the budget.
+            if (vm.fiber == NULL) vm.budgetMark += bodySize;
+            break;
+        }
+
+        // Both leave the value for resumeFiber() on the fiber's stack.
+        // They, and native calls which make the fiber wait, are the only
+        // ways for the interpreter to return to a fiber's resumer.
+        case OP_YIELD:
+            return INTERPRET_OK;
+        case OP_END_FIBER:
+            push(NIL_VAL);
+            return INTERPRET_OK;
 
         case OP_NOT:
             push(BOOL_VAL(isFalsey(pop())));
             break;
         
         case OP_NEGATE:
+        {
             if (!IS_NUMBER(peek(0)))
             {
                 runtimeError("Operand must be a number.");
                 return INTERPRET_RUNTIME_ERROR;
             }
-            push(NUMBER_VAL(-AS_NUMBER(pop())));
+
+            Value value = pop();
+            int32_t result;
+            if (IS_INT(value) && negateInt(AS_INT(value), &result))
+            {
+                push(INT_VAL(result));
+            }
+            else
+            {
+                push(NUMBER_VAL(-AS_NUMBER(value)));
+            }
             break;
+        }
         
         case OP_PRINT:
             printValue(pop());
@@ -173,34 +638,484 @@ static InterpretResult run()
         case OP_RETURN:
             // Exit interpreter.
             return INTERPRET_OK;
+
+        case OP_GREATER_NUM:
+            NUMBER_OP(BOOL_VAL, >, COMPARISON(BOOL_VAL, >), OP_GREATER);
+            break;
+        case OP_GREATER_EQUAL_NUM:
+            NUMBER_OP(NOT_BOOL_VAL, <, COMPARISON(NOT_BOOL_VAL, <), OP_GREATER_EQUAL);
+            break;
+        case OP_LESS_NUM:
+            NUMBER_OP(BOOL_VAL, <, COMPARISON(BOOL_VAL, <), OP_LESS);
+            break;
+        case OP_LESS_EQUAL_NUM:
+            NUMBER_OP(NOT_BOOL_VAL, >, COMPARISON(NOT_BOOL_VAL, >), OP_LESS_EQUAL);
+            break;
+        case OP_ADD_NUM:
+            NUMBER_OP(NUMBER_VAL, +, ARITHMETIC(addInts, +), OP_ADD_ANY);
+            break;
+        case OP_SUBTRACT_NUM:
+            NUMBER_OP(NUMBER_VAL, -, ARITHMETIC(subtractInts, -), OP_SUBTRACT);
+            break;
+        case OP_MULTIPLY_NUM:
+            NUMBER_OP(NUMBER_VAL, *, ARITHMETIC(multiplyInts, *), OP_MULTIPLY);
+            break;
+        case OP_DIVIDE_NUM:
+            NUMBER_OP(NUMBER_VAL, /, ARITHMETIC(divideInts, /), OP_DIVIDE);
+            break;
+
+        case OP_GREATER_INT:       INT_OP(COMPARISON(BOOL_VAL, >), OP_GREATER);           break;
+        case OP_GREATER_EQUAL_INT: INT_OP(COMPARISON(NOT_BOOL_VAL, <), OP_GREATER_EQUAL); break;
+        case OP_LESS_INT:          INT_OP(COMPARISON(BOOL_VAL, <), OP_LESS);              break;
+        case OP_LESS_EQUAL_INT:    INT_OP(COMPARISON(NOT_BOOL_VAL, >), OP_LESS_EQUAL);    break;
+        case OP_ADD_INT:           INT_OP(ARITHMETIC(addInts, +), OP_ADD);                break;
+        case OP_SUBTRACT_INT:      INT_OP(ARITHMETIC(subtractInts, -), OP_SUBTRACT);      break;
+        case OP_MULTIPLY_INT:      INT_OP(ARITHMETIC(multiplyInts, *), OP_MULTIPLY);      break;
+
+        case OP_ADD_STR:
+            if (!IS_STRING(peek(0)) || !IS_STRING(peek(1)))
+            {
+                DEOPTIMIZE(OP_ADD_ANY);
+                break;
+            }
+            concatenate();
+            break;
         }
+
+        // A deoptimized instruction has not run yet, so it does not count.
+        if (singleInstruction && vm.ip != instructionStart) return INTERPRET_OK;
     }
 
 #undef READ_BYTE
+#undef READ_OPCODE
+#undef READ_SHORT
 #undef READ_CONSTANT
+#undef QUICKEN
+#undef DEOPTIMIZE
+#undef NOT_BOOL_VAL
+#undef ARITHMETIC
+#undef COMPARISON
 #undef BINARY_OP
+#undef NUMBER_OP
+#undef INT_OP
+#undef SAFEPOINT
 }
 
-InterpretResult interpret(const char* source)
+/**
+ * @brief Run the current chunk until it returns.
+ */
+static InterpretResult run()
+{
+    return execute(false);
+}
+
+/**
+ * @brief Execute the single instruction at an offset in the current chunk.
+ * Compiled code calls this for the instructions it does not implement itself.
+ */
+InterpretResult runInstruction(int offset)
 {
-    // Compile the source into a chunk.
-    Chunk chunk;
-    initChunk(&chunk);
-    
-    if (!compile(source, &chunk))
+    vm.ip = vm.chunk->code + offset;
+    return execute(true);
+}
+
+/**
+ * @brief Run a fiber on this thread's VM until it yields, waits or finishes.
+ * The running code is suspended meanwhile, and continues on its own
+ * stack afterwards, so fibers can resume other fibers.
+ * @param result Where to store the yielded value, or nil if the
+ * fiber is waiting or has finished.
+ * @return False after reporting a runtime error. The fiber
+ * can then not be resumed again.
+ */
+bool resumeFiber(ObjFiber* fiber, Value* result)
+{
+    switch (fiber->state)
     {
-        // A compile error was found.
-        freeChunk(&chunk);
-        return INTERPRET_COMPILE_ERROR;
+    case FIBER_RUNNING:
+        runtimeError("Can't resume a running fiber.");
+        return false;
+    case FIBER_WAITING:
+        runtimeError("Can't resume a waiting fiber.");
+        return false;
+    case FIBER_DONE:
+        runtimeError("Can't resume a finished fiber.");
+        return false;
+    case FIBER_SUSPENDED:
+        break;
     }
 
-    // Interpret the chunk.
-    vm.chunk = &chunk;
-    vm.ip = vm.chunk->code;
+    Program* program = vm.program;
+    Chunk* chunk = vm.chunk;
+    uint8_t* ip = vm.ip;
+    Value* slots = vm.slots;
+    Value* stackTop = vm.stackTop;
+    ObjFiber* resumer = vm.fiber;
+
+    vm.program = fiber->program;
+    vm.chunk = fiber->chunk;
+    vm.ip = fiber->ip;
+    vm.slots = fiber->stack;
+    vm.stackTop = fiber->stackTop;
+    vm.fiber = fiber;
+    fiber->state = FIBER_RUNNING;
+
+    InterpretResult status = run();
+    if (status == INTERPRET_OK)
+    {
+        if (fiber->state == FIBER_WAITING)
+        {
+            *result = NIL_VAL;
+        }
+        else
+        {
+            *result = pop();
+            fiber->state = vm.ip[-1] == OP_END_FIBER ? FIBER_DONE : FIBER_SUSPENDED;
+        }
+        fiber->ip = vm.ip;
+        fiber->stackTop = vm.stackTop;
+    }
+    else
+    {
+        fiber->state = FIBER_DONE;
+    }
+
+    vm.program = program;
+    vm.chunk = chunk;
+    vm.ip = ip;
+    vm.slots = slots;
+    vm.stackTop = stackTop;
+    vm.fiber = resumer;
+
+    // The error unwinds the code which resumed the fiber too.
+    if (status != INTERPRET_OK) resetStack();
+    return status == INTERPRET_OK;
+}
+
+/**
+ * @brief Make sure a value does not refer to a constant of a program,
+ * by taking the VM's own reference to it if it is a string.
+ */
+static void retainValue(Value value)
+{
+    if (!IS_STRING(value)) return;
+
+    Value unused;
+    if (tableGet(&vm.strings, value, &unused)) return;
+
+    tableReserve(&vm.strings);
+    retainSharedString(AS_STRING(value));
+    tableSet(&vm.strings, value, NIL_VAL);
+}
+
+/**
+ * @brief Make sure none of the values an object holds refers to a constant of a program.
+ */
+static void retainObjectValues(Obj* object)
+{
+    switch (object->type)
+    {
+    case OBJ_LIST:
+    {
+        ValueArray* elements = &((ObjList*)object)->elements;
+        for (int i = 0; i < elements->count; i++) retainValue(elements->values[i]);
+        break;
+    }
+    case OBJ_MAP:
+    {
+        Table* table = &((ObjMap*)object)->table;
+        for (int i = 0; i < table->capacity; i++)
+        {
+            Entry* entry = &table->entries[i];
+            if (IS_UNDEFINED(entry->key)) continue;
+            retainValue(entry->key);
+            retainValue(entry->value);
+        }
+        break;
+    }
+    case OBJ_FIBER:
+    {
+        ObjFiber* fiber = (ObjFiber*)object;
+        for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) retainValue(*slot);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Release the programs the VM kept. Values the VM made may still
+ * be constant strings of those programs, so it first takes its own
+ * references to every string it can reach.
+ */
+static void releasePrograms()
+{
+    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) retainValue(*slot);
+    for (int i = 0; i < vm.globals.count; i++) retainValue(vm.globals.values[i]);
+    for (Obj* object = vm.objects; object != NULL; object = object->next)
+    {
+        retainObjectValues(object);
+    }
+    retainLoopValues(retainValue);
+
+    for (int i = 0; i < vm.programCount; i++)
+    {
+        releaseProgram(vm.programs[i]);
+    }
+    vm.programCount = 0;
+    vm.programBytes = 0;
+}
+
+/**
+ * @brief Keep a program alive for as long as values the VM made may
+ * refer to its constants. Programs are only kept for a while, and
+ * released together once they take up too much memory. Fibers hold
+ * the programs they run themselves.
+ */
+static void keepProgram(Program* program)
+{
+    if (vm.programCount > 0 && vm.programs[vm.programCount - 1] == program) return;
+
+    size_t limit = vm.bytesAllocated > PROGRAMS_MIN ? vm.bytesAllocated : PROGRAMS_MIN;
+    if (vm.programBytes > limit) releasePrograms();
+
+    if (vm.programCount == vm.programCapacity)
+    {
+        int oldCapacity = vm.programCapacity;
+        int capacity = GROW_CAPACITY(oldCapacity);
+        vm.programs = GROW_ARRAY(Program*, vm.programs, oldCapacity, capacity);
+        vm.programCapacity = capacity;
+    }
+
+    vm.programs[vm.programCount] = retainProgram(program);
+    vm.programCount++;
+    vm.programBytes += program->size;
+}
+
+/**
+ * @brief Make room for every global slot handed out so far.
+ * New slots hold no value until they are defined.
+ */
+static void growGlobals()
+{
+    int count = globalCount();
+    while (vm.globals.count < count)
+    {
+        writeValueArray(&vm.globals, UNDEFINED_VAL);
+    }
+}
+
+/**
+ * @brief Define a global variable holding a native function.
+ * @param name The function's name, which must outlive the VM.
+ */
+void defineNative(const char* name, int arity, NativeFn function)
+{
+    beginResolvingGlobals();
+    int slot = resolveGlobal(name, (int)strlen(name));
+    growGlobals();
+    defineGlobal(slot, OBJ_VAL(newNative(function, arity, name)));
+    endResolvingGlobals();
+}
+
+/**
+ * @brief Set the value of a global variable, defining it.
+ * The VM holds a reference to each slot it has defined.
+ */
+void defineGlobal(int slot, Value value)
+{
+    if (IS_UNDEFINED(vm.globals.values[slot])) retainGlobal(slot);
+    vm.globals.values[slot] = value;
+}
+
+/**
+ * @brief Prepare this thread's VM to run code of a program,
+ * keeping the program alive and making room for its globals.
+ */
+void loadProgram(Program* program)
+{
+    keepProgram(program);
+    growGlobals();
+}
+
+/**
+ * @brief Run a slice of a program, unwinding back here
+ * if it reaches the heap limit.
+ * @param program The program to load and start, or NULL to continue the loaded one.
+ * @param code Code that behaves like the chunk, or NULL to interpret the chunk.
+ */
+static InterpretResult runSlice(Program* program, CompiledCode code)
+{
+    jmp_buf handler;
+    jmp_buf* enclosing = vm.outOfMemory;
+    InterpretResult result;
+    uint64_t start = traceStart();
+
+    if (setjmp(handler) == 0)
+    {
+        vm.outOfMemory = &handler;
+
+        // Loading allocates, so it happens under the handler too.
+        if (program != NULL)
+        {
+            loadProgram(program);
+            vm.program = program;
+            vm.chunk = &program->chunk;
+            vm.ip = vm.chunk->code;
+        }
+
+        // The budget counts from where the slice starts, so only once vm.ip is set.
+        startSlice();
+        result = code != NULL ? code(&vm) : run();
+    }
+    else
+    {
+        // Any fibers being run were abandoned halfway, along with the script.
+        vm.slots = vm.stack;
+        vm.fiber = NULL;
+        resetStack();
+        result = INTERPRET_OUT_OF_MEMORY;
+    }
+    vm.outOfMemory = enclosing;
+    traceEnd("run", start);
+    publishMetrics();
+
+    // A program which yielded stays loaded, to be continued.
+    if (result != INTERPRET_YIELDED)
+    {
+        vm.program = NULL;
+        vm.chunk = NULL;
+    }
+    return result;
+}
+
+/**
+ * @brief Execute a program on this thread's VM with machine code for its chunk.
+ * Only its opcodes are written, by quickening, so it may be executing on
+ * other VMs at the same time.
+ * @param code Code that behaves like the chunk, or NULL to interpret the chunk.
+ */
+InterpretResult runCompiledProgram(Program* program, CompiledCode code)
+{
+    return runSlice(program, code);
+}
+
+/**
+ * @brief Limit how long programs run on this thread's VM before they yield,
+ * so that the embedder can run other work and continue them later.
+ * @param instructions How many instructions each slice may run for, or 0.
+ * @param microseconds How long each slice may run for, or 0.
+ */
+void setBudget(int64_t instructions, int64_t microseconds)
+{
+    vm.instructionLimit = instructions;
+    vm.timeLimit = microseconds;
+}
+
+/**
+ * @brief Run the next slice of the program which last yielded on this thread's VM.
+ */
+InterpretResult continueProgram()
+{
+    if (vm.program == NULL)
+    {
+        fprintf(stderr, "No program to continue.\n");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    return runSlice(NULL, NULL);
+}
+
+/**
+ * @brief Limit the memory this thread's VM may allocate for its heap.
+ * Reaching the limit is a runtime error, after which the VM can still be used.
+ * @param bytes The limit, or 0 for no limit.
+ */
+void setHeapLimit(size_t bytes)
+{
+    vm.heapLimit = bytes;
+}
+
+/**
+ * @brief Add what this thread's VM has done since it last did so
+ * to the metrics, if they are on. Instructions are counted by the VM
+ * itself, and only added now and then, as they are run so often.
+ */
+void publishMetrics()
+{
+    countInstructions(vm.instructions);
+    countStringTable(vm.strings.count - vm.countedStrings,
+                     vm.strings.capacity - vm.countedStringCapacity);
+    vm.instructions = 0;
+    vm.countedStrings = vm.strings.count;
+    vm.countedStringCapacity = vm.strings.capacity;
+}
+
+/**
+ * @brief Execute a compiled program on this thread's VM.
+ * Only its opcodes are written, by quickening, so it may be executing on
+ * other VMs at the same time.
+ */
+InterpretResult runProgram(Program* program)
+{
+    // Machine code can't stop halfway, so programs with a budget are interpreted.
+    bool budgeted = vm.instructionLimit > 0 || vm.timeLimit > 0;
+    bool jit = program->jit != NULL && jitEnabled() && !budgeted;
+    return runCompiledProgram(program, jit ? program->jit->entry : NULL);
+}
+
+static bool compileStreamBatch(Chunk* chunk, const void* context)
+{
+    (void)context;
+
+    return compileBatch(chunk);
+}
+
+/**
+ * @brief Compile a streamed source and execute it once, running each batch
+ * of statements as soon as it is compiled. Each batch is a program of its
+ * own, which the VM keeps only for a while after it has run, so constants
+ * used only by batches that are done with are freed along with them.
+ * Batches run to completion, even if the VM has a budget.
+ */
+InterpretResult interpretStream(SourceReader read, void* context)
+{
+    countScript();
+    beginStream(read, context);
+
+    InterpretResult result = INTERPRET_OK;
+    bool ended = false;
+    while (!ended && result == INTERPRET_OK)
+    {
+        Program* batch = buildProgram(compileStreamBatch, NULL);
+        if (batch == NULL)
+        {
+            result = INTERPRET_COMPILE_ERROR;
+            break;
+        }
+
+        ended = streamEnded();
+        result = runProgram(batch);
+        while (result == INTERPRET_YIELDED) result = continueProgram();
+        releaseProgram(batch);
+    }
+
+    endStream();
+    return result;
+}
+
+/**
+ * @brief Compile source and execute it once.
+ */
+InterpretResult interpret(const char* source)
+{
+    countScript();
+    Program* program = compileProgram(source);
+    if (program == NULL) return INTERPRET_COMPILE_ERROR;
 
-    InterpretResult result = run();
+    InterpretResult result = runProgram(program);
 
-    // Clean up and return OK signal.
-    freeChunk(&chunk);
-    return INTERPRET_OK;
+    releaseProgram(program);
+    return result;
 }
@@ -1,35 +1,113 @@
 #ifndef CLOX_VM_H
 #define CLOX_VM_H
 
+#include <setjmp.h>
+
 #include "chunk.h"
+#include "intern.h"
 #include "object.h"
+#include "program.h"
+#include "scanner.h"
 #include "table.h"
 #include "value.h"
 
 #define STACK_MAX 256
 
+/**
+ * @brief A virtual machine.
+ * @param slots The bottom of the stack being run on, where local
+ * variables start: the VM's own stack, or a fiber's.
+ * @param fiber The running fiber, or NULL when running the script itself.
+ * @param globals The values of global variables, indexed by slot.
+ * @param programs The programs the VM has run lately, as values it
+ * made may refer to their constants, and programBytes roughly how
+ * much memory they take.
+ * @param loop The event loop, created when it is first used.
+ * @param actor The actor whose VM this is, if it is one. Otherwise the
+ * actor standing for the thread, created when it is first needed.
+ * @param instructionLimit, timeLimit How many instructions, and how many
+ * microseconds, each slice of a program may run for. 0 means no limit.
+ * @param budget The instructions left in the current slice, and
+ * budgetMark where the script was when they were last counted.
+ * @param deadline When the current slice ends, in microseconds, or 0.
+ * @param bytesAllocated The memory the VM's heap takes, and heapLimit
+ * how much it may take, or 0 for no limit.
+ * @param sharedHeapDepth How many times the VM has entered the shared heap,
+ * where the memory allocated belongs to no VM and is not counted.
+ * @param outOfMemory Where to unwind to when the heap limit is reached,
+ * or NULL to exit the process.
+ * @param instructions How many instructions the VM has run since they
+ * were last added to the metrics, and countedStrings, countedStringCapacity
+ * the size of its table of interned strings as the metrics last saw it.
+ */
 typedef struct 
 {
+    Program* program;
     Chunk* chunk;
     uint8_t* ip;
     Value stack[STACK_MAX];
+    Value* slots;
     Value* stackTop;
+    ObjFiber* fiber;
+    ValueArray globals;
+    int programCount;
+    int programCapacity;
+    Program** programs;
+    size_t programBytes;
     Table strings;
     Obj* objects;
+    struct EventLoop* loop;
+    struct Actor* actor;
+    int64_t instructionLimit;
+    int64_t timeLimit;
+    int64_t budget;
+    uint8_t* budgetMark;
+    uint64_t deadline;
+    size_t bytesAllocated;
+    size_t heapLimit;
+    int sharedHeapDepth;
+    jmp_buf* outOfMemory;
+    uint64_t instructions;
+    int countedStrings;
+    int countedStringCapacity;
 } VM;
 
 typedef enum
 {
     INTERPRET_OK,
     INTERPRET_COMPILE_ERROR,
-    INTERPRET_RUNTIME_ERROR
+    INTERPRET_RUNTIME_ERROR,
+    // A runtime error which left the VM as it was before the instruction.
+    INTERPRET_OUT_OF_MEMORY,
+    // The program ran out of its slice, and continueProgram() runs the next one.
+    INTERPRET_YIELDED
 } InterpretResult;
 
-extern VM vm;
+/**
+ * @brief Machine code for a chunk, which runs it on a VM like the interpreter would.
+ */
+typedef InterpretResult (*CompiledCode)(VM* vm);
+
+// Each thread has its own VM, so VMs on different threads
+// can run (shared) programs concurrently.
+extern _Thread_local VM vm;
 
 void initVM();
 void freeVM();
 InterpretResult interpret(const char* source);
+InterpretResult interpretStream(SourceReader read, void* context);
+void loadProgram(Program* program);
+InterpretResult runProgram(Program* program);
+InterpretResult runCompiledProgram(Program* program, CompiledCode code);
+InterpretResult runInstruction(int offset);
+void setBudget(int64_t instructions, int64_t microseconds);
+InterpretResult continueProgram();
+void setHeapLimit(size_t bytes);
+void publishMetrics();
+void runtimeError(const char* format, ...);
+void defineNative(const char* name, int arity, NativeFn function);
+void defineGlobal(int slot, Value value);
+bool resumeFiber(ObjFiber* fiber, Value* result);
 
 void push(Value value);
 Value pop();